@@ -0,0 +1,28 @@
+/**
+ * Samples the daemon writes out when run with -B, for wfbench.
+ *
+ * A run is a stream of fixed size records, one per pulse delivered and
+ * one per cutoff, with the totals for the run at the end.  Delivery is
+ * in simulated time, since how long a pulse sits in the ring scales
+ * with the flow, cutoff latency is in real time because it is only the
+ * loop's own work.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+enum bench_kind {
+  BENCH_DELIVERY, // Pulse timestamp to the loop picking it up, ns
+  BENCH_CUTOFF,   // Tripping pulse to the relay going low, ns
+  BENCH_LOOP_CPU, // CPU the main loop used over the run, ns
+  BENCH_PULSES    // Pulses counted over the run
+};
+
+struct bench_sample {
+  uint32_t kind;
+  uint32_t reserved;
+  int64_t value;
+};
+
+#endif
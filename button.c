@@ -0,0 +1,72 @@
+/**
+ * Debounced push buttons, see button.h.
+ */
+#include <string.h>
+#include "button.h"
+
+void
+btnInit(struct button * b, int pin) {
+  memset(b, 0, sizeof(*b));
+  b->pin = pin;
+}
+
+/**
+ * Note an edge at ts, safe from any thread.
+ */
+void
+btnEdge(struct button * b, int64_t ts) {
+  atomic_store_explicit(&b->edge, ts, memory_order_release);
+}
+
+/**
+ * See what the button has done by now, given whether it is down at the
+ * moment.  A change nobody stamped an edge for, because the button is
+ * being polled, starts the debounce just the same.
+ */
+int
+btnCheck(struct button * b, int64_t now, int pressed, int64_t debounce, int64_t long_press) {
+  int64_t edge = atomic_load_explicit(&b->edge, memory_order_acquire);
+  int event = BTN_NONE;
+
+  if (edge != b->seen) {
+    // Bouncing, so start again from the latest edge
+    b->seen = edge;
+    b->settle = edge + debounce;
+  } else if (!b->settle && pressed != b->pressed) {
+    b->settle = now + debounce;
+  }
+  if (b->settle && now >= b->settle) {
+    b->settle = 0;
+    if (pressed != b->pressed) {
+      b->pressed = pressed;
+      if (pressed) {
+        b->down = now;
+        b->long_done = 0;
+        if (!long_press) {
+          event = BTN_PRESS;
+        }
+      } else if (long_press && !b->long_done) {
+        event = BTN_PRESS;
+      }
+    }
+  }
+  if (long_press && b->pressed && !b->long_done && now - b->down >= long_press) {
+    b->long_done = 1;
+    event = BTN_LONG;
+  }
+  return event;
+}
+
+/**
+ * When the button next needs looking at, 0 if only an edge will do.
+ */
+int64_t
+btnNext(const struct button * b, int64_t long_press) {
+  if (b->settle) {
+    return b->settle;
+  }
+  if (long_press && b->pressed && !b->long_done) {
+    return b->down + long_press;
+  }
+  return 0;
+}
@@ -0,0 +1,42 @@
+/**
+ * Debounced push buttons.
+ *
+ * Edges are stamped as they come in, from an interrupt or whatever
+ * other thread sees them, and the main loop decides what they add up
+ * to: a button only counts as having moved once it has stayed put for
+ * the debounce time.  With long presses in use a short one counts when
+ * the button is let go and a long one as soon as it has been held long
+ * enough, otherwise a press counts as soon as it has settled.  Like
+ * flowrate.h nothing here knows about pins or clocks, the caller hands
+ * in times in ns and whether the button is down.
+ */
+#ifndef BUTTON_H
+#define BUTTON_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define BUTTON_DEBOUNCE 30 // ms, unless the config says otherwise
+
+enum btn_event {
+  BTN_NONE,
+  BTN_PRESS,  // Pressed and, with long presses in use, let go again
+  BTN_LONG    // Held down for the long press time
+};
+
+struct button {
+  int pin;
+  _Atomic int64_t edge;  // Latest edge, written by the edge thread
+  int64_t seen;          // Latest edge we have gone by
+  int64_t settle;        // When the button will have settled, 0 if it has
+  int64_t down;          // When it settled down
+  int pressed;           // Settled state
+  int long_done;         // This press has counted as a long one
+};
+
+void btnInit(struct button * b, int pin);
+void btnEdge(struct button * b, int64_t ts);
+int btnCheck(struct button * b, int64_t now, int pressed, int64_t debounce, int64_t long_press);
+int64_t btnNext(const struct button * b, int64_t long_press);
+
+#endif
@@ -0,0 +1,96 @@
+/**
+ * Meter calibration, see calibration.h.
+ *
+ * Between points the pulses per litre are taken to change in a straight
+ * line with the pulse rate, and beyond the ends to stay where the end
+ * point has them.  All the arithmetic is done here, when the table is
+ * built, never as pulses come in.
+ */
+#include <string.h>
+#include "calibration.h"
+
+#define NS 1000000000LL
+
+static uint32_t
+stepFor(double clicks_per_litre) {
+  return (uint32_t)((double)CAL_UL * (1 << CAL_FRAC) / clicks_per_litre + 0.5);
+}
+
+/**
+ * Fill in the table for a meter with n calibration points, or just the
+ * one clicks_per_litre if there are none.
+ */
+void
+calBuild(struct calibration * cal, int clicks_per_litre, const struct cal_point * points, int n) {
+  struct cal_point p[CAL_POINTS], t;
+  double freq[CAL_POINTS], f, lo, hi, cpl;
+  int b, i, j, top;
+
+  cal->idle = cal->most = stepFor(clicks_per_litre);
+  if (n <= 0) {
+    for (b = 0; b < CAL_BINS; b++) {
+      cal->step[b] = cal->idle;
+    }
+    return;
+  }
+  // Sorted by pulses a second, which is what the table goes by
+  memcpy(p, points, n * sizeof(*p));
+  for (i = 1; i < n; i++) {
+    for (j = i; j > 0 && p[j].rate * (double)p[j].clicks_per_litre < p[j - 1].rate * (double)p[j - 1].clicks_per_litre; j--) {
+      t = p[j];
+      p[j] = p[j - 1];
+      p[j - 1] = t;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    freq[i] = p[i].rate * (double)p[i].clicks_per_litre / 60;
+  }
+  for (b = 0; b < CAL_BINS; b++) {
+    // Middle of the gaps that land in this bin
+    top = b >> CAL_SUB;
+    if (top < CAL_SUB) {
+      lo = b ? b : 1;
+      hi = lo;
+    } else {
+      lo = (double)((1 << CAL_SUB) | (b & ((1 << CAL_SUB) - 1))) * (1ULL << (top - CAL_SUB));
+      hi = lo + (double)(1ULL << (top - CAL_SUB));
+    }
+    f = NS / ((lo + hi) / 2);
+    for (i = 0; i < n - 1 && f > freq[i + 1]; i++)
+      ;
+    if (f <= freq[0]) {
+      cpl = p[0].clicks_per_litre;
+    } else if (i == n - 1) {
+      cpl = p[n - 1].clicks_per_litre;
+    } else if (freq[i + 1] == freq[i]) {
+      cpl = p[i + 1].clicks_per_litre;
+    } else {
+      cpl = p[i].clicks_per_litre + (p[i + 1].clicks_per_litre - p[i].clicks_per_litre)
+        * (f - freq[i]) / (freq[i + 1] - freq[i]);
+    }
+    cal->step[b] = stepFor(cpl);
+    if (cal->step[b] > cal->most) {
+      cal->most = cal->step[b];
+    }
+  }
+}
+
+/**
+ * Gap between pulses in ns that a flow of rate litres a minute comes
+ * out at.  The step depends on the gap, so this settles on it over a
+ * few rounds rather than working it out at once.
+ */
+int64_t
+calRateGap(const struct calibration * cal, int rate) {
+  double gap, step = cal->idle;
+  int i;
+
+  if (rate <= 0) {
+    return 0;
+  }
+  for (i = 0; i < 4; i++) {
+    gap = step * 60.0 * NS / ((double)CAL_UL * (1 << CAL_FRAC) * rate);
+    step = calStep(cal, gap < 1 ? 1 : (int64_t)gap);
+  }
+  return gap;
+}
@@ -0,0 +1,73 @@
+/**
+ * Rate-dependent meter calibration.
+ *
+ * A meter's pulses per litre drift with the flow rate, so a zone can
+ * be given a few measured points of rate and pulses per litre.  These
+ * are worked out once into a table of the volume each pulse stands
+ * for, in fixed-point microlitres, indexed by the gap between pulses:
+ * the top bit of the gap picks an octave and the bits under it a
+ * step within it.  Turning a pulse into volume is then a shift, a
+ * table lookup and an add, with no division anywhere on the way.
+ */
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <stdint.h>
+
+#define CAL_POINTS 8              // Points a zone can be calibrated at
+#define CAL_FRAC 8                // Fraction bits in a step
+#define CAL_SUB 3                 // Steps per octave of gap, as bits
+#define CAL_BINS (64 << CAL_SUB)
+#define CAL_UL 1000000            // Microlitres in a litre, the unit volume is kept in
+
+struct cal_point {
+  int rate;               // Litres a minute
+  int clicks_per_litre;   // Measured at that rate
+};
+
+struct calibration {
+  uint32_t idle;            // Step before there is a rate to go by
+  uint32_t most;            // Largest step of all
+  uint32_t step[CAL_BINS];  // Microlitres per pulse << CAL_FRAC, by calBin()
+};
+
+void calBuild(struct calibration * cal, int clicks_per_litre, const struct cal_point * points, int n);
+int64_t calRateGap(const struct calibration * cal, int rate);
+
+/**
+ * Table index for a gap between pulses in ns.
+ */
+static inline int
+calBin(int64_t gap) {
+  int top = 63 - __builtin_clzll(gap);
+
+  if (top < CAL_SUB) {
+    return gap;
+  }
+  return (top << CAL_SUB) | ((gap >> (top - CAL_SUB)) & ((1 << CAL_SUB) - 1));
+}
+
+/**
+ * Volume of one pulse at the given gap, or before there is one.
+ */
+static inline uint32_t
+calStep(const struct calibration * cal, int64_t gap) {
+  return gap > 0 ? cal->step[calBin(gap)] : cal->idle;
+}
+
+/**
+ * Fewest pulses that could add up to volume microlitres, at least one,
+ * for knowing how long the loop can leave pulses waiting.
+ */
+static inline uint64_t
+calPulses(const struct calibration * cal, uint64_t volume) {
+  uint64_t n;
+
+  if (volume >= UINT64_MAX >> CAL_FRAC) {
+    return UINT64_MAX;
+  }
+  n = (volume << CAL_FRAC) / cal->most;
+  return n ? n : 1;
+}
+
+#endif
@@ -0,0 +1,328 @@
+/**
+ * Pulse capture, see capture.h.
+ *
+ * The loop fills one buffer while the writer thread has the other.
+ * Handing a full one over is a flag and a semaphore post, and if the
+ * writer still has the other one the pulses are only counted until
+ * there is room again.  A write that fails is given up on, as there is
+ * nowhere else for the buffer to go, and counted along with its error
+ * for the stats, as the capture has a gap there.  A capture file is only ever appended to, so a
+ * segment begun on a file with something in it is marked out from the
+ * records before it.
+ */
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+#define VARINT_MAX 10 // Bytes in the longest 64 bit varint
+
+static int cap_fd = -1;
+static unsigned char buf[2][CAPTURE_CHUNK];
+static int cur;             // Buffer the loop is filling
+static size_t fill;         // Bytes in it so far
+static size_t out_len;      // Bytes in the other one, for the writer
+static atomic_int busy;     // The writer has the other one
+static sem_t write_sem;
+static pthread_t write_thread;
+static int stopping = 0;
+static int64_t last[MAX_ZONES];
+static uint64_t lost[MAX_ZONES]; // Pulses that found no room
+static atomic_uint failed;       // Buffers, or what was left of them, not written
+static atomic_int failed_errno;
+
+static void
+writeAll(const unsigned char * p, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(cap_fd, p, len)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      atomic_store_explicit(&failed_errno, errno, memory_order_relaxed);
+      atomic_fetch_add_explicit(&failed, 1, memory_order_release);
+      return;
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static void *
+writeThreadMain(void * arg) {
+  while (1) {
+    while (sem_wait(&write_sem) < 0 && errno == EINTR)
+      ;
+    if (atomic_load_explicit(&busy, memory_order_acquire)) {
+      writeAll(buf[!cur], out_len);
+      atomic_store_explicit(&busy, 0, memory_order_release);
+    }
+    if (stopping) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Give the buffer being filled to the writer, returns -1 if it still
+ * has the other one.
+ */
+static int
+handOff(void) {
+  if (fill == 0) {
+    return 0;
+  }
+  if (atomic_load_explicit(&busy, memory_order_acquire)) {
+    return -1;
+  }
+  out_len = fill;
+  cur = !cur;
+  fill = 0;
+  atomic_store_explicit(&busy, 1, memory_order_release);
+  sem_post(&write_sem);
+  return 0;
+}
+
+/**
+ * Add a record, returns -1 if there is no room for it.
+ */
+static int
+put(uint64_t v) {
+  unsigned char * p;
+
+  if (fill + VARINT_MAX > CAPTURE_CHUNK && handOff() < 0) {
+    return -1;
+  }
+  p = buf[cur] + fill;
+  while (v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  fill = p - buf[cur];
+  return 0;
+}
+
+/**
+ * Write down any pulses that have been waiting for room.
+ */
+static void
+putLost(void) {
+  int z;
+
+  for (z = 0; z < MAX_ZONES; z++) {
+    if (lost[z] && put(lost[z] << CAPTURE_SHIFT | (CAPTURE_DROPPED + z)) == 0) {
+      lost[z] = 0;
+    }
+  }
+}
+
+/**
+ * Start a segment at the end of path for zones, with the clocks the
+ * pulses will be going by.
+ */
+int
+captureOpen(const char * path, int zones, int64_t realtime, int64_t monotonic) {
+  struct capture_header hdr;
+  struct stat st;
+  char dir[256];
+  int z, err;
+
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = 0;
+  mkdir(dirname(dir), 0755);
+  if ((cap_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+    return -1;
+  }
+  if (fstat(cap_fd, &st) < 0) {
+    goto fail;
+  }
+  cur = 0;
+  fill = 0;
+  atomic_store(&busy, 0);
+  stopping = 0;
+  if (st.st_size > 0) {
+    put(CAPTURE_SEGMENT);
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CAPTURE_MAGIC;
+  hdr.version = 1;
+  hdr.zones = zones;
+  hdr.realtime = realtime;
+  hdr.monotonic = monotonic;
+  memcpy(buf[cur] + fill, &hdr, sizeof(hdr));
+  fill += sizeof(hdr);
+  for (z = 0; z < MAX_ZONES; z++) {
+    last[z] = monotonic;
+    lost[z] = 0;
+  }
+  sem_init(&write_sem, 0, 0);
+  if ((err = pthread_create(&write_thread, NULL, writeThreadMain, NULL)) != 0) {
+    errno = err;
+    goto fail;
+  }
+  return 0;
+
+fail:
+  close(cap_fd);
+  cap_fd = -1;
+  return -1;
+}
+
+/**
+ * Write down a pulse on zone at ts.
+ */
+void
+capturePulse(int zone, int64_t ts) {
+  if (cap_fd < 0) {
+    return;
+  }
+  if (lost[zone]) {
+    putLost();
+  }
+  if (lost[zone] || put((uint64_t)(ts > last[zone] ? ts - last[zone] : 0) << CAPTURE_SHIFT | zone) < 0) {
+    lost[zone]++;
+    return;
+  }
+  last[zone] = ts;
+}
+
+/**
+ * Write down n pulses on zone that came without their times.
+ */
+void
+captureDropped(int zone, unsigned int n) {
+  if (cap_fd < 0) {
+    return;
+  }
+  lost[zone] += n;
+  putLost();
+}
+
+/**
+ * Have what we have so far written out.
+ */
+void
+captureSync(void) {
+  if (cap_fd < 0) {
+    return;
+  }
+  putLost();
+  handOff();
+}
+
+/**
+ * Write out everything and stop capturing.
+ */
+void
+captureClose(void) {
+  if (cap_fd < 0) {
+    return;
+  }
+  putLost();
+  // Whatever the writer has goes before the stop is seen
+  stopping = 1;
+  sem_post(&write_sem);
+  pthread_join(write_thread, NULL);
+  sem_destroy(&write_sem);
+  writeAll(buf[cur], fill);
+  fill = 0;
+  fdatasync(cap_fd);
+  close(cap_fd);
+  cap_fd = -1;
+}
+
+/**
+ * Writes given up on since we started, with the error from the last
+ * one in *err.
+ */
+unsigned int
+captureFailed(int * err) {
+  unsigned int n = atomic_load_explicit(&failed, memory_order_acquire);
+
+  *err = atomic_load_explicit(&failed_errno, memory_order_relaxed);
+  return n;
+}
+
+static int
+readHeader(struct capture_reader * r) {
+  int z;
+
+  if (fread(&r->header, sizeof(r->header), 1, r->f) != 1
+   || r->header.magic != CAPTURE_MAGIC || r->header.version != 1 || r->header.zones > MAX_ZONES) {
+    return -1;
+  }
+  for (z = 0; z < MAX_ZONES; z++) {
+    r->last[z] = r->header.monotonic;
+  }
+  return 0;
+}
+
+/**
+ * Open a capture for reading, positioned on its first segment.
+ */
+int
+captureReadOpen(struct capture_reader * r, const char * path) {
+  if ((r->f = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  if (readHeader(r) < 0) {
+    fclose(r->f);
+    r->f = NULL;
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Next thing in the capture, returns its kind.  A record cut short at
+ * the end, as a crash can leave, reads as the end.
+ */
+int
+captureRead(struct capture_reader * r, struct capture_event * ev) {
+  uint64_t v = 0;
+  int c, shift = 0, kind;
+
+  do {
+    if ((c = getc(r->f)) == EOF || shift > 63) {
+      return ev->kind = CAP_END;
+    }
+    v |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  kind = v & ((1 << CAPTURE_SHIFT) - 1);
+  v >>= CAPTURE_SHIFT;
+  if (kind < CAPTURE_DROPPED) {
+    ev->kind = CAP_PULSE;
+    ev->zone = kind;
+    ev->ts = r->last[kind] += v;
+    ev->count = 1;
+  } else if (v) {
+    ev->kind = CAP_DROPPED;
+    ev->zone = kind - CAPTURE_DROPPED;
+    ev->ts = r->last[ev->zone];
+    ev->count = v;
+  } else if (kind == CAPTURE_SEGMENT && readHeader(r) == 0) {
+    ev->kind = CAP_SEGMENT;
+  } else {
+    ev->kind = CAP_END;
+  }
+  return ev->kind;
+}
+
+void
+captureReadClose(struct capture_reader * r) {
+  if (r->f) {
+    fclose(r->f);
+    r->f = NULL;
+  }
+}
@@ -0,0 +1,72 @@
+/**
+ * Pulse capture, for going back over what a meter really did.
+ *
+ * Every pulse the loop takes from a zone's ring is written down as the
+ * gap in ns since that zone's previous one, a varint with the zone in
+ * its low bits, so a pulse at any everyday rate takes three or four
+ * bytes.  Records are built up in one of two large buffers and a
+ * helper thread writes out each one as it fills, so the loop never
+ * waits on the SD card.  If both buffers are taken the pulses are
+ * still written down, as dropped ones without their times, like the
+ * pulse ring's own.  Writes that fail are counted in captureFailed().  Each time capture starts a new segment is begun
+ * with a header giving the clocks its gaps count from.  wfreplay plays
+ * a capture back through the cutoff rules.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "zone.h"
+
+#define CAPTURE_FILE "/var/lib/waterfuse/pulses"
+#define CAPTURE_MAGIC 0x31544657 // "WFT1"
+#define CAPTURE_CHUNK 65536      // Bytes written at a time
+#define CAPTURE_SHIFT 3          // Bits under the value that say what a record is
+#define CAPTURE_DROPPED 4        // Dropped pulses on zone (kind - CAPTURE_DROPPED)
+#define CAPTURE_SEGMENT CAPTURE_DROPPED // No pulses dropped, a header follows
+
+#if MAX_ZONES > CAPTURE_DROPPED
+#error Capture records have room for no more than 4 zones
+#endif
+
+struct capture_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t zones;
+  int64_t realtime;  // CLOCK_REALTIME ns at monotonic
+  int64_t monotonic; // hal clock ns each zone's first gap counts from
+};
+
+enum capture_kind {
+  CAP_END,      // Nothing more, or the rest is no good
+  CAP_SEGMENT,  // A new header, the clocks start again
+  CAP_PULSE,    // One pulse on zone at ts
+  CAP_DROPPED   // count pulses on zone without their times
+};
+
+struct capture_event {
+  int kind;
+  int zone;
+  int64_t ts;       // hal clock ns
+  uint64_t count;
+};
+
+struct capture_reader {
+  FILE * f;
+  struct capture_header header;
+  int64_t last[MAX_ZONES];
+};
+
+int captureOpen(const char * path, int zones, int64_t realtime, int64_t monotonic);
+void capturePulse(int zone, int64_t ts);
+void captureDropped(int zone, unsigned int n);
+void captureSync(void);
+void captureClose(void);
+unsigned int captureFailed(int * err);
+
+int captureReadOpen(struct capture_reader * r, const char * path);
+int captureRead(struct capture_reader * r, struct capture_event * ev);
+void captureReadClose(struct capture_reader * r);
+
+#endif
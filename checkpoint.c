@@ -0,0 +1,260 @@
+/**
+ * Crash-safe checkpoints, see checkpoint.h.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+#define NS 1000000000LL
+#define CRC_LEN offsetof(struct checkpoint, crc)
+#define SAME_FROM offsetof(struct checkpoint, zones) // What a save with nothing new in it has the same
+
+struct checkpoint_slot {
+  struct checkpoint cp;
+  uint32_t bucket[MAX_ZONES * FW_BUCKETS]; // Each zone's span in turn, oldest first
+};
+
+static struct checkpoint_slot * slot = MAP_FAILED;
+static const struct checkpoint_slot * restored = NULL;
+static struct checkpoint last;
+static int saved = 0;         // last is what the newest record holds
+static int64_t shift = 0;     // Seconds to move restored flow on by
+static uint32_t crc_table[256];
+static uint64_t seq = 0;
+static char boot_id[40];
+
+static void
+crcInit(void) {
+  uint32_t c;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+/**
+ * Carry a CRC-32 started from 0xffffffff on over len more bytes.
+ */
+static uint32_t
+crcAdd(uint32_t c, const void * data, size_t len) {
+  const uint8_t * p = data;
+
+  while (len--) {
+    c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+  }
+  return c;
+}
+
+/**
+ * Buckets kept after the record, for them all or up to zone z.
+ */
+static uint32_t
+slotBuckets(const struct checkpoint * cp, unsigned int z) {
+  uint32_t n = 0;
+  unsigned int i;
+
+  for (i = 0; i < z && i < cp->zones; i++) {
+    n += cp->flow[i].span;
+  }
+  return n;
+}
+
+static uint32_t
+slotCrc(const struct checkpoint_slot * s) {
+  uint32_t c = crcAdd(0xffffffff, &s->cp, CRC_LEN);
+
+  return crcAdd(c, s->bucket, slotBuckets(&s->cp, MAX_ZONES) * sizeof(s->bucket[0])) ^ 0xffffffff;
+}
+
+static int
+slotValid(const struct checkpoint_slot * s) {
+  const struct checkpoint * cp = &s->cp;
+  unsigned int z;
+
+  if (cp->magic != CHECKPOINT_MAGIC || cp->size != sizeof(*cp) || cp->zones > MAX_ZONES) {
+    return 0;
+  }
+  // Sizes to be sure of before the checksum goes by them
+  for (z = 0; z < cp->zones; z++) {
+    if (cp->flow[z].span > FW_BUCKETS) {
+      return 0;
+    }
+  }
+  return cp->crc == slotCrc(s);
+}
+
+/**
+ * Seconds of fw's history that a rule can still see.
+ */
+static uint32_t
+flowSpan(const struct flow_window * fw) {
+  int64_t span = 0;
+  int i;
+
+  for (i = 0; i < fw->nrules; i++) {
+    if (fw->rule[i].kind == FW_VOLUME && fw->rule[i].window > span) {
+      span = fw->rule[i].window;
+    }
+  }
+  // Nothing has flowed since the oldest of them
+  return fw->now - fw->last >= span ? 0 : span;
+}
+
+/**
+ * Map the checkpoint file, creating it if need be.
+ */
+int
+checkpointOpen(const char * path) {
+  char dir[256];
+  FILE * f;
+  int fd;
+
+  crcInit();
+  if ((f = fopen("/proc/sys/kernel/random/boot_id", "r")) != NULL) {
+    if (fgets(boot_id, sizeof(boot_id), f) == NULL) {
+      boot_id[0] = 0;
+    }
+    boot_id[strcspn(boot_id, "\n")] = 0;
+    fclose(f);
+  }
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = 0;
+  mkdir(dirname(dir), 0755);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, 2 * sizeof(struct checkpoint_slot)) < 0) {
+    close(fd);
+    return -1;
+  }
+  slot = mmap(NULL, 2 * sizeof(struct checkpoint_slot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (slot == MAP_FAILED) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Save cp, and the cp->zones flow windows in flow, over the older of
+ * the two records.  The caller fills in the rest of cp but for the
+ * times, the flow, the sequence number and checksum are done here.
+ * If nothing but the times has changed since the last save there is
+ * no need for this one.
+ */
+void
+checkpointSave(struct checkpoint * cp, const struct flow_window * flow) {
+  struct checkpoint_slot * dst;
+  const struct flow_window * fw;
+  struct checkpoint_flow * cf;
+  uint32_t n = 0;
+  unsigned int z;
+  int64_t t;
+
+  if (slot == MAP_FAILED) {
+    return;
+  }
+  for (z = 0; z < cp->zones && z < MAX_ZONES; z++) {
+    fw = &flow[z];
+    cf = &cp->flow[z];
+    cf->now = fw->now;
+    cf->gap = fw->gap;
+    cf->first = fw->first;
+    cf->last = fw->last;
+    cf->session = fw->session;
+    cf->counting = fw->counting;
+    cf->nrules = fw->nrules;
+    memcpy(cf->rule, fw->rule, sizeof(cf->rule));
+    cf->span = flowSpan(fw);
+  }
+  if (saved && memcmp((const char *)cp + SAME_FROM, (const char *)&last + SAME_FROM, CRC_LEN - SAME_FROM) == 0) {
+    return;
+  }
+  cp->magic = CHECKPOINT_MAGIC;
+  cp->size = sizeof(*cp);
+  cp->seq = ++seq;
+  memcpy(cp->boot_id, boot_id, sizeof(cp->boot_id));
+  dst = &slot[seq & 1];
+  dst->cp.crc = 0;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&dst->cp, cp, CRC_LEN);
+  for (z = 0; z < cp->zones && z < MAX_ZONES; z++) {
+    cf = &cp->flow[z];
+    for (t = cf->now - cf->span + 1; t <= cf->now; t++) {
+      dst->bucket[n++] = flow[z].bucket[t & FW_MASK];
+    }
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  dst->cp.crc = slotCrc(dst);
+  last = *cp;
+  saved = 1;
+}
+
+/**
+ * Fetch the latest good checkpoint, returns -1 if there isn't one.
+ * The zones' flow comes from checkpointFlow() afterwards.
+ */
+int
+checkpointRestore(struct checkpoint * cp, int64_t mono, int64_t real) {
+  const struct checkpoint_slot * best = NULL;
+  unsigned int i;
+
+  if (slot == MAP_FAILED) {
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    if (slotValid(&slot[i]) && (best == NULL || slot[i].cp.seq > best->cp.seq)) {
+      best = &slot[i];
+    }
+  }
+  if (best == NULL) {
+    return -1;
+  }
+  memcpy(cp, &best->cp, sizeof(*cp));
+  seq = cp->seq;
+  restored = best;
+  shift = 0;
+  if (strcmp(cp->boot_id, boot_id) != 0) {
+    // Wall clock time that has passed since, put on our monotonic clock
+    shift = (mono - (real - cp->real) - cp->mono) / NS;
+  }
+  return 0;
+}
+
+/**
+ * Put zone z's flow window back as it was in the restored checkpoint,
+ * on the monotonic clock that checkpointRestore() was given, moved on
+ * by however long we were down if there has been a reboot since.
+ */
+void
+checkpointFlow(int z, struct flow_window * fw) {
+  const struct checkpoint_flow * cf = &restored->cp.flow[z];
+  const uint32_t * b = &restored->bucket[slotBuckets(&restored->cp, z)];
+  int64_t t;
+
+  memset(fw->bucket, 0, sizeof(fw->bucket));
+  fw->now = cf->now + shift;
+  fw->gap = cf->gap;
+  fw->first = cf->first + shift;
+  fw->last = cf->last + shift;
+  fw->session = cf->session;
+  fw->counting = cf->counting;
+  fw->nrules = cf->nrules;
+  memcpy(fw->rule, cf->rule, sizeof(fw->rule));
+  for (t = fw->now - cf->span + 1; t <= fw->now; t++) {
+    fw->bucket[t & FW_MASK] = *b++;
+  }
+}
@@ -0,0 +1,66 @@
+/**
+ * Crash-safe checkpoints of the control state.
+ *
+ * The file holds two records and each save goes to the one not
+ * holding the latest, with a checksum written last, so a save cut
+ * short leaves the previous record to restore from.  The file is
+ * mapped, so a save is a copy into memory and survives the daemon
+ * being killed or restarted as soon as it is made.  Of each zone's
+ * flow history only the seconds its longest window rule can still see
+ * are kept, and a save with nothing new in it is skipped, so a save
+ * under steady flow touches a few pages rather than all of them.
+ */
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "flowwindow.h"
+#include "zone.h"
+
+#define CHECKPOINT_FILE "/var/lib/waterfuse/checkpoint"
+#define CHECKPOINT_MAGIC 0x34504357 // "WCP4"
+#define CHECKPOINT_INTERVAL 10      // Seconds between saves while counting
+
+/**
+ * A flow window less its buckets, which follow the record.
+ */
+struct checkpoint_flow {
+  int64_t now;
+  int64_t gap;
+  int64_t first;
+  int64_t last;
+  uint64_t session;
+  int32_t counting;
+  int32_t nrules;
+  struct fw_rule rule[FW_MAX_RULES];
+  uint32_t span;        // Buckets kept, the ones up to now
+  uint32_t reserved;
+};
+
+struct checkpoint {
+  uint32_t magic;
+  uint32_t size;
+  uint64_t seq;
+  char boot_id[40];     // Monotonic times only carry over within a boot
+  int64_t mono;         // CLOCK_MONOTONIC when saved, ns
+  int64_t real;         // CLOCK_REALTIME when saved, ns
+  uint32_t zones;
+  uint32_t reserved;
+  uint64_t total_clicks[MAX_ZONES];
+  uint64_t total_volume[MAX_ZONES];
+  uint32_t cutoffs[MAX_ZONES];
+  uint8_t triggered[MAX_ZONES];
+  uint8_t stop_reason[MAX_ZONES];
+  uint8_t reset_reason[MAX_ZONES];
+  uint8_t spare[MAX_ZONES];
+  struct checkpoint_flow flow[MAX_ZONES];
+  uint32_t crc;         // Over everything above and the buckets
+  uint32_t reserved2;
+};
+
+int checkpointOpen(const char * path);
+void checkpointSave(struct checkpoint * cp, const struct flow_window * flow);
+int checkpointRestore(struct checkpoint * cp, int64_t mono, int64_t real);
+void checkpointFlow(int z, struct flow_window * fw);
+
+#endif
@@ -0,0 +1,487 @@
+/**
+ * Config file loading and hot reload, see config.h.
+ *
+ * Settings before the first "zone NAME" line are the defaults for every
+ * zone, each zone line starts a new zone with those and what follows is
+ * for it alone.  With no zone lines at all there is just the one.
+ *
+ * "calibrate RATE CLICKS" gives the meter's pulses per litre at a flow
+ * of RATE litres a minute, one line for each point measured.  A zone's
+ * own calibrate lines replace any it would have had from the defaults.
+ *
+ * "schedule HH:MM LITRES MINUTES" has max_litres and max_time change to
+ * LITRES and MINUTES at that time of day, until the next schedule line
+ * takes over.  The last of the day goes on over midnight, so a zone
+ * with a schedule is always on one of its lines.  They replace the
+ * defaults' in the same way, and are kept sorted by time so the loop
+ * only has to look at them when one is due.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <arpa/inet.h>
+#include "config.h"
+#include "gpiodev.h"
+#include "logring.h"
+#include "button.h"
+#include "pressure.h"
+#include "health.h"
+
+#define FLOW_METER 0 // Pin for flow meter input
+#define POWER_RELAY 1 // Pin for relay to pump output
+#define RESET_BUTTON 2
+#define PRESSURE_SENSOR 3 // ADC input for the pressure sensor
+#define CLICKS_PER_LITRE 450 // Number of pulses per litre
+#define MAX_FLOW 200 // Maximum number of litres in a given time period
+#define RESET_PERIOD 600 // Quiescent time to reset counters
+#define MAX_TIME 900 // Time during which the max flow can be achieved
+
+struct zone_key {
+  const char * name;
+  size_t offset;   // Into struct zone_config
+  int min;
+  int scale;       // What the file's unit is in ours
+};
+
+static const struct zone_key zone_keys[] = {
+  { "clicks_per_litre", offsetof(struct zone_config, clicks_per_litre), 1, 1 },
+  { "max_litres", offsetof(struct zone_config, max_litres), 0, 1 },
+  { "reset_period", offsetof(struct zone_config, reset_period), 1, 1 },
+  { "max_time", offsetof(struct zone_config, time_limit), 1, 60 },
+  { "window_litres", offsetof(struct zone_config, window_litres), 0, 1 },
+  { "window_minutes", offsetof(struct zone_config, window_minutes), 0, 1 },
+  { "max_rate", offsetof(struct zone_config, max_rate), 0, 1 },
+  { "leak_rate", offsetof(struct zone_config, leak_rate), 0, 1 },
+  { "leak_hours", offsetof(struct zone_config, leak_hours), 0, 1 },
+  { "flow_pin", offsetof(struct zone_config, flow_pin), 0, 1 },
+  { "relay_pin", offsetof(struct zone_config, relay_pin), 0, 1 },
+  { "button_pin", offsetof(struct zone_config, button_pin), 0, 1 },
+  { "gpio_line", offsetof(struct zone_config, gpio_line), -1, 1 },
+  { "pressure_pin", offsetof(struct zone_config, pressure_pin), 0, 1 },
+  { "pressure_drop", offsetof(struct zone_config, pressure_drop), 0, 1 },
+  { "pressure_window", offsetof(struct zone_config, pressure_window), 1, 1 },
+  { NULL, 0, 0, 0 }
+};
+
+static const char * config_path;
+static void (*ready_fn)(void);
+static int request_fd = -1;
+static _Atomic(struct config *) pending = NULL;
+
+static int
+fail(struct config * cfg, const char * fmt, ...) {
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(cfg->error, sizeof(cfg->error), fmt, args);
+  va_end(args);
+  return -1;
+}
+
+/**
+ * What a zone gets for anything the config file doesn't say.
+ */
+static void
+defaultZone(struct zone_config * c) {
+  memset(c, 0, sizeof(*c));
+  strcpy(c->name, "zone0");
+  c->clicks_per_litre = CLICKS_PER_LITRE;
+  c->max_litres = MAX_FLOW;
+  c->reset_period = RESET_PERIOD;
+  c->time_limit = MAX_TIME;
+  c->flow_pin = FLOW_METER;
+  c->relay_pin = POWER_RELAY;
+  c->button_pin = RESET_BUTTON;
+  c->gpio_line = -1;
+  c->pressure_pin = PRESSURE_SENSOR;
+  c->pressure_window = PRESSURE_WINDOW;
+}
+
+/**
+ * The whole of value has to be a number no smaller than min.
+ */
+static int
+number(const char * value, int min, int * out) {
+  char * end;
+  long v;
+
+  errno = 0;
+  v = strtol(value, &end, 10);
+  if (errno || end == value || *end || v < min || v > INT_MAX / 60) {
+    return -1;
+  }
+  *out = v;
+  return 0;
+}
+
+/**
+ * HH:MM as seconds after midnight.
+ */
+static int
+timeOfDay(const char * value, int * out) {
+  int h, m, len;
+
+  if (sscanf(value, "%2d:%2d%n", &h, &m, &len) != 2 || value[len] || h < 0 || h > 23 || m < 0 || m > 59) {
+    return -1;
+  }
+  *out = h * 3600 + m * 60;
+  return 0;
+}
+
+/**
+ * Checks that need the whole of the config, also run again by the
+ * daemon once its command line has been laid over the top.
+ */
+int
+configCheck(struct config * cfg) {
+  struct zone_config * a, * b;
+  int i, j, k;
+
+  for (i = 0; i < cfg->count; i++) {
+    a = &cfg->zone[i];
+    if (a->clicks_per_litre <= 0) {
+      return fail(cfg, "zone %s needs clicks_per_litre", a->name);
+    }
+    if ((a->window_litres > 0) != (a->window_minutes > 0)) {
+      return fail(cfg, "zone %s needs both window_litres and window_minutes", a->name);
+    }
+    if (a->window_minutes * 60 >= FW_BUCKETS) {
+      return fail(cfg, "zone %s: window_minutes is longer than the %d we keep history for", a->name, FW_BUCKETS / 60);
+    }
+    if ((a->leak_rate > 0) != (a->leak_hours > 0)) {
+      return fail(cfg, "zone %s needs both leak_rate and leak_hours", a->name);
+    }
+    if (a->pressure_drop > 0 && (int64_t)a->pressure_window * cfg->pressure_rate / PRESSURE_BATCH >= PRESSURE_RING) {
+      return fail(cfg, "zone %s: pressure_window is longer than the %d seconds we keep at pressure_rate %d",
+        a->name, PRESSURE_RING * PRESSURE_BATCH / cfg->pressure_rate, cfg->pressure_rate);
+    }
+    for (j = 0; j < a->cal_points; j++) {
+      if (a->cal[j].rate <= 0 || a->cal[j].clicks_per_litre <= 0) {
+        return fail(cfg, "zone %s has a calibrate point that isn't a flow", a->name);
+      }
+      for (k = 0; k < j; k++) {
+        if (a->cal[k].rate == a->cal[j].rate) {
+          return fail(cfg, "zone %s is calibrated twice at %d litres a minute", a->name, a->cal[j].rate);
+        }
+      }
+    }
+    for (j = 1; j < a->schedule_count; j++) {
+      if (a->schedule[j].at == a->schedule[j - 1].at) {
+        return fail(cfg, "zone %s has two schedule lines at %02d:%02d", a->name,
+          a->schedule[j].at / 3600, a->schedule[j].at / 60 % 60);
+      }
+    }
+    // Zones can share a reset button, but counting one meter twice or
+    // two zones fighting over a relay would be nonsense
+    for (j = i + 1; j < cfg->count; j++) {
+      b = &cfg->zone[j];
+      if (strcmp(a->name, b->name) == 0) {
+        return fail(cfg, "zone %s is there twice", a->name);
+      }
+      if (a->flow_pin == b->flow_pin || (a->gpio_line >= 0 && a->gpio_line == b->gpio_line)) {
+        return fail(cfg, "zones %s and %s share a flow meter", a->name, b->name);
+      }
+      if (a->relay_pin == b->relay_pin) {
+        return fail(cfg, "zones %s and %s share a relay", a->name, b->name);
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Parse path into cfg, returning -1 with cfg->error set if anything in
+ * it is wrong.  No file at all just means the defaults at startup, but
+ * on a reload that is far more likely to be one being replaced, so it
+ * is refused along with one that sets nothing.
+ */
+static int
+load(const char * path, struct config * cfg, int reloading) {
+  struct zone_config defaults, * c = &defaults;
+  const struct zone_key * k;
+  struct schedule_entry * s;
+  char line[256], key[64], value[64], value2[64], value3[64], extra[2];
+  int n, val, val2, val3, lineno = 0, settings = 0, own_cal = 0, own_schedule = 0;
+  struct in_addr addr;
+  FILE * f;
+
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->verbose = -1;
+  cfg->gpio_chip = GPIO_CHIP;
+  cfg->realtime_cpu = -1;
+  cfg->debounce = BUTTON_DEBOUNCE;
+  cfg->pressure_rate = PRESSURE_RATE;
+  cfg->collector_interval = UPLINK_INTERVAL;
+  cfg->max_lag = HEALTH_MAX_LAG;
+  defaultZone(&defaults);
+  if ((f = fopen(path, "r")) == NULL) {
+    if (errno != ENOENT || reloading) {
+      return fail(cfg, "%s: %s", path, strerror(errno));
+    }
+  } else {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      lineno++;
+      if (strchr(line, '\n') == NULL && !feof(f)) {
+        fclose(f);
+        return fail(cfg, "%s:%d: line is too long", path, lineno);
+      }
+      if ((n = sscanf(line, "%63s %63s %63s %63s %1s", key, value, value2, value3, extra)) < 1 || key[0] == '#') {
+        continue;
+      }
+      settings++;
+      if (strcmp("calibrate", key) == 0) {
+        if (n != 3 || number(value, 1, &val) < 0 || number(value2, 1, &val2) < 0) {
+          fclose(f);
+          return fail(cfg, "%s:%d: expected calibrate, litres a minute and clicks a litre", path, lineno);
+        }
+        if (!own_cal) {
+          c->cal_points = 0;
+        }
+        own_cal = 1;
+        if (c->cal_points == CAL_POINTS) {
+          fclose(f);
+          return fail(cfg, "%s:%d: no more than %d calibrate points", path, lineno, CAL_POINTS);
+        }
+        c->cal[c->cal_points].rate = val;
+        c->cal[c->cal_points++].clicks_per_litre = val2;
+        continue;
+      }
+      if (strcmp("schedule", key) == 0) {
+        if (n != 4 || timeOfDay(value, &val) < 0 || number(value2, 0, &val2) < 0 || number(value3, 1, &val3) < 0) {
+          fclose(f);
+          return fail(cfg, "%s:%d: expected schedule, HH:MM, litres and minutes", path, lineno);
+        }
+        if (!own_schedule) {
+          c->schedule_count = 0;
+        }
+        own_schedule = 1;
+        if (c->schedule_count == SCHEDULE_MAX) {
+          fclose(f);
+          return fail(cfg, "%s:%d: no more than %d schedule lines", path, lineno, SCHEDULE_MAX);
+        }
+        // In with the rest in time order
+        for (s = &c->schedule[c->schedule_count++]; s > c->schedule && s[-1].at > val; s--) {
+          s[0] = s[-1];
+        }
+        s->at = val;
+        s->max_litres = val2;
+        s->time_limit = val3 * 60;
+        continue;
+      }
+      if (n != 2) {
+        fclose(f);
+        return fail(cfg, "%s:%d: expected a name and one value", path, lineno);
+      }
+      if (strcmp("zone", key) == 0) {
+        if (cfg->count == MAX_ZONES) {
+          fclose(f);
+          return fail(cfg, "%s:%d: no more than %d zones", path, lineno, MAX_ZONES);
+        }
+        if (strlen(value) >= ZONE_NAME) {
+          fclose(f);
+          return fail(cfg, "%s:%d: zone name is longer than %d", path, lineno, ZONE_NAME - 1);
+        }
+        c = &cfg->zone[cfg->count++];
+        *c = defaults;
+        strcpy(c->name, value);
+        own_cal = own_schedule = 0;
+        continue;
+      }
+      for (k = zone_keys; k->name && strcmp(k->name, key) != 0; k++)
+        ;
+      if (k->name) {
+        if (number(value, k->min, &val) < 0) {
+          fclose(f);
+          return fail(cfg, "%s:%d: %s should be a number, at least %d", path, lineno, key, k->min);
+        }
+        *(int *)((char *)c + k->offset) = val * k->scale;
+      } else if (strcmp("verbosity", key) == 0 && number(value, 0, &val) == 0) {
+        cfg->verbose = val;
+      } else if (strcmp("gpio_chip", key) == 0 && number(value, 0, &val) == 0) {
+        cfg->gpio_chip = val;
+      } else if (strcmp("realtime_priority", key) == 0 && number(value, 0, &val) == 0) {
+        cfg->realtime = val;
+      } else if (strcmp("realtime_cpu", key) == 0 && number(value, -1, &val) == 0) {
+        cfg->realtime_cpu = val;
+      } else if (strcmp("log_ring", key) == 0 && number(value, 0, &val) == 0
+              && (val == 0 || val >= LOGRING_MIN)) {
+        cfg->log_ring = val;
+      } else if (strcmp("metrics_port", key) == 0 && number(value, 0, &val) == 0 && val <= 65535) {
+        cfg->metrics_port = val;
+      } else if (strcmp("metrics_address", key) == 0 && inet_pton(AF_INET, value, &addr) == 1) {
+        strcpy(cfg->metrics_address, value);
+      } else if (strcmp("button_debounce", key) == 0 && number(value, 0, &val) == 0) {
+        cfg->debounce = val;
+      } else if (strcmp("long_press", key) == 0 && number(value, 0, &val) == 0) {
+        cfg->long_press = val;
+      } else if (strcmp("capture", key) == 0 && number(value, 0, &val) == 0 && val <= 1) {
+        cfg->capture = val;
+      } else if (strcmp("pressure_rate", key) == 0 && number(value, 1, &val) == 0 && val <= 10000) {
+        cfg->pressure_rate = val;
+      } else if (strcmp("collector", key) == 0 && strlen(value) < sizeof(cfg->collector)) {
+        strcpy(cfg->collector, value);
+      } else if (strcmp("site", key) == 0 && strlen(value) < sizeof(cfg->site)) {
+        strcpy(cfg->site, value);
+      } else if (strcmp("collector_interval", key) == 0 && number(value, 1, &val) == 0) {
+        cfg->collector_interval = val;
+      } else if (strcmp("max_lag", key) == 0 && number(value, 0, &val) == 0) {
+        cfg->max_lag = val;
+      } else if (strcmp("watchdog_device", key) == 0 && strlen(value) < sizeof(cfg->watchdog_device)) {
+        strcpy(cfg->watchdog_device, value);
+      } else {
+        fclose(f);
+        return fail(cfg, "%s:%d: can't make sense of %s %s", path, lineno, key, value);
+      }
+    }
+    fclose(f);
+    if (reloading && settings == 0) {
+      return fail(cfg, "%s: sets nothing", path);
+    }
+  }
+  if (cfg->count == 0) {
+    cfg->zone[cfg->count++] = defaults;
+  }
+  return configCheck(cfg);
+}
+
+int
+configLoad(const char * path, struct config * cfg) {
+  return load(path, cfg, 0);
+}
+
+/**
+ * Hand a result over to the loop, replacing one it hasn't got to yet.
+ */
+static void
+publish(struct config * cfg) {
+  free(atomic_exchange(&pending, cfg));
+  if (ready_fn) {
+    ready_fn();
+  }
+}
+
+/**
+ * Reload when asked to, or when inotify sees the file closed after
+ * writing or renamed into place, not when it is created or deleted as
+ * editors go about replacing it.  Changes the watch turns up that make
+ * no difference to what is loaded aren't passed on.
+ */
+static void *
+configThread(void * arg) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char copy[256], * base;
+  const struct inotify_event * ev;
+  struct config last, * cfg;
+  struct pollfd fds[2];
+  uint64_t count;
+  ssize_t len;
+  int asked, changed, nfds = 1;
+
+  configLoad(config_path, &last);
+  snprintf(copy, sizeof(copy), "%s", config_path);
+  base = basename(copy);
+  fds[0].fd = request_fd;
+  fds[0].events = POLLIN;
+  fds[1].events = POLLIN;
+  if ((fds[1].fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0) {
+    snprintf(buf, sizeof(buf), "%s", config_path);
+    // The directory, so editors that write a new file and rename it are seen
+    if (inotify_add_watch(fds[1].fd, dirname(buf), IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) {
+      nfds = 2;
+    }
+  }
+  while (1) {
+    if (poll(fds, nfds, -1) < 0) {
+      continue;
+    }
+    asked = changed = 0;
+    if (fds[0].revents & POLLIN) {
+      asked = read(request_fd, &count, sizeof(count)) == sizeof(count);
+    }
+    if (nfds == 2 && (fds[1].revents & POLLIN)) {
+      while ((len = read(fds[1].fd, buf, sizeof(buf))) > 0) {
+        for (ev = (void *)buf; (char *)ev < buf + len; ev = (void *)((char *)ev + sizeof(*ev) + ev->len)) {
+          if (ev->len && strcmp(ev->name, base) == 0) {
+            changed = 1;
+          }
+        }
+      }
+    }
+    if (!asked && !changed) {
+      continue;
+    }
+    if ((cfg = malloc(sizeof(*cfg))) == NULL) {
+      continue;
+    }
+    load(config_path, cfg, 1);
+    if (!asked && cfg->error[0] == '\0' && memcmp(cfg, &last, sizeof(last)) == 0) {
+      free(cfg);
+      continue;
+    }
+    if (cfg->error[0] == '\0') {
+      last = *cfg;
+    }
+    publish(cfg);
+  }
+  return NULL;
+}
+
+/**
+ * Start watching path, ready is called from the loader thread whenever
+ * there is something for configTake().
+ */
+int
+configStart(const char * path, void (*ready)(void)) {
+  pthread_t thread;
+  int err;
+
+  config_path = path;
+  ready_fn = ready;
+  if ((request_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    return -1;
+  }
+  if ((err = pthread_create(&thread, NULL, configThread, NULL)) != 0) {
+    close(request_fd);
+    request_fd = -1;
+    errno = err;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/**
+ * Ask the loader thread to read the file again.
+ */
+void
+configReload(void) {
+  uint64_t one = 1;
+
+  if (request_fd >= 0) {
+    write(request_fd, &one, sizeof(one));
+  }
+}
+
+/**
+ * The latest result from the loader thread, or NULL if there is
+ * nothing new.  The caller frees it.
+ */
+struct config *
+configTake(void) {
+  if (atomic_load_explicit(&pending, memory_order_relaxed) == NULL) {
+    return NULL;
+  }
+  return atomic_exchange(&pending, NULL);
+}
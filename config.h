@@ -0,0 +1,51 @@
+/**
+ * Config file loading and hot reload.
+ *
+ * The file is parsed into a fresh struct config and checked as a whole
+ * before anything sees it, so a typo or a half written file is never
+ * half applied.  Reloads are done by a thread of their own, woken by
+ * inotify when the file is replaced or written, or by configReload()
+ * from the main loop.  Each result is left in a single pointer for the
+ * main loop to swap out when it is ready.
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "zone.h"
+#include "uplink.h"
+#include "metrics.h"
+
+#define WATCHDOG_DEVICE 64 // Longest watchdog device path
+
+#define CONFIG_FILE "/etc/waterfuse/waterfuse.conf"
+#define CONFIG_ERROR 160 // Longest error we report
+
+struct config {
+  int count;              // Zones in use
+  struct zone_config zone[MAX_ZONES];
+  int verbose;            // -1 if the file doesn't say
+  int gpio_chip;
+  int realtime;           // SCHED_FIFO priority for the control path, 0 for none
+  int realtime_cpu;       // Core to keep the control path on, -1 for any
+  int log_ring;           // Kilobytes of ring log, 0 for a text log
+  int metrics_port;       // TCP port for /metrics, 0 for none
+  char metrics_address[METRICS_ADDRESS]; // To listen on, empty for loopback
+  int debounce;           // ms a button has to stay put to count
+  int long_press;         // Seconds held down that stops the pumps, 0 never
+  int capture;            // Write every pulse to the capture file
+  int pressure_rate;      // Pressure reads a second
+  char collector[UPLINK_DEST]; // HOST:PORT to send UDP telemetry to, empty for none
+  char site[UPLINK_SITE]; // Name to send it as, empty for the host name
+  int collector_interval; // Seconds between packets under steady flow
+  int max_lag;            // ms a pass of the loop can take before the pumps go off, 0 for no limit
+  char watchdog_device[WATCHDOG_DEVICE]; // Hardware watchdog, empty for none
+  char error[CONFIG_ERROR]; // Empty unless the file was no good
+};
+
+int configLoad(const char * path, struct config * cfg);
+int configCheck(struct config * cfg);
+int configStart(const char * path, void (*ready)(void));
+void configReload(void);
+struct config * configTake(void);
+
+#endif
@@ -0,0 +1,240 @@
+/**
+ * Control socket, see control.h.
+ *
+ * Like the notify socket everything is non-blocking.  Requests are
+ * answered as soon as they are read, and replies that don't go out
+ * straight away are queued for the client until they do; one that
+ * lets too much build up, or sends something we can't frame, is
+ * dropped rather than holding up the main loop.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "control.h"
+
+struct control_client {
+  int fd;
+  int subscribed;
+  int in_len;
+  int out_len;
+  char in[sizeof(struct control_header) + CONTROL_MAX];
+  char out[CONTROL_BUFFER];
+};
+
+static int control_epfd = -1;
+static int listen_fd = -1;
+static control_fn handler;
+static struct control_client clients[CONTROL_CLIENTS];
+
+static void
+dropClient(struct control_client * c) {
+  epoll_ctl(control_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+}
+
+static void
+watchClient(struct control_client * c) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | (c->out_len ? EPOLLOUT : 0);
+  ev.data.fd = c->fd;
+  epoll_ctl(control_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/**
+ * Send what we can of the queue, returns -1 if the client has gone.
+ */
+static int
+flushClient(struct control_client * c) {
+  ssize_t n;
+  int was = c->out_len;
+
+  while (c->out_len > 0) {
+    if ((n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+      if (errno == EAGAIN) {
+        break;
+      }
+      dropClient(c);
+      return -1;
+    }
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+  }
+  // Only ask after writability while there is something waiting
+  if ((was != 0) != (c->out_len != 0)) {
+    watchClient(c);
+  }
+  return 0;
+}
+
+static int
+sendFrame(struct control_client * c, int type, int status, const char * msg, int len) {
+  struct control_header h;
+
+  if (c->out_len + (int)sizeof(h) + len > CONTROL_BUFFER) {
+    dropClient(c);
+    return -1;
+  }
+  h.type = type;
+  h.status = status;
+  h.len = htons(len);
+  memcpy(c->out + c->out_len, &h, sizeof(h));
+  memcpy(c->out + c->out_len + sizeof(h), msg, len);
+  c->out_len += sizeof(h) + len;
+  return flushClient(c);
+}
+
+/**
+ * Answer every whole request in the client's buffer.
+ */
+static void
+handleRequests(struct control_client * c) {
+  static char reply[CONTROL_MAX];
+  struct control_header h;
+  char arg[CONTROL_MAX + 1];
+  int len, used = 0, n;
+
+  while (c->in_len - used >= (int)sizeof(h)) {
+    memcpy(&h, c->in + used, sizeof(h));
+    len = ntohs(h.len);
+    if (len > CONTROL_MAX) {
+      dropClient(c);
+      return;
+    }
+    if (c->in_len - used < (int)sizeof(h) + len) {
+      break;
+    }
+    memcpy(arg, c->in + used + sizeof(h), len);
+    arg[len] = '\0';
+    used += sizeof(h) + len;
+    if ((n = handler(h.type, arg, reply, sizeof(reply))) < 0) {
+      if (sendFrame(c, h.type, -n, "", 0) < 0) {
+        return;
+      }
+      continue;
+    }
+    if (h.type == CTL_SUBSCRIBE) {
+      c->subscribed = 1;
+    }
+    if (sendFrame(c, h.type, 0, reply, n) < 0) {
+      return;
+    }
+  }
+  memmove(c->in, c->in + used, c->in_len - used);
+  c->in_len -= used;
+}
+
+/**
+ * Listen on path, answering requests with fn.  Only root and the group
+ * get to turn pumps on and off.
+ */
+int
+controlOpen(int epfd, const char * path, control_fn fn) {
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  int i;
+
+  for (i = 0; i < CONTROL_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+   || chmod(path, 0660) < 0
+   || listen(listen_fd, CONTROL_CLIENTS) < 0) {
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  control_epfd = epfd;
+  handler = fn;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+/**
+ * Deal with activity on fd if it is one of ours, returns non-zero if
+ * it was.
+ */
+int
+controlEvent(int fd, uint32_t events) {
+  struct control_client * c;
+  struct epoll_event ev;
+  int i, client;
+  ssize_t n;
+
+  if (listen_fd < 0) {
+    return 0;
+  }
+  if (fd == listen_fd) {
+    while ((client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      for (i = 0; i < CONTROL_CLIENTS && clients[i].fd >= 0; i++)
+        ;
+      if (i == CONTROL_CLIENTS) {
+        close(client);
+        continue;
+      }
+      c = &clients[i];
+      c->fd = client;
+      c->subscribed = 0;
+      c->in_len = c->out_len = 0;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.fd = client;
+      epoll_ctl(control_epfd, EPOLL_CTL_ADD, client, &ev);
+    }
+    return 1;
+  }
+  for (i = 0; i < CONTROL_CLIENTS; i++) {
+    c = &clients[i];
+    if (c->fd != fd) {
+      continue;
+    }
+    if ((events & EPOLLOUT) && flushClient(c) < 0) {
+      return 1;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      n = recv(fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        dropClient(c);
+        return 1;
+      }
+      if (n > 0) {
+        c->in_len += n;
+        handleRequests(c);
+      }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Pass a state line on to every subscriber.
+ */
+void
+controlPublish(const char * msg, int len) {
+  int i;
+
+  for (i = 0; i < CONTROL_CLIENTS; i++) {
+    if (clients[i].fd >= 0 && clients[i].subscribed) {
+      sendFrame(&clients[i], CTL_STATE, 0, msg, len);
+    }
+  }
+}
@@ -0,0 +1,46 @@
+/**
+ * Control socket, for asking the daemon things and telling it to do
+ * things without signals or reading the log.
+ *
+ * Requests and replies are frames of a four byte header and up to
+ * CONTROL_MAX bytes of text.  A request's payload is an optional zone
+ * name, all zones if empty; the reply has the same type, a status of
+ * 0 or an errno value, and the answer as "name value" lines.  The
+ * reply to a subscribe is the state line of every zone, after which a
+ * CTL_STATE frame follows each time one of them changes.
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+
+#define CONTROL_CLIENTS 8    // Connections we will hold at once
+#define CONTROL_MAX 4096     // Longest payload
+#define CONTROL_BUFFER 16384 // Replies queued for a client before it is dropped
+
+enum control_type {
+  CTL_STATS = 1,  // Counters for each zone
+  CTL_RESET,      // Turn zones back on
+  CTL_STOP,       // Cut zones off
+  CTL_CONFIG,     // Settings in use
+  CTL_SUBSCRIBE,  // Send state changes from now on
+  CTL_STATE       // A state change, only ever sent to subscribers
+};
+
+struct control_header {
+  uint8_t type;
+  uint8_t status;
+  uint16_t len;   // Payload that follows, network order
+};
+
+/**
+ * Handles a request, writing the reply into out and returning its
+ * length, or a negative errno value.
+ */
+typedef int (*control_fn)(int type, const char * arg, char * out, int size);
+
+int controlOpen(int epfd, const char * path, control_fn fn);
+int controlEvent(int fd, uint32_t events);
+void controlPublish(const char * msg, int len);
+
+#endif
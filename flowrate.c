@@ -0,0 +1,61 @@
+/**
+ * Flow rate estimation, see flowrate.h.
+ */
+#include <string.h>
+#include "flowrate.h"
+
+void
+rateInit(struct flow_rate * r) {
+  memset(r, 0, sizeof(*r));
+}
+
+void
+rateAdd(struct flow_rate * r, int64_t ts) {
+  int64_t gap = ts - r->last;
+
+  if (r->last == 0) {
+    r->last = ts;
+    return;
+  }
+  r->last = ts;
+  if (r->gaps == 0) {
+    r->gap = gap;
+    r->gaps = 1;
+    return;
+  }
+  if (gap > r->gap * RATE_OUTLIER) {
+    // Not a missed pulse, the flow has stopped or fallen away
+    r->gaps = 0;
+  } else if (gap * RATE_OUTLIER < r->gap) {
+    r->held += gap;
+    if (++r->suspect < RATE_RESEED) {
+      return;
+    }
+    // Not a bounce then, start again from the new flow
+    r->gap = r->held / r->suspect;
+    r->gaps = 1;
+  } else {
+    r->gap += (gap - r->gap) / RATE_WEIGHT;
+    if (r->gaps < RATE_WARM) {
+      r->gaps++;
+    }
+  }
+  r->suspect = 0;
+  r->held = 0;
+}
+
+/**
+ * Average gap between pulses as of now, or 0 if we haven't seen enough
+ * to say.  Once the meter has gone quiet for longer than an outlying
+ * gap the silence itself is the gap, so the rate falls away when the
+ * flow stops rather than sticking at the last value.
+ */
+int64_t
+rateGap(const struct flow_rate * r, int64_t now) {
+  int64_t quiet = now - r->last;
+
+  if (r->gaps < RATE_WARM) {
+    return 0;
+  }
+  return quiet > r->gap * RATE_OUTLIER ? quiet : r->gap;
+}
@@ -0,0 +1,34 @@
+/**
+ * Flow rate from the gaps between pulses.
+ *
+ * Each gap goes into an exponentially weighted average.  A gap much
+ * shorter than the average, a bounce on the meter contact, is left out
+ * unless a few of them come in a row, which means the flow really has
+ * jumped and the average starts again from those.  One much longer
+ * means the flow has stopped or dropped right off, so the average
+ * starts over from nothing.  Like flowwindow.h this knows nothing of
+ * litres, it works in ns per pulse.
+ */
+#ifndef FLOWRATE_H
+#define FLOWRATE_H
+
+#include <stdint.h>
+
+#define RATE_WEIGHT 8  // Each new gap counts for 1/8 of the average
+#define RATE_OUTLIER 4 // Gaps this many times off the average don't belong to it
+#define RATE_RESEED 4  // Short gaps in a row that mean the flow has jumped
+#define RATE_WARM 8    // Gaps needed before the average means anything
+
+struct flow_rate {
+  int64_t last;   // Latest pulse, ns
+  int64_t gap;    // Average gap, ns
+  int gaps;       // Gaps in the average, stops counting at RATE_WARM
+  int suspect;    // Short gaps in a row
+  int64_t held;   // Sum of those gaps
+};
+
+void rateInit(struct flow_rate * r);
+void rateAdd(struct flow_rate * r, int64_t ts);
+int64_t rateGap(const struct flow_rate * r, int64_t now);
+
+#endif
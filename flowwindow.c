@@ -0,0 +1,215 @@
+/**
+ * Windowed flow accounting, see flowwindow.h.
+ *
+ * Moving time forward walks each new second, taking the bucket that
+ * leaves a rule's window off its sum and clearing the bucket about to
+ * be reused.  That is bounded by FW_BUCKETS steps however long we have
+ * been idle, and is one step per second of flow otherwise.
+ */
+#include <string.h>
+#include "flowwindow.h"
+
+void
+fwInit(struct flow_window * fw, int64_t now, int64_t gap) {
+  memset(fw, 0, sizeof(*fw));
+  fw->now = now;
+  fw->gap = gap;
+}
+
+static void
+fwAdvance(struct flow_window * fw, int64_t t) {
+  struct fw_rule * r;
+  int64_t s;
+  int i;
+
+  if (t <= fw->now) {
+    return;
+  }
+  if (t - fw->now >= FW_BUCKETS) {
+    memset(fw->bucket, 0, sizeof(fw->bucket));
+    for (i = 0; i < fw->nrules; i++) {
+      fw->rule[i].sum = 0;
+    }
+    fw->now = t;
+    return;
+  }
+  for (s = fw->now + 1; s <= t; s++) {
+    for (i = 0; i < fw->nrules; i++) {
+      r = &fw->rule[i];
+      if (r->kind == FW_VOLUME && r->window) {
+        r->sum -= fw->bucket[(s - r->window) & FW_MASK];
+      }
+    }
+    fw->bucket[s & FW_MASK] = 0;
+  }
+  fw->now = t;
+}
+
+/**
+ * Set up rule idx, working out its sum from the history we already
+ * have so limits can be changed on the fly.  Returns -1 if the rule
+ * can't be held.
+ */
+int
+fwSetRule(struct flow_window * fw, int idx, int kind, uint64_t limit, int window, int reason) {
+  struct fw_rule * r;
+  int i;
+
+  if (idx < 0 || idx >= FW_MAX_RULES || window < 0 || (kind == FW_VOLUME && window >= FW_BUCKETS)) {
+    return -1;
+  }
+  r = &fw->rule[idx];
+  r->kind = kind;
+  r->limit = limit;
+  r->window = window;
+  r->reason = reason;
+  r->sum = 0;
+  if (kind == FW_VOLUME && window) {
+    for (i = 0; i < window; i++) {
+      r->sum += fw->bucket[(fw->now - i) & FW_MASK];
+    }
+  }
+  if (idx >= fw->nrules) {
+    fw->nrules = idx + 1;
+  }
+  return 0;
+}
+
+/**
+ * Account for flow at second t.  Returns the reason of the first rule
+ * that has tripped, or 0 if none has.
+ */
+int
+fwAdd(struct flow_window * fw, int64_t t, uint32_t amount) {
+  struct fw_rule * r;
+  int i;
+
+  // Late arrivals are put in the current second
+  fwAdvance(fw, t);
+  if (t < fw->now) {
+    t = fw->now;
+  }
+  if (!fw->counting || t - fw->last > fw->gap) {
+    fw->counting = 1;
+    fw->first = t;
+    fw->session = 0;
+  }
+  fw->last = t;
+  fw->session += amount;
+  fw->bucket[t & FW_MASK] += amount;
+  for (i = 0; i < fw->nrules; i++) {
+    r = &fw->rule[i];
+    switch (r->kind) {
+      case FW_VOLUME:
+        if (r->window) {
+          r->sum += amount;
+          if (r->sum >= r->limit) {
+            return r->reason;
+          }
+        } else if (fw->session >= r->limit) {
+          return r->reason;
+        }
+        break;
+      case FW_CONTINUOUS:
+        if (t - fw->first > r->window) {
+          return r->reason;
+        }
+        break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Move time on to t without any flow.  Returns non-zero if that has
+ * brought the flow session to an end.
+ */
+int
+fwIdle(struct flow_window * fw, int64_t t) {
+  fwAdvance(fw, t);
+  if (fw->counting && t - fw->last > fw->gap) {
+    fw->counting = 0;
+    fw->session = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Forget everything, giving every rule its full budget back.
+ */
+void
+fwReset(struct flow_window * fw) {
+  int i;
+
+  memset(fw->bucket, 0, sizeof(fw->bucket));
+  for (i = 0; i < fw->nrules; i++) {
+    fw->rule[i].sum = 0;
+  }
+  fw->counting = 0;
+  fw->session = 0;
+}
+
+/**
+ * How much more flow, as of second t, could be added before a rule
+ * might trip.  Window sums only drop as time goes on, so this errs on
+ * the early side.  Outside a session the first flow is always of
+ * interest, as is any flow once a continuous rule has run out.
+ */
+uint64_t
+fwHeadroom(struct flow_window * fw, int64_t t) {
+  struct fw_rule * r;
+  uint64_t room = UINT64_MAX, used;
+  int i;
+
+  if (!fw->counting) {
+    return 1;
+  }
+  for (i = 0; i < fw->nrules; i++) {
+    r = &fw->rule[i];
+    if (r->kind == FW_CONTINUOUS && t - fw->first > r->window) {
+      return 1;
+    }
+    if (r->kind == FW_VOLUME) {
+      used = r->window ? r->sum : fw->session;
+      if (used >= r->limit) {
+        return 1;
+      }
+      if (r->limit - used < room) {
+        room = r->limit - used;
+      }
+    }
+  }
+  return room;
+}
+
+/**
+ * Second at which the current session ends if no more flow turns up,
+ * or -1 if there is no session.
+ */
+int64_t
+fwSessionEnd(struct flow_window * fw) {
+  return fw->counting ? fw->last + fw->gap + 1 : -1;
+}
+
+/**
+ * Second after which the next flow trips a continuous rule, or -1.
+ */
+int64_t
+fwTimeLimit(struct flow_window * fw) {
+  int64_t when = -1, t;
+  int i;
+
+  if (!fw->counting) {
+    return -1;
+  }
+  for (i = 0; i < fw->nrules; i++) {
+    if (fw->rule[i].kind == FW_CONTINUOUS) {
+      t = fw->first + fw->rule[i].window + 1;
+      if (when < 0 || t < when) {
+        when = t;
+      }
+    }
+  }
+  return when;
+}
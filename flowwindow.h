@@ -0,0 +1,54 @@
+/**
+ * Windowed flow accounting.
+ *
+ * Flow is added in per-second buckets held in a fixed circular array,
+ * and every rule keeps a running sum over its own window so checking
+ * it costs the same whatever the window length.  Nothing here knows
+ * about GPIO or clocks, the caller hands in times in seconds and flow
+ * in whatever unit it likes, so long as the limits use the same one.
+ */
+#ifndef FLOWWINDOW_H
+#define FLOWWINDOW_H
+
+#include <stdint.h>
+
+#define FW_BUCKETS 8192 // Seconds of history, must be a power of two
+#define FW_MASK (FW_BUCKETS - 1)
+#define FW_MAX_RULES 4
+
+enum fw_kind {
+  FW_NONE,       // Rule slot not in use
+  FW_VOLUME,     // limit reached within window seconds, 0 for the whole session
+  FW_CONTINUOUS  // flow session lasting longer than window seconds
+};
+
+struct fw_rule {
+  int kind;
+  int reason;      // Handed back by fwAdd() when this rule trips
+  uint64_t limit;
+  int window;
+  uint64_t sum;    // Flow over the window, FW_VOLUME only
+};
+
+struct flow_window {
+  uint32_t bucket[FW_BUCKETS];
+  int64_t now;      // Second the newest bucket belongs to
+  int64_t gap;      // Quiet seconds that end a flow session
+  int64_t first;    // First second of flow this session
+  int64_t last;     // Latest second with flow
+  uint64_t session; // Flow since the session started
+  int counting;     // A flow session is under way
+  int nrules;
+  struct fw_rule rule[FW_MAX_RULES];
+};
+
+void fwInit(struct flow_window * fw, int64_t now, int64_t gap);
+int fwSetRule(struct flow_window * fw, int idx, int kind, uint64_t limit, int window, int reason);
+int fwAdd(struct flow_window * fw, int64_t t, uint32_t amount);
+int fwIdle(struct flow_window * fw, int64_t t);
+void fwReset(struct flow_window * fw);
+uint64_t fwHeadroom(struct flow_window * fw, int64_t t);
+int64_t fwSessionEnd(struct flow_window * fw);
+int64_t fwTimeLimit(struct flow_window * fw);
+
+#endif
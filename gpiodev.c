@@ -0,0 +1,163 @@
+/**
+ * Flow meter input using the gpio-v2 line event API.
+ *
+ * The kernel queues edge events with CLOCK_MONOTONIC timestamps, so
+ * the timing is exact however late our thread gets to run, and at high
+ * flow rates one read() hands back a whole batch of them.  If reading
+ * fails the line is asked for again, and if that can't be done either
+ * the zone is handed to the fail function, as its pulses have stopped
+ * being counted.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "gpiodev.h"
+#include "logger.h"
+
+#define GPIO_EVENTS 64 // Events taken per read
+#define GPIO_EVENT_BUFFER 1024 // Events the kernel will queue for us
+#define GPIO_RETRIES 3 // Failed reads in a row before the line is given up on
+#define GPIO_RETRY_MS 100 // Wait before asking for it again
+
+struct gpio_source {
+  int line_fd;
+  int chip;
+  int line;
+  int zone;
+  gpio_pulse_fn pulse_fn;
+  gpio_fail_fn fail_fn;
+};
+
+/**
+ * Claim a line for rising edge events, returning its fd.
+ */
+static int
+gpioRequest(int chip, int line) {
+  struct gpio_v2_line_request req;
+  char path[32];
+  int chip_fd, err;
+
+  snprintf(path, sizeof(path), "/dev/gpiochip%d", chip);
+  if ((chip_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    return -1;
+  }
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = line;
+  req.num_lines = 1;
+  req.event_buffer_size = GPIO_EVENT_BUFFER;
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING;
+  strncpy(req.consumer, "waterfuse", sizeof(req.consumer) - 1);
+  err = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  close(chip_fd);
+  return err < 0 ? -1 : req.fd;
+}
+
+/**
+ * After a failed read, let go of the line and have it again.  Returns
+ * -1 if it can't be had, leaving line_fd closed.
+ */
+static int
+gpioReopen(struct gpio_source * src) {
+  struct timespec pause = { 0, GPIO_RETRY_MS * 1000000L };
+
+  if (src->line_fd >= 0) {
+    close(src->line_fd);
+  }
+  nanosleep(&pause, NULL);
+  src->line_fd = gpioRequest(src->chip, src->line);
+  return src->line_fd < 0 ? -1 : 0;
+}
+
+static void *
+gpioDevThread(void * arg) {
+  struct gpio_source * src = arg;
+  struct gpio_v2_line_event ev[GPIO_EVENTS];
+  unsigned int expect = 0;
+  ssize_t len;
+  int i, n, failed = 0;
+
+  while (1) {
+    len = src->line_fd < 0 ? -1 : read(src->line_fd, ev, sizeof(ev));
+    if (len < 0) {
+      if (src->line_fd >= 0 && errno == EINTR) {
+        continue;
+      }
+      if (src->line_fd >= 0) {
+        printLog(0, "GPIO event read failed on line %d: %s\n", src->line, strerror(errno));
+      }
+      // Nothing on this line is being counted while we try
+      if (++failed > GPIO_RETRIES) {
+        printLog(0, "Giving up on GPIO line %d\n", src->line);
+        src->fail_fn(src->zone);
+        break;
+      }
+      if (gpioReopen(src) < 0) {
+        printLog(0, "Unable to have GPIO line %d again: %s\n", src->line, strerror(errno));
+      }
+      // Its sequence numbers start again
+      expect = 0;
+      continue;
+    }
+    failed = 0;
+    n = len / sizeof(ev[0]);
+    for (i = 0; i < n; i++) {
+      // A gap in the sequence means the kernel buffer overflowed, count
+      // the missing edges with the timestamp of the one that made it
+      if (expect) {
+        while (expect < ev[i].line_seqno) {
+          src->pulse_fn(src->zone, ev[i].timestamp_ns);
+          expect++;
+        }
+      }
+      src->pulse_fn(src->zone, ev[i].timestamp_ns);
+      expect = ev[i].line_seqno + 1;
+    }
+  }
+  if (src->line_fd >= 0) {
+    close(src->line_fd);
+  }
+  free(src);
+  return NULL;
+}
+
+/**
+ * Claim the line for rising edge events and start reading them, one
+ * thread per line, handing each pulse to fn along with the zone, and
+ * the zone to fail if the line is lost.  Returns -1 with errno set if
+ * the line can't be had, so the caller can fall back to wiringPi.
+ */
+int
+gpioDevStart(int chip, int line, int zone, gpio_pulse_fn fn, gpio_fail_fn fail) {
+  struct gpio_source * src;
+  pthread_t thread;
+  int fd, err;
+
+  if ((fd = gpioRequest(chip, line)) < 0) {
+    return -1;
+  }
+  if ((src = malloc(sizeof(*src))) == NULL) {
+    close(fd);
+    return -1;
+  }
+  src->line_fd = fd;
+  src->chip = chip;
+  src->line = line;
+  src->zone = zone;
+  src->pulse_fn = fn;
+  src->fail_fn = fail;
+  if ((err = pthread_create(&thread, NULL, gpioDevThread, src)) != 0) {
+    close(src->line_fd);
+    free(src);
+    errno = err;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,22 @@
+/**
+ * Flow meter input straight from the GPIO character device.
+ *
+ * Rising edges are timestamped by the kernel and read back in batches
+ * by a single thread, instead of wiringPi's one poll()/read() per edge.
+ * A line that stops giving events and can't be had again is reported
+ * to the fail function, from that thread.
+ */
+#ifndef GPIODEV_H
+#define GPIODEV_H
+
+#include <stdint.h>
+
+#define GPIO_CHIP 0  // /dev/gpiochipN holding the flow meter line
+#define GPIO_LINE 17 // BCM line for wiringPi pin 0
+
+typedef void (*gpio_pulse_fn)(int zone, int64_t ts);
+typedef void (*gpio_fail_fn)(int zone);
+
+int gpioDevStart(int chip, int line, int zone, gpio_pulse_fn fn, gpio_fail_fn fail);
+
+#endif
@@ -0,0 +1,104 @@
+/**
+ * Backend lookup and the shared clock, see hal.h.
+ *
+ * At speed 1 the clock is just CLOCK_MONOTONIC, so pulse timestamps
+ * from the kernel line up with it.  Faster than that, time since
+ * halSetSpeed() is multiplied up, and halRealFor() / halDuration()
+ * turn our times back into real ones for sleeping and timers.
+ */
+#include <string.h>
+#include "hal.h"
+
+#define NS 1000000000LL
+
+static int speed = 1;
+static int64_t base_mono;
+static int64_t base_real;
+
+static int64_t
+clockNs(clockid_t clock) {
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * NS + ts.tv_nsec;
+}
+
+/**
+ * Backend by name, the first one built in if name is NULL.
+ */
+const struct hal *
+halFind(const char * name) {
+  const struct hal * backends[2];
+  int i, n = 0;
+
+  // wiringPi is left out of simulator builds
+  if (&halWiringPi != NULL) {
+    backends[n++] = &halWiringPi;
+  }
+  backends[n++] = &halSim;
+  for (i = 0; i < n; i++) {
+    if (name == NULL || strcmp(name, backends[i]->name) == 0) {
+      return backends[i];
+    }
+  }
+  return NULL;
+}
+
+void
+halSetSpeed(int s) {
+  base_mono = clockNs(CLOCK_MONOTONIC);
+  base_real = clockNs(CLOCK_REALTIME);
+  speed = s > 1 ? s : 1;
+}
+
+int
+halSpeed(void) {
+  return speed;
+}
+
+/**
+ * Monotonic time in ns, the clock every pulse timestamp uses.
+ */
+int64_t
+halNow(void) {
+  int64_t now = clockNs(CLOCK_MONOTONIC);
+
+  if (speed == 1) {
+    return now;
+  }
+  return base_mono + (now - base_mono) * speed;
+}
+
+/**
+ * Wall clock time in ns, moving at the same rate as halNow().
+ */
+int64_t
+halRealtime(void) {
+  if (speed == 1) {
+    return clockNs(CLOCK_REALTIME);
+  }
+  return base_real + (clockNs(CLOCK_MONOTONIC) - base_mono) * speed;
+}
+
+/**
+ * The CLOCK_MONOTONIC time at which halNow() will reach ts.
+ */
+int64_t
+halRealFor(int64_t ts) {
+  if (speed == 1) {
+    return ts;
+  }
+  return base_mono + (ts - base_mono) / speed;
+}
+
+/**
+ * How long ns of our time really takes.
+ */
+void
+halDuration(int64_t ns, struct timespec * ts) {
+  if (ns > 0 && speed > 1) {
+    ns = ns / speed > 0 ? ns / speed : 1;
+  }
+  ts->tv_sec = ns / NS;
+  ts->tv_nsec = ns % NS;
+}
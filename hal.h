@@ -0,0 +1,50 @@
+/**
+ * Hardware abstraction for the pins we drive and the pulses we count.
+ *
+ * Each backend fills in a struct hal.  wiringPi drives the real pins,
+ * the simulator replays a pulse trace against pins that only exist in
+ * memory.  The clock lives here too, because the simulator can run it
+ * faster than real time and everything has to agree on what time it is.
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define HAL_LOW 0
+#define HAL_HIGH 1
+#define HAL_INPUT 0
+#define HAL_OUTPUT 1
+#define HAL_PUD_UP 2
+
+typedef void (*hal_pulse_fn)(int zone, int64_t ts);
+typedef void (*hal_done_fn)(void);
+typedef void (*hal_edge_fn)(int pin);
+
+struct hal {
+  const char * name;
+  int (*setup)(const char * arg);
+  void (*pinMode)(int pin, int mode);
+  void (*pullUpDn)(int pin, int pud);
+  void (*digitalWrite)(int pin, int value);
+  int (*digitalRead)(int pin);
+  // Deliver rising edges on pin to fn for zone, done is called if they run out
+  int (*pulseStart)(int zone, int pin, hal_pulse_fn fn, hal_done_fn done);
+  // Call fn whenever an input pin changes, either way
+  int (*edgeStart)(int pin, hal_edge_fn fn);
+  int (*analogRead)(int pin);
+};
+
+extern const struct hal halWiringPi __attribute__((weak));
+extern const struct hal halSim;
+
+const struct hal * halFind(const char * name);
+void halSetSpeed(int speed);
+int halSpeed(void);
+int64_t halNow(void);
+int64_t halRealtime(void);
+int64_t halRealFor(int64_t ts);
+void halDuration(int64_t ns, struct timespec * ts);
+
+#endif
@@ -0,0 +1,376 @@
+/**
+ * Simulated pins and flow meter.
+ *
+ * Pins are just memory, and pulses come from a trace file played back
+ * by a thread on the hal clock, so with halSetSpeed() a day of flow
+ * can go through in minutes.  Relay changes are reported on stderr
+ * with the simulated time they happened at.  The setup argument is a
+ * comma separated list of traces, one for each zone in order, each
+ * played by a thread of its own.
+ *
+ * A trace is a text file of one step per line:
+ *
+ *   clicks_per_litre N    pulses per litre for the steps that follow
+ *   flow RATE SECS        steady flow of RATE litres a minute
+ *   ramp FROM TO SECS     flow changing steadily from one rate to another
+ *   idle SECS             no flow
+ *   pulse SECS            a single pulse this long after the last one
+ *   press SECS            hold the reset button down this long
+ *   button PIN            pin the press steps that follow work, 2 to start with
+ *   pressure PIN VALUE    what the ADC reads on pin from now on, 0 to start with
+ *   jitter PERCENT        vary each gap between pulses by up to this much
+ *   repeat N              play everything so far N more times
+ *
+ * Lines starting with # are ignored.  The pulse step is how recorded
+ * traces are played back, one line per pulse.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "hal.h"
+#include "zone.h"
+
+#define SIM_PINS 64
+#define SIM_STEPS 65536   // Longest trace we will hold, after repeats
+#define SIM_BUTTON 2      // Pin the press step works unless told otherwise
+#define SIM_SLACK 50000   // Pulses due this close (ns) are spun for rather than slept for
+#define CLICKS_PER_LITRE 450
+#define NS 1000000000LL
+
+enum sim_kind { SIM_FLOW, SIM_IDLE, SIM_PULSE, SIM_PRESS, SIM_PRESSURE };
+
+struct sim_step {
+  int kind;
+  int cpl;
+  int jitter;        // Percent
+  int pin;           // Button for press, sensor for pressure
+  int value;         // Pressure
+  double from, to;   // Litres a minute
+  double secs;
+};
+
+struct sim_trace {
+  struct sim_step * steps;
+  int nsteps;
+  int zone;
+  hal_pulse_fn pulse_fn;
+};
+
+static struct sim_trace traces[MAX_ZONES];
+static int ntraces = 0;
+static atomic_int running; // Traces still to finish
+static volatile int pins[SIM_PINS];
+static atomic_int analog[SIM_PINS];
+static hal_edge_fn edge_fn[SIM_PINS];
+static hal_done_fn done_fn;
+
+static int
+addStep(struct sim_trace * tr, struct sim_step * s) {
+  if (tr->nsteps >= SIM_STEPS) {
+    return -1;
+  }
+  tr->steps[tr->nsteps++] = *s;
+  return 0;
+}
+
+static int
+loadTrace(struct sim_trace * tr, const char * path) {
+  struct sim_step s;
+  char line[256], word[32];
+  double a, b, c;
+  int cpl = CLICKS_PER_LITRE, jitter = 0, pin = SIM_BUTTON;
+  int i, n, count, lineno = 0;
+  FILE * f;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  if ((tr->steps = calloc(SIM_STEPS, sizeof(*tr->steps))) == NULL) {
+    fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    if (line[0] == '#' || (n = sscanf(line, "%31s %lf %lf %lf", word, &a, &b, &c)) < 1) {
+      continue;
+    }
+    memset(&s, 0, sizeof(s));
+    s.cpl = cpl;
+    s.jitter = jitter;
+    s.pin = pin;
+    if (strcmp(word, "clicks_per_litre") == 0 && n == 2 && a > 0) {
+      cpl = a;
+      continue;
+    } else if (strcmp(word, "jitter") == 0 && n == 2) {
+      jitter = a;
+      continue;
+    } else if (strcmp(word, "button") == 0 && n == 2 && a >= 0 && a < SIM_PINS) {
+      pin = a;
+      continue;
+    } else if (strcmp(word, "repeat") == 0 && n == 2) {
+      count = tr->nsteps;
+      for (n = 0; n < (int)a; n++) {
+        for (i = 0; i < count; i++) {
+          addStep(tr, &tr->steps[i]);
+        }
+      }
+      continue;
+    } else if (strcmp(word, "flow") == 0 && n == 3) {
+      s.kind = SIM_FLOW;
+      s.from = s.to = a;
+      s.secs = b;
+    } else if (strcmp(word, "ramp") == 0 && n == 4) {
+      s.kind = SIM_FLOW;
+      s.from = a;
+      s.to = b;
+      s.secs = c;
+    } else if (strcmp(word, "idle") == 0 && n == 2) {
+      s.kind = SIM_IDLE;
+      s.secs = a;
+    } else if (strcmp(word, "pulse") == 0 && n == 2) {
+      s.kind = SIM_PULSE;
+      s.secs = a;
+    } else if (strcmp(word, "press") == 0 && n == 2) {
+      s.kind = SIM_PRESS;
+      s.secs = a;
+    } else if (strcmp(word, "pressure") == 0 && n == 3 && a >= 0 && a < SIM_PINS) {
+      s.kind = SIM_PRESSURE;
+      s.pin = a;
+      s.value = b;
+    } else {
+      fprintf(stderr, "sim: %s:%d: can't make sense of \"%s\"\n", path, lineno, word);
+      continue;
+    }
+    if (addStep(tr, &s) < 0) {
+      fprintf(stderr, "sim: %s: trace is too long, ignoring the rest\n", path);
+      break;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+/**
+ * Wait until our clock reaches ts, never handing a pulse over early or
+ * its timestamp would be in the future.
+ */
+static void
+waitFor(int64_t ts) {
+  struct timespec now, until;
+  int64_t real = halRealFor(ts);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (real - ((int64_t)now.tv_sec * NS + now.tv_nsec) >= SIM_SLACK) {
+    until.tv_sec = real / NS;
+    until.tv_nsec = real % NS;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+      ;
+  }
+  while (halNow() < ts)
+    ;
+}
+
+static double
+jittered(double gap, int jitter) {
+  if (jitter <= 0) {
+    return gap;
+  }
+  return gap * (1.0 + jitter / 100.0 * (2.0 * rand() / RAND_MAX - 1.0));
+}
+
+/**
+ * Change an input the way a button would, edge and all.
+ */
+static void
+setInput(int pin, int value) {
+  pins[pin] = value;
+  if (edge_fn[pin]) {
+    edge_fn[pin](pin);
+  }
+}
+
+static void *
+simThread(void * arg) {
+  struct sim_trace * tr = arg;
+  struct sim_step * s;
+  int64_t t, start, end, next;
+  double rate, gap, part = 0;
+  int i;
+
+  t = halNow();
+  for (i = 0; i < tr->nsteps; i++) {
+    s = &tr->steps[i];
+    end = t + (int64_t)(s->secs * NS);
+    switch (s->kind) {
+      case SIM_FLOW:
+        /*
+         * part is how far we had got towards the next pulse when the
+         * last step ran out, so steps join up without a hiccup.
+         */
+        start = t;
+        while (1) {
+          rate = s->from;
+          if (end > start) {
+            rate += (s->to - s->from) * (t - start) / (double)(end - start);
+          }
+          if (rate <= 0) {
+            // Nothing flowing yet, look again a little later
+            t += NS / 10;
+            part = 0;
+            if (t >= end) {
+              break;
+            }
+            continue;
+          }
+          gap = jittered(60.0 * NS / (rate * s->cpl), s->jitter);
+          next = t + (int64_t)(gap * (1.0 - part));
+          if (next > end) {
+            part += (double)(end - t) / gap;
+            t = end;
+            break;
+          }
+          part = 0;
+          t = next;
+          waitFor(t);
+          tr->pulse_fn(tr->zone, t);
+        }
+        break;
+      case SIM_PULSE:
+        t = end;
+        waitFor(t);
+        tr->pulse_fn(tr->zone, t);
+        break;
+      case SIM_PRESS:
+        waitFor(t);
+        setInput(s->pin, HAL_LOW);
+        t = end;
+        waitFor(t);
+        setInput(s->pin, HAL_HIGH);
+        break;
+      case SIM_PRESSURE:
+        waitFor(t);
+        atomic_store(&analog[s->pin], s->value);
+        break;
+      case SIM_IDLE:
+        part = 0;
+        t = end;
+        waitFor(t);
+        break;
+    }
+  }
+  // Only once every trace has played out
+  if (atomic_fetch_sub(&running, 1) == 1 && done_fn) {
+    done_fn();
+  }
+  return NULL;
+}
+
+static int
+simSetup(const char * arg) {
+  char list[1024], * path, * next;
+  int i;
+
+  for (i = 0; i < SIM_PINS; i++) {
+    pins[i] = HAL_LOW;
+  }
+  if (arg == NULL || strlen(arg) >= sizeof(list)) {
+    errno = EINVAL;
+    return -1;
+  }
+  strcpy(list, arg);
+  for (path = list; path != NULL; path = next) {
+    if ((next = strchr(path, ',')) != NULL) {
+      *next++ = '\0';
+    }
+    if (ntraces == MAX_ZONES) {
+      errno = E2BIG;
+      return -1;
+    }
+    traces[ntraces].zone = ntraces;
+    if (loadTrace(&traces[ntraces], path) < 0) {
+      return -1;
+    }
+    ntraces++;
+  }
+  running = ntraces;
+  return 0;
+}
+
+static void
+simPinMode(int pin, int mode) {
+}
+
+static void
+simPullUpDn(int pin, int pud) {
+  if (pin >= 0 && pin < SIM_PINS) {
+    pins[pin] = pud == HAL_PUD_UP ? HAL_HIGH : HAL_LOW;
+  }
+}
+
+static void
+simDigitalWrite(int pin, int value) {
+  if (pin < 0 || pin >= SIM_PINS) {
+    return;
+  }
+  if (pins[pin] != value) {
+    fprintf(stderr, "sim: %.3f pin %d %s\n", halNow() / 1e9, pin, value ? "high" : "low");
+  }
+  pins[pin] = value;
+}
+
+static int
+simDigitalRead(int pin) {
+  return pin >= 0 && pin < SIM_PINS ? pins[pin] : HAL_LOW;
+}
+
+static int
+simAnalogRead(int pin) {
+  return pin >= 0 && pin < SIM_PINS ? atomic_load_explicit(&analog[pin], memory_order_relaxed) : 0;
+}
+
+/**
+ * A zone past the last trace just never sees a pulse.
+ */
+static int
+simPulseStart(int zone, int pin, hal_pulse_fn fn, hal_done_fn done) {
+  pthread_t thread;
+  int err;
+
+  if (zone < 0 || zone >= ntraces) {
+    return 0;
+  }
+  traces[zone].pulse_fn = fn;
+  done_fn = done;
+  if ((err = pthread_create(&thread, NULL, simThread, &traces[zone])) != 0) {
+    errno = err;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+static int
+simEdgeStart(int pin, hal_edge_fn fn) {
+  if (pin < 0 || pin >= SIM_PINS) {
+    errno = EINVAL;
+    return -1;
+  }
+  edge_fn[pin] = fn;
+  return 0;
+}
+
+const struct hal halSim = {
+  "sim",
+  simSetup,
+  simPinMode,
+  simPullUpDn,
+  simDigitalWrite,
+  simDigitalRead,
+  simPulseStart,
+  simEdgeStart,
+  simAnalogRead
+};
@@ -0,0 +1,129 @@
+/**
+ * The real pins, through wiringPi.
+ */
+#include <wiringPi.h>
+#include "hal.h"
+#include "zone.h"
+
+static hal_pulse_fn pulse_fn[MAX_ZONES];
+static hal_edge_fn edge_fn;
+static int edge_pin[MAX_ZONES];
+static int edge_pins = 0;
+
+static int
+wpSetup(const char * arg) {
+  // Later versions die internally, no need to check result
+  wiringPiSetup();
+  return 0;
+}
+
+static void
+wpPinMode(int pin, int mode) {
+  pinMode(pin, mode == HAL_OUTPUT ? OUTPUT : INPUT);
+}
+
+static void
+wpPullUpDn(int pin, int pud) {
+  pullUpDnControl(pin, pud == HAL_PUD_UP ? PUD_UP : PUD_OFF);
+}
+
+static void
+wpDigitalWrite(int pin, int value) {
+  digitalWrite(pin, value ? HIGH : LOW);
+}
+
+static int
+wpDigitalRead(int pin) {
+  return digitalRead(pin);
+}
+
+static int
+wpAnalogRead(int pin) {
+  return analogRead(pin);
+}
+
+/**
+ * wiringPi gives us no timestamp, so take our own.  Nor does it pass
+ * anything to the ISR, so each zone needs one of its own.
+ */
+static void
+wpClick0(void) {
+  pulse_fn[0](0, halNow());
+}
+
+static void
+wpClick1(void) {
+  pulse_fn[1](1, halNow());
+}
+
+static void
+wpClick2(void) {
+  pulse_fn[2](2, halNow());
+}
+
+static void
+wpClick3(void) {
+  pulse_fn[3](3, halNow());
+}
+
+static void (*wp_click[MAX_ZONES])(void) = { wpClick0, wpClick1, wpClick2, wpClick3 };
+
+static int
+wpPulseStart(int zone, int pin, hal_pulse_fn fn, hal_done_fn done) {
+  pulse_fn[zone] = fn;
+  return wiringPiISR(pin, INT_EDGE_RISING, wp_click[zone]);
+}
+
+/**
+ * Same again for the buttons, zones may share one so these go by pin.
+ */
+static void
+wpEdge0(void) {
+  edge_fn(edge_pin[0]);
+}
+
+static void
+wpEdge1(void) {
+  edge_fn(edge_pin[1]);
+}
+
+static void
+wpEdge2(void) {
+  edge_fn(edge_pin[2]);
+}
+
+static void
+wpEdge3(void) {
+  edge_fn(edge_pin[3]);
+}
+
+static void (*wp_edge[MAX_ZONES])(void) = { wpEdge0, wpEdge1, wpEdge2, wpEdge3 };
+
+static int
+wpEdgeStart(int pin, hal_edge_fn fn) {
+  int i;
+
+  for (i = 0; i < edge_pins; i++) {
+    if (edge_pin[i] == pin) {
+      return 0;
+    }
+  }
+  if (edge_pins == MAX_ZONES) {
+    return -1;
+  }
+  edge_fn = fn;
+  edge_pin[edge_pins] = pin;
+  return wiringPiISR(pin, INT_EDGE_BOTH, wp_edge[edge_pins++]);
+}
+
+const struct hal halWiringPi = {
+  "wiringpi",
+  wpSetup,
+  wpPinMode,
+  wpPullUpDn,
+  wpDigitalWrite,
+  wpDigitalRead,
+  wpPulseStart,
+  wpEdgeStart,
+  wpAnalogRead
+};
@@ -0,0 +1,163 @@
+/**
+ * Loop health monitor, see health.h.
+ *
+ * Marking a pass costs the loop a store at each end, and a semaphore
+ * post on the first pass after the monitor has gone to sleep.  The
+ * monitor only sleeps once it has seen the loop waiting, and the loop
+ * waiting is all it ever sees until a post, so a quiet loop never
+ * wakes it.  Each stuck pass is failed once, however long it goes on.
+ * Passes are timed on CLOCK_MONOTONIC, as max_lag and our own sleeps
+ * are real milliseconds whatever speed the hal clock runs at.  Only
+ * the time a stall is reported at is on the hal clock, like the
+ * pulses.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "health.h"
+#include "hal.h"
+
+static _Atomic int64_t pass_start = 0; // CLOCK_MONOTONIC, 0 while the loop is waiting
+static _Atomic int64_t bound = (int64_t)HEALTH_MAX_LAG * 1000000;
+static _Atomic int64_t stalled = 0;    // When a stall was failed, for the loop
+static _Atomic int64_t lag_max = 0;
+static atomic_uint backlog_max = 0;
+static atomic_uint stalls = 0;
+static atomic_int sleeping = 0;       // The monitor is, or is about to be, waiting on wake
+static sem_t wake;
+static struct pulse_ring * ring;
+static int nrings;
+static health_fail_fn fail_fn;
+
+static int64_t
+monoNow(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Keep the most pulses waiting in any ring.  The loop and the monitor
+ * both look, so the most is only ever raised.
+ */
+static void
+sampleBacklog(void) {
+  unsigned int backlog, most;
+  int z;
+
+  for (z = 0; z < nrings; z++) {
+    backlog = atomic_load_explicit(&ring[z].head, memory_order_relaxed)
+      - atomic_load_explicit(&ring[z].tail, memory_order_relaxed);
+    most = atomic_load_explicit(&backlog_max, memory_order_relaxed);
+    while (backlog > most
+      && !atomic_compare_exchange_weak_explicit(&backlog_max, &most, backlog, memory_order_relaxed, memory_order_relaxed))
+      ;
+  }
+}
+
+static void *
+healthThread(void * arg) {
+  struct timespec pause = { 0, HEALTH_CHECK * 1000000L };
+  int64_t start, lag, failed = 0, limit;
+
+  while (1) {
+    // Either this sees the pass start or the loop sees us asleep and posts
+    atomic_store(&sleeping, 1);
+    if (atomic_load(&pass_start) == 0) {
+      while (sem_wait(&wake) < 0 && errno == EINTR)
+        ;
+    }
+    atomic_store(&sleeping, 0);
+    // Posts for passes we were already awake for
+    while (sem_trywait(&wake) == 0)
+      ;
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &pause, &pause) == EINTR)
+      ;
+    pause.tv_nsec = HEALTH_CHECK * 1000000L;
+    sampleBacklog();
+    if ((start = atomic_load(&pass_start)) == 0) {
+      continue;
+    }
+    lag = monoNow() - start;
+    if (lag > atomic_load_explicit(&lag_max, memory_order_relaxed)) {
+      atomic_store_explicit(&lag_max, lag, memory_order_relaxed);
+    }
+    limit = atomic_load_explicit(&bound, memory_order_relaxed);
+    if (limit > 0 && lag > limit && start != failed) {
+      failed = start;
+      atomic_fetch_add_explicit(&stalls, 1, memory_order_relaxed);
+      atomic_store_explicit(&stalled, halNow(), memory_order_release);
+      fail_fn(lag);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Start watching the loop, which takes pulses from rings, calling fail
+ * if it gets stuck.
+ */
+int
+healthStart(struct pulse_ring * rings, int zones, health_fail_fn fail) {
+  pthread_t thread;
+  int err;
+
+  ring = rings;
+  nrings = zones;
+  fail_fn = fail;
+  sem_init(&wake, 0, 0);
+  if ((err = pthread_create(&thread, NULL, healthThread, NULL)) != 0) {
+    errno = err;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/**
+ * Longest a pass can take, 0 for no limit.
+ */
+void
+healthBound(int ms) {
+  atomic_store(&bound, (int64_t)ms * 1000000);
+}
+
+/**
+ * The loop has woken at now, on CLOCK_MONOTONIC.  What built up in the
+ * rings while it waited is all there now, before it is taken.
+ */
+void
+healthPass(int64_t now) {
+  sampleBacklog();
+  atomic_store(&pass_start, now);
+  if (atomic_load(&sleeping)) {
+    sem_post(&wake);
+  }
+}
+
+/**
+ * The loop is going back to waiting.
+ */
+void
+healthIdle(void) {
+  atomic_store_explicit(&pass_start, 0, memory_order_release);
+}
+
+/**
+ * When the loop was found stuck, if it has been since the last look,
+ * otherwise 0.
+ */
+int64_t
+healthStalled(void) {
+  return atomic_exchange_explicit(&stalled, 0, memory_order_acquire);
+}
+
+void
+healthRead(struct health_stats * out) {
+  out->lag_max = atomic_load(&lag_max);
+  out->backlog_max = atomic_load(&backlog_max);
+  out->stalls = atomic_load(&stalls);
+}
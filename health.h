@@ -0,0 +1,42 @@
+/**
+ * Watching over the main loop from outside it.
+ *
+ * The loop marks when each pass starts and when it goes back to
+ * waiting, and while it is busy a thread of its own looks every
+ * HEALTH_CHECK ms at how long the pass under way has been going and how
+ * many pulses are waiting in the rings, keeping the worst of each for
+ * the stats.  While the loop is waiting the thread sleeps until the
+ * next pass starts, and the rings are looked at as each pass starts
+ * instead, when everything that came in during the wait is still in
+ * them.  A pass that has gone on longer than max_lag means
+ * the loop is stuck, on a card that has stopped answering say, and is
+ * cutting nothing off.  The monitor then calls the daemon's fail
+ * function, from its own thread, to turn the pumps off, and
+ * healthStalled() tells the loop if it ever gets going again so the
+ * zones are stopped properly.
+ */
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>
+#include "pulsering.h"
+
+#define HEALTH_CHECK 100    // ms between looks at the loop
+#define HEALTH_MAX_LAG 5000 // ms a pass can take before we fail safe, as a default
+
+struct health_stats {
+  int64_t lag_max;          // Longest pass seen, real ns
+  unsigned int backlog_max; // Most pulses seen waiting in one ring
+  unsigned int stalls;      // Times the loop has been found stuck
+};
+
+typedef void (*health_fail_fn)(int64_t lag);
+
+int healthStart(struct pulse_ring * rings, int zones, health_fail_fn fail);
+void healthBound(int ms);
+void healthPass(int64_t now);
+void healthIdle(void);
+int64_t healthStalled(void);
+void healthRead(struct health_stats * out);
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * Fixed size log-linear latency histograms.
+ *
+ * Every power of two of nanoseconds is split into HIST_SUB linear
+ * buckets, so a bucket is never wider than an eighth of the values in
+ * it.  Recording is a count leading zeros and an increment, nothing is
+ * ever allocated, and the whole thing is plain counters so it can sit
+ * in the telemetry segment for other programs to read.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 36 // 2^37 ns is over two minutes, anything longer goes in the last bucket
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct hist {
+  uint64_t count;
+  uint64_t sum;   // ns
+  int64_t max;    // ns
+  uint32_t bucket[HIST_BUCKETS];
+};
+
+static inline int
+histBucket(int64_t ns) {
+  uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+  int e;
+
+  if (v < HIST_SUB) {
+    return v;
+  }
+  e = 63 - __builtin_clzll(v);
+  if (e > HIST_MAX_EXP) {
+    return HIST_BUCKETS - 1;
+  }
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * Smallest value that falls in bucket i.
+ */
+static inline int64_t
+histValue(int i) {
+  int e;
+
+  if (i < HIST_SUB) {
+    return i;
+  }
+  e = i / HIST_SUB + HIST_SUB_BITS - 1;
+  return (int64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static inline void
+histRecord(struct hist * h, int64_t ns) {
+  h->bucket[histBucket(ns)]++;
+  h->count++;
+  h->sum += ns > 0 ? ns : 0;
+  if (ns > h->max) {
+    h->max = ns;
+  }
+}
+
+/**
+ * Value p percent of the samples are at or below, to within a bucket.
+ * The top of the bucket is given, so this never flatters.
+ */
+static inline int64_t
+histPercentile(const struct hist * h, int p) {
+  uint64_t want, seen = 0;
+  int64_t top;
+  int i;
+
+  if (h->count == 0) {
+    return 0;
+  }
+  want = (h->count * p + 99) / 100;
+  for (i = 0; i < HIST_BUCKETS - 1; i++) {
+    seen += h->bucket[i];
+    if (seen >= want) {
+      break;
+    }
+  }
+  top = i < HIST_BUCKETS - 1 ? histValue(i + 1) - 1 : h->max;
+  return top < h->max ? top : h->max;
+}
+
+#endif
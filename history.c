@@ -0,0 +1,332 @@
+/**
+ * Usage history, see history.h.
+ *
+ * Record 0 of the file is the header, which keeps every chunk of
+ * records page aligned so the chunk being appended to can be mapped
+ * on its own.  The end of the history is found at startup with a
+ * binary search for the first unused record.  Once a chunk is half
+ * full the file is grown and the next one mapped from historyFlush(),
+ * so append() on the cutoff path only ever writes to memory.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+#define HISTORY_SYNC 600 // Most seconds of history we risk on a crash
+#define CHUNK_BYTES (HISTORY_CHUNK * sizeof(struct history_record))
+
+static int hist_fd = -1;
+static struct history_record * chunk = MAP_FAILED;
+static uint64_t chunk_no;   // Chunk currently mapped
+static struct history_record * ahead = MAP_FAILED; // The one after it, ready before it is needed
+static uint64_t ahead_no;
+static struct history_record * done = MAP_FAILED;  // The one before it, left to unmap later
+static uint64_t slots;      // Records the file has room for
+static uint64_t next;       // Next record to write
+static time_t last_sync;
+static time_t minute[MAX_ZONES];  // Minute each zone is totalling flow for
+static uint64_t minute_clicks[MAX_ZONES];
+static uint64_t minute_volume[MAX_ZONES]; // Microlitres
+static sem_t sync_sem;
+static pthread_t sync_thread;
+static int stopping = 0;
+
+static int
+recordType(uint64_t i) {
+  struct history_record rec;
+
+  if (pread(hist_fd, &rec, sizeof(rec), i * sizeof(rec)) != sizeof(rec)) {
+    return HIST_NONE;
+  }
+  return rec.type;
+}
+
+static void *
+mapAt(uint64_t n) {
+  return mmap(NULL, CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, hist_fd, n * CHUNK_BYTES);
+}
+
+static void
+unmap(struct history_record ** map) {
+  if (*map != MAP_FAILED) {
+    munmap(*map, CHUNK_BYTES);
+    *map = MAP_FAILED;
+  }
+}
+
+/**
+ * Make chunk n the one being written, from ahead if it is there.
+ */
+static int
+mapChunk(uint64_t n) {
+  void * map;
+
+  if (chunk != MAP_FAILED && chunk_no == n) {
+    return 0;
+  }
+  if (ahead != MAP_FAILED && ahead_no == n) {
+    map = ahead;
+    ahead = MAP_FAILED;
+  } else if ((map = mapAt(n)) == MAP_FAILED) {
+    return -1;
+  }
+  unmap(&done);
+  done = chunk;
+  chunk = map;
+  chunk_no = n;
+  return 0;
+}
+
+/**
+ * Let go of the chunk before the one being written, and once that is
+ * half full grow the file and map the next, for append() to find.
+ */
+static void
+growAhead(void) {
+  uint64_t n = next / HISTORY_CHUNK + 1;
+
+  if (hist_fd < 0) {
+    return;
+  }
+  unmap(&done);
+  if (next % HISTORY_CHUNK < HISTORY_CHUNK / 2 || (ahead != MAP_FAILED && ahead_no == n)) {
+    return;
+  }
+  if (slots < (n + 1) * HISTORY_CHUNK) {
+    if (ftruncate(hist_fd, (n + 1) * CHUNK_BYTES) < 0) {
+      return;
+    }
+    slots = (n + 1) * HISTORY_CHUNK;
+  }
+  unmap(&ahead);
+  ahead = mapAt(n);
+  ahead_no = n;
+}
+
+static void *
+syncThreadMain(void * arg) {
+  while (1) {
+    while (sem_wait(&sync_sem) < 0 && errno == EINTR)
+      ;
+    if (stopping) {
+      break;
+    }
+    fdatasync(hist_fd);
+  }
+  return NULL;
+}
+
+static void
+append(time_t t, int zone, int type, int reason, uint64_t clicks, uint64_t volume) {
+  struct history_record * rec;
+
+  if (hist_fd < 0) {
+    return;
+  }
+  // Only if growAhead() hasn't had the chance
+  if (next >= slots) {
+    if (ftruncate(hist_fd, (slots + HISTORY_CHUNK) * sizeof(*rec)) < 0) {
+      return;
+    }
+    slots += HISTORY_CHUNK;
+  }
+  if (mapChunk(next / HISTORY_CHUNK) < 0) {
+    return;
+  }
+  rec = &chunk[next % HISTORY_CHUNK];
+  rec->time = t;
+  rec->reason = reason;
+  rec->zone = zone;
+  rec->clicks = clicks;
+  rec->ml = volume / 1000;
+  __atomic_store_n(&rec->type, type, __ATOMIC_RELEASE);
+  next++;
+  if (t - last_sync >= HISTORY_SYNC) {
+    historySync(t);
+  }
+}
+
+/**
+ * Write out zone z's totals for its minute, and go on to the next.
+ */
+static void
+appendMinute(int z) {
+  append(minute[z], z, HIST_USAGE, 0, minute_clicks[z], minute_volume[z]);
+  minute_clicks[z] = 0;
+  minute_volume[z] = 0;
+  minute[z] += 60;
+}
+
+/**
+ * Open (or create) the history file and find where it ends.
+ */
+int
+historyOpen(const char * path) {
+  struct history_header hdr;
+  struct stat st;
+  char dir[256], old[272];
+  uint64_t lo, hi, mid;
+  int err;
+
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = 0;
+  mkdir(dirname(dir), 0755);
+  if ((hist_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+    return -1;
+  }
+  if (fstat(hist_fd, &st) < 0) {
+    goto fail;
+  }
+  if (st.st_size > 0 && (pread(hist_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != HISTORY_MAGIC)) {
+    errno = EINVAL;
+    goto fail;
+  }
+  if (st.st_size > 0 && (hdr.version != HISTORY_VERSION || hdr.record_size != sizeof(struct history_record))) {
+    // Kept rather than written over, and a new one started
+    close(hist_fd);
+    snprintf(old, sizeof(old), "%s.old", path);
+    if (rename(path, old) < 0 || (hist_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+      hist_fd = -1;
+      return -1;
+    }
+    st.st_size = 0;
+  }
+  if (st.st_size == 0) {
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = HISTORY_MAGIC;
+    hdr.version = HISTORY_VERSION;
+    hdr.record_size = sizeof(struct history_record);
+    if (ftruncate(hist_fd, CHUNK_BYTES) < 0
+     || pwrite(hist_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      goto fail;
+    }
+    st.st_size = CHUNK_BYTES;
+  }
+  slots = st.st_size / sizeof(struct history_record);
+  // First unused record, everything before it has been written
+  lo = 1;
+  hi = slots;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (recordType(mid) == HIST_NONE) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  next = lo;
+  sem_init(&sync_sem, 0, 0);
+  if ((err = pthread_create(&sync_thread, NULL, syncThreadMain, NULL)) != 0) {
+    errno = err;
+    goto fail;
+  }
+  last_sync = 0;
+  return 0;
+
+fail:
+  close(hist_fd);
+  hist_fd = -1;
+  return -1;
+}
+
+/**
+ * Write out what we have, sync it and let go of the file.
+ */
+void
+historyClose(void) {
+  int z;
+
+  if (hist_fd < 0) {
+    return;
+  }
+  for (z = 0; z < MAX_ZONES; z++) {
+    if (minute_clicks[z]) {
+      appendMinute(z);
+    }
+  }
+  stopping = 1;
+  sem_post(&sync_sem);
+  pthread_join(sync_thread, NULL);
+  fdatasync(hist_fd);
+  unmap(&chunk);
+  unmap(&ahead);
+  unmap(&done);
+  close(hist_fd);
+  hist_fd = -1;
+}
+
+/**
+ * Add flow at time t, in clicks and microlitres, to the zone's total
+ * for its minute, writing out the zone's previous minute once we have
+ * moved on from it.  Each zone goes by its own minute, as the loop
+ * gets round to the zones' pulses in turn rather than in time order,
+ * and flow that turns up late for a minute already written goes in
+ * the one after it.
+ */
+void
+historyFlow(time_t t, int zone, unsigned int clicks, uint64_t volume) {
+  time_t m = t - t % 60;
+
+  if (m > minute[zone] && minute_clicks[zone]) {
+    appendMinute(zone);
+  }
+  if (m > minute[zone]) {
+    minute[zone] = m;
+  }
+  minute_clicks[zone] += clicks;
+  minute_volume[zone] += volume;
+}
+
+/**
+ * Write out the minutes being totalled that are over by time t, and
+ * have the next chunk ready if it will be wanted soon.  Returns the
+ * seconds until the next minute is over, or 0 if there is nothing left
+ * to write.
+ */
+int
+historyFlush(time_t t) {
+  int z, wait = 0;
+
+  growAhead();
+  for (z = 0; z < MAX_ZONES; z++) {
+    if (!minute_clicks[z]) {
+      continue;
+    }
+    if (t >= minute[z] + 60) {
+      appendMinute(z);
+    } else if (!wait || minute[z] + 60 - t < wait) {
+      wait = minute[z] + 60 - t;
+    }
+  }
+  return wait;
+}
+
+/**
+ * Record an event as it happens, and get it on to disk.
+ */
+void
+historyEvent(time_t t, int zone, int type, int reason, uint64_t clicks, uint64_t volume) {
+  append(t, zone, type, reason, clicks, volume);
+  historySync(t);
+}
+
+/**
+ * Have the sync thread get everything written so far on to disk, at
+ * time t on the same clock as the records.
+ */
+void
+historySync(time_t t) {
+  if (hist_fd < 0) {
+    return;
+  }
+  last_sync = t;
+  sem_post(&sync_sem);
+}
@@ -0,0 +1,56 @@
+/**
+ * Usage history in an append-only file of fixed size records.
+ *
+ * Flow is totalled per minute for each zone, and cutoffs, resets and
+ * restarts are recorded as they happen.  Records are written straight into a
+ * mapping of the end of the file, which grows a chunk at a time, and
+ * a helper thread syncs it to disk now and then so the SD card sees a
+ * few large writes instead of many small ones.  A file from an older
+ * version is moved aside to .old and a new one started.
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <time.h>
+#include "zone.h"
+
+#define HISTORY_FILE "/var/lib/waterfuse/history"
+#define HISTORY_MAGIC 0x31484657 // "WFH1"
+#define HISTORY_VERSION 2        // Counts went to 64 bits
+#define HISTORY_CHUNK 4096       // Records added each time the file grows
+
+enum history_type {
+  HIST_NONE,     // Unused record, the end of the history
+  HIST_USAGE,    // Flow during the minute starting at time
+  HIST_CUTOFF,   // Pump turned off, reason from stop_msg
+  HIST_RESET,    // Pump turned back on, reason from reset_msg
+  HIST_START,    // Daemon started
+  HIST_SHUTDOWN, // Daemon stopped
+  HIST_ALARM     // Something for someone to look at, reason from alarm_msg
+};
+
+struct history_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint32_t reserved[2];
+};
+
+struct history_record {
+  uint32_t time;   // CLOCK_REALTIME seconds
+  uint8_t type;    // Written last, so a torn record reads as HIST_NONE
+  uint8_t reason;
+  uint16_t zone;   // Index in the config, 0 for events that aren't about one
+  uint64_t clicks;
+  uint64_t ml;     // Millilitres
+};
+
+int historyOpen(const char * path);
+void historyClose(void);
+void historyFlow(time_t t, int zone, unsigned int clicks, uint64_t volume);
+int historyFlush(time_t t);
+void historyEvent(time_t t, int zone, int type, int reason, uint64_t clicks, uint64_t volume);
+void historySync(time_t t);
+
+#endif
@@ -0,0 +1,219 @@
+/**
+ * Non-blocking log output, see logger.h.
+ *
+ * The queue is a bounded multi-producer ring where every slot carries
+ * a sequence number saying whose turn it is, so producers only ever
+ * compete on a compare-and-swap and never wait on each other.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <time.h>
+#include "logger.h"
+#include "logring.h"
+
+#define LOG_MASK (LOG_SLOTS - 1)
+#define LOG_OUT 8192 // Written out in chunks up to this size
+
+struct log_slot {
+  atomic_uint seq;
+  int64_t stamp; // CLOCK_REALTIME seconds
+  char text[LOG_TEXT];
+};
+
+static struct log_slot slots[LOG_SLOTS];
+static atomic_uint enq_pos;
+static unsigned int deq_pos;
+static atomic_uint dropped;
+static atomic_uint total_dropped;
+static atomic_int stopping;
+static sem_t log_sem;
+static pthread_t log_thread;
+static int log_fd = 1;
+static int running = 0;
+static int use_ring = 0;
+
+void
+logInit(void) {
+  int i;
+
+  for (i = 0; i < LOG_SLOTS; i++) {
+    atomic_init(&slots[i].seq, i);
+  }
+  sem_init(&log_sem, 0, 0);
+}
+
+/**
+ * Format a message into the next free slot, never blocks.
+ */
+void
+logPrintv(const char * fmt, va_list args) {
+  struct log_slot * slot;
+  unsigned int pos, seq;
+  struct timespec ts;
+
+  pos = atomic_load_explicit(&enq_pos, memory_order_relaxed);
+  while (1) {
+    slot = &slots[pos & LOG_MASK];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&enq_pos, &pos, pos + 1,
+          memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if ((int)(seq - pos) < 0) {
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&enq_pos, memory_order_relaxed);
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  slot->stamp = ts.tv_sec;
+  vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  sem_post(&log_sem);
+}
+
+static void
+logFlush(char * out, size_t * len) {
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < *len) {
+    n = write(log_fd, out + done, *len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  *len = 0;
+}
+
+static void
+logAppend(char * out, size_t * len, const char * date, const char * text) {
+  size_t need;
+
+  need = strlen(date) + strlen(text);
+  if (*len + need > LOG_OUT) {
+    logFlush(out, len);
+  }
+  *len += snprintf(out + *len, LOG_OUT - *len, "%s%s", date, text);
+}
+
+static void *
+logThreadMain(void * arg) {
+  static char out[LOG_OUT];
+  struct log_slot * slot;
+  struct tm parts;
+  time_t last = time(0), date_stamp = -1;
+  char date[32] = "";
+  char note[64];
+  unsigned int lost;
+  size_t len = 0;
+
+  while (1) {
+    while (sem_wait(&log_sem) < 0 && errno == EINTR)
+      ;
+    while (1) {
+      slot = &slots[deq_pos & LOG_MASK];
+      if (atomic_load_explicit(&slot->seq, memory_order_acquire) != deq_pos + 1) {
+        break;
+      }
+      last = slot->stamp;
+      if (use_ring) {
+        logRingWrite(slot->stamp, slot->text, strlen(slot->text));
+        atomic_store_explicit(&slot->seq, deq_pos + LOG_SLOTS, memory_order_release);
+        deq_pos++;
+        continue;
+      }
+      // Only redo the date when the second changes
+      if (slot->stamp != date_stamp) {
+        date_stamp = slot->stamp;
+        localtime_r(&date_stamp, &parts);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S ", &parts);
+      }
+      logAppend(out, &len, date, slot->text);
+      atomic_store_explicit(&slot->seq, deq_pos + LOG_SLOTS, memory_order_release);
+      deq_pos++;
+    }
+    if ((lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed)) > 0) {
+      atomic_fetch_add_explicit(&total_dropped, lost, memory_order_relaxed);
+      snprintf(note, sizeof(note), "%u log messages dropped\n", lost);
+      if (use_ring) {
+        logRingWrite(last, note, strlen(note));
+      } else {
+        logAppend(out, &len, date, note);
+      }
+    }
+    logFlush(out, &len);
+    if (atomic_load(&stopping)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Send messages to a ring log of size bytes at path from now on,
+ * rather than the fd given to logStart().  Has to come before that.
+ */
+int
+logRing(const char * path, size_t size) {
+  if (logRingOpen(path, size) < 0) {
+    return -1;
+  }
+  use_ring = 1;
+  return 0;
+}
+
+/**
+ * Start writing queued messages to fd.  Anything logged before this
+ * is held in the queue until then.
+ */
+int
+logStart(int fd) {
+  int err;
+
+  log_fd = fd;
+  if ((err = pthread_create(&log_thread, NULL, logThreadMain, NULL)) != 0) {
+    errno = err;
+    return -1;
+  }
+  running = 1;
+  return 0;
+}
+
+/**
+ * Write out whatever is still queued and stop the thread.
+ */
+void
+logStop(void) {
+  if (!running) {
+    return;
+  }
+  atomic_store(&stopping, 1);
+  sem_post(&log_sem);
+  pthread_join(log_thread, NULL);
+  running = 0;
+  if (use_ring) {
+    logRingClose();
+  }
+}
+
+/**
+ * Messages dropped since we started.
+ */
+unsigned int
+logDropped(void) {
+  return atomic_load_explicit(&total_dropped, memory_order_relaxed)
+    + atomic_load_explicit(&dropped, memory_order_relaxed);
+}
@@ -0,0 +1,40 @@
+/**
+ * Non-blocking log output.
+ *
+ * Callers format their message into a preallocated slot and carry on,
+ * a background thread adds the date and does the writing.  If the
+ * queue is full the message is dropped and counted rather than making
+ * the caller wait, and the count is reported once there is room.
+ *
+ * Messages normally go out as text with the date in front.  Once
+ * logRing() has been given a file they go into that instead, as
+ * records of a timestamp and the bare message, for wflog to turn back
+ * into text.
+ *
+ * Everything in the daemon logs through printLog(), which leaves lines
+ * above LOG_MAX out of the build and hands the rest to the daemon's
+ * logLine() to be checked against the verbosity and queued.
+ */
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#define LOG_SLOTS 256 // Must be a power of two
+#define LOG_TEXT 240  // Longest message we keep
+
+#ifndef LOG_MAX
+#define LOG_MAX 9
+#endif
+#define printLog(level, ...) do { if ((level) <= LOG_MAX) logLine(level, __VA_ARGS__); } while (0)
+
+void logInit(void);
+int logRing(const char * path, size_t size);
+int logStart(int fd);
+void logStop(void);
+void logPrintv(const char * fmt, va_list args);
+unsigned int logDropped(void);
+void logLine(int level, const char * fmt, ...);
+
+#endif
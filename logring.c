@@ -0,0 +1,110 @@
+/**
+ * Ring log writer, see logring.h.
+ *
+ * Only the log thread writes, so there is no locking here, just the
+ * ordering readers need to spot a record being overwritten under them.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logring.h"
+
+static struct logring_header * ring = MAP_FAILED;
+static size_t ring_len = 0;
+
+static void
+put(uint64_t pos, const void * in, size_t len) {
+  char * data = (char *)(ring + 1);
+  size_t off = pos % ring->size;
+  size_t first = len < ring->size - off ? len : ring->size - off;
+
+  memcpy(data + off, in, first);
+  memcpy(data, (const char *)in + first, len - first);
+}
+
+/**
+ * Map path as a ring of size bytes, carrying on from what is there if
+ * it is a ring of the same size, starting afresh if not.
+ */
+int
+logRingOpen(const char * path, size_t size) {
+  struct stat st;
+  size_t len = sizeof(*ring) + size;
+  int fd, err;
+
+  if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || ((size_t)st.st_size != len && ftruncate(fd, len) < 0)) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  // Allocate the blocks now, so the card isn't asked for them line by line
+  posix_fallocate(fd, 0, len);
+  ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    return -1;
+  }
+  ring_len = len;
+  if (ring->magic != LOGRING_MAGIC || ring->version != LOGRING_VERSION || ring->size != size
+   || atomic_load(&ring->tail) > atomic_load(&ring->head)
+   || atomic_load(&ring->head) - atomic_load(&ring->tail) > size) {
+    ring->magic = 0;
+    ring->version = LOGRING_VERSION;
+    ring->size = size;
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_thread_fence(memory_order_release);
+    ring->magic = LOGRING_MAGIC;
+  }
+  return 0;
+}
+
+/**
+ * Append one message, dropping as many of the oldest as it takes.
+ */
+void
+logRingWrite(int64_t stamp, const char * text, size_t len) {
+  struct logring_record rec, old;
+  uint64_t head, tail, need;
+
+  if (ring == MAP_FAILED) {
+    return;
+  }
+  if (len > ring->size / 4) {
+    len = ring->size / 4;
+  }
+  need = LOGRING_ALIGN(sizeof(rec) + len);
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (head + need - tail > ring->size) {
+    logRingCopy(ring, tail, &old, sizeof(old));
+    tail += LOGRING_ALIGN(sizeof(old) + old.len);
+  }
+  // Readers check tail after copying, so it has to move first
+  atomic_store_explicit(&ring->tail, tail, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memset(&rec, 0, sizeof(rec));
+  rec.len = len;
+  rec.stamp = stamp;
+  put(head, &rec, sizeof(rec));
+  put(head + sizeof(rec), text, len);
+  atomic_store_explicit(&ring->head, head + need, memory_order_release);
+}
+
+void
+logRingClose(void) {
+  if (ring == MAP_FAILED) {
+    return;
+  }
+  msync(ring, ring_len, MS_SYNC);
+  munmap(ring, ring_len);
+  ring = MAP_FAILED;
+}
@@ -0,0 +1,59 @@
+/**
+ * Size-capped log kept in a preallocated, mapped ring file.
+ *
+ * The file is a header followed by size bytes of records, each a
+ * binary timestamp and the message text, end to end with no dates or
+ * padding lines.  Positions only ever count up and are taken modulo
+ * size, so a record may wrap around the end.  The writer drops the
+ * oldest records to make room, moving tail before it touches their
+ * bytes and head once the new record is in, and a reader that finds
+ * tail has passed what it copied knows the copy may be torn.  Nothing
+ * is ever written but the mapping, so the SD card sees each dirty
+ * page once per writeback however many lines go through it.
+ */
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define LOGRING_FILE "/var/log/waterfuse.ring"
+#define LOGRING_MAGIC 0x474c4657 // "WFLG"
+#define LOGRING_VERSION 1
+#define LOGRING_MIN 16           // Smallest ring, kilobytes
+
+struct logring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;          // Bytes of records after the header
+  _Atomic uint64_t head;  // Position the next record goes at
+  _Atomic uint64_t tail;  // Position of the oldest record
+};
+
+struct logring_record {
+  uint32_t len;           // Text that follows
+  uint32_t reserved;
+  int64_t stamp;          // CLOCK_REALTIME seconds
+};
+
+#define LOGRING_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+int logRingOpen(const char * path, size_t size);
+void logRingWrite(int64_t stamp, const char * text, size_t len);
+void logRingClose(void);
+
+/**
+ * Copy len bytes from position pos, wrapping round the end.
+ */
+static inline void
+logRingCopy(const struct logring_header * h, uint64_t pos, void * out, size_t len) {
+  const char * data = (const char *)(h + 1);
+  size_t off = pos % h->size;
+  size_t first = len < h->size - off ? len : h->size - off;
+
+  __builtin_memcpy(out, data + off, first);
+  __builtin_memcpy((char *)out + first, data, len - first);
+}
+
+#endif
@@ -0,0 +1,238 @@
+/**
+ * Prometheus metrics, see metrics.h.
+ *
+ * The page is kept with room in front of it for the response header,
+ * so a response is the header and page in one buffer and goes out in
+ * as few sends as the socket allows.  While a client is still part way
+ * through it the page is left alone, even if it is out of date, and a
+ * new client that turns up when every slot is taken pushes out the one
+ * that has been there longest.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "metrics.h"
+
+#define METRICS_HEAD 128 // Room for the response header
+
+struct metrics_client {
+  int fd;
+  unsigned int serial;   // Order they came in, for pushing out the oldest
+  int in_len;
+  const char * out;      // Response, 0 until the request is in
+  int out_len;
+  int sent;
+  char in[METRICS_REQUEST];
+};
+
+static const char not_found[] =
+  "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot found\n";
+
+static int metrics_epfd = -1;
+static int listen_fd = -1;
+static metrics_fn render;
+static struct metrics_client clients[METRICS_CLIENTS];
+static unsigned int serial = 0;
+static char page[METRICS_HEAD + METRICS_MAX];
+static const char * response;  // Header and page, somewhere in page[]
+static int response_len = 0;
+static int changed = 1;
+
+static void
+dropClient(struct metrics_client * c) {
+  epoll_ctl(metrics_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+}
+
+/**
+ * Build the page again if it has changed and nobody is reading it.
+ */
+static void
+refresh(void) {
+  char head[METRICS_HEAD];
+  int i, len, n;
+
+  if (!changed) {
+    return;
+  }
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    if (clients[i].fd >= 0 && response && clients[i].out == response) {
+      return;
+    }
+  }
+  len = render(page + METRICS_HEAD, METRICS_MAX);
+  n = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", len);
+  memcpy(page + METRICS_HEAD - n, head, n);
+  response = page + METRICS_HEAD - n;
+  response_len = n + len;
+  changed = 0;
+}
+
+/**
+ * Send what we can of the response, closing once it has all gone.
+ */
+static void
+sendMore(struct metrics_client * c) {
+  struct epoll_event ev;
+  ssize_t n;
+
+  while (c->sent < c->out_len) {
+    if ((n = send(c->fd, c->out + c->sent, c->out_len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+      if (errno == EAGAIN) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT | EPOLLRDHUP;
+        ev.data.fd = c->fd;
+        epoll_ctl(metrics_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+      }
+      break;
+    }
+    c->sent += n;
+  }
+  dropClient(c);
+}
+
+/**
+ * Answer the request once its header is all in.
+ */
+static void
+handleRequest(struct metrics_client * c) {
+  c->in[c->in_len] = '\0';
+  if (strstr(c->in, "\r\n\r\n") == NULL && strstr(c->in, "\n\n") == NULL) {
+    // Leave room for the terminator
+    if (c->in_len >= METRICS_REQUEST - 1) {
+      dropClient(c);
+    }
+    return;
+  }
+  if (strncmp(c->in, "GET /metrics", 12) == 0 && (c->in[12] == ' ' || c->in[12] == '?')) {
+    refresh();
+    c->out = response;
+    c->out_len = response_len;
+  } else {
+    c->out = not_found;
+    c->out_len = sizeof(not_found) - 1;
+  }
+  c->sent = 0;
+  sendMore(c);
+}
+
+/**
+ * Listen on address and port, loopback if address is empty, building
+ * pages with fn.
+ */
+int
+metricsOpen(int epfd, const char * address, int port, metrics_fn fn) {
+  struct sockaddr_in addr;
+  struct epoll_event ev;
+  int i, one = 1;
+
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (address[0] && inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    return -1;
+  }
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+   || listen(listen_fd, METRICS_CLIENTS) < 0) {
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  metrics_epfd = epfd;
+  render = fn;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+/**
+ * Deal with activity on fd if it is one of ours, returns non-zero if
+ * it was.
+ */
+int
+metricsEvent(int fd, uint32_t events) {
+  struct metrics_client * c;
+  struct epoll_event ev;
+  int i, client, oldest;
+  ssize_t n;
+
+  if (listen_fd < 0) {
+    return 0;
+  }
+  if (fd == listen_fd) {
+    while ((client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      for (i = 0, oldest = 0; i < METRICS_CLIENTS && clients[i].fd >= 0; i++) {
+        if ((int)(clients[i].serial - clients[oldest].serial) < 0) {
+          oldest = i;
+        }
+      }
+      if (i == METRICS_CLIENTS) {
+        i = oldest;
+        dropClient(&clients[i]);
+      }
+      c = &clients[i];
+      c->fd = client;
+      c->serial = serial++;
+      c->in_len = 0;
+      c->out = NULL;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.fd = client;
+      epoll_ctl(metrics_epfd, EPOLL_CTL_ADD, client, &ev);
+    }
+    return 1;
+  }
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    c = &clients[i];
+    if (c->fd != fd) {
+      continue;
+    }
+    if (c->out) {
+      if (events & (EPOLLHUP | EPOLLERR)) {
+        dropClient(c);
+      } else {
+        sendMore(c);
+      }
+      return 1;
+    }
+    n = recv(fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+      dropClient(c);
+      return 1;
+    }
+    if (n > 0) {
+      c->in_len += n;
+      handleRequest(c);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Something the page shows has moved, build it afresh for the next
+ * scrape.
+ */
+void
+metricsChanged(void) {
+  changed = 1;
+}
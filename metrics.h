@@ -0,0 +1,32 @@
+/**
+ * Prometheus metrics over HTTP, served from the main loop.
+ *
+ * Just enough HTTP to answer GET /metrics: every request gets one
+ * response and the connection is closed after it.  The page is built
+ * by the daemon's metrics_fn, and only when metricsChanged() has said
+ * something moved since the last one, so a scrape between changes is
+ * a copy out of a buffer we already have.  Like the control socket
+ * everything is non-blocking and a client that can't keep up is the
+ * one that loses out.  It listens on loopback unless told to listen on
+ * some other address, as the page names every zone and its state.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_CLIENTS 4    // Connections we will hold at once
+#define METRICS_MAX 32768    // Largest page
+#define METRICS_REQUEST 1024 // Longest request we will read
+#define METRICS_ADDRESS 16   // Longest IPv4 address to listen on
+
+/**
+ * Writes the page into out, returning its length.
+ */
+typedef int (*metrics_fn)(char * out, int size);
+
+int metricsOpen(int epfd, const char * address, int port, metrics_fn fn);
+int metricsEvent(int fd, uint32_t events);
+void metricsChanged(void);
+
+#endif
@@ -1,56 +1,103 @@
 'use strict'
 
-const fs = require('fs')
+const net = require('net')
 const path = require('path')
-const { on } = require('events')
-const stateFile = 'waterfuse.state'
+const { WebClient, LogLevel } = require("@slack/web-api")
 const stateDir = '/var/run/waterfuse'
+const socketPath = path.join(stateDir, 'waterfuse.sock')
 
-let fileContents = ""
-let oldContents = ""
+const batchDelay = 500       // Wait this long for more changes before sending
+const retryMin = 1000        // First retry / reconnect delay
+const retryMax = 60000       // They back off to no more than this
 
-const sendSlack = async function(message) {
-  const { WebClient, LogLevel } = require("@slack/web-api")
-  const channelId = process.env.slackChannel
+const channelId = process.env.slackChannel
+const client = new WebClient(process.env.slackToken, {
+  logLevel: LogLevel.DEBUG
+})
 
-  const token = process.env.slackToken
-  const client = new WebClient(token, {
-    logLevel: LogLevel.DEBUG
-  })
+let pending = []
+let lastState = {}       // Last line seen for each zone
+let sending = false
+let sendTimer = null
+let sendDelay = retryMin
+let connectDelay = retryMin
 
+// Send everything that has queued up as one message.  If Slack is
+// having a bad day the messages stay queued and we try again later.
+const sendSlack = async function() {
+  sendTimer = null
+  if (sending || pending.length === 0) {
+    return
+  }
+  sending = true
+  const batch = pending
+  pending = []
   const messageArgs = {
     channel: channelId,
-    text: message
+    text: batch.join('\n\n')
   }
 
   try {
-    const retval = client.chat.postMessage(messageArgs)
+    await client.chat.postMessage(messageArgs)
+    sendDelay = retryMin
   }
   catch (error) {
     console.error(error)
-    throw new Error(error)
+    pending = batch.concat(pending)
+    sendDelay = Math.min(sendDelay * 2, retryMax)
+  }
+  sending = false
+  if (pending.length) {
+    scheduleSend(sendDelay)
   }
 }
 
-// Poll the state file and check for changes, when we get a change
-// we send a message
-fs.watch(stateDir, (type, fname) => {
-  if (type === 'change' && fname && fname === stateFile) {
-    fs.readFile(path.join(stateDir,stateFile), (err,data) => {
-      fileContents = data.toString();
-    })
+const scheduleSend = function(delay) {
+  if (!sendTimer) {
+    sendTimer = setTimeout(sendSlack, delay)
   }
-})
-
-// Now we just keep an eye on the fileContent variable and if it changes
-// we send out a message.  State file has two words in it, started or stopped
-// and a reason code
+}
 
-setInterval(async () => {
-  if (oldContents != fileContents) {
-    oldContents = fileContents
-    const content = oldContents.split(/\s/)
-    const message = `*Pump Status Changed*\nPump is now ${content[0]}\nReason: ${content[1]}`
-    await sendSlack(message)
+// State lines have three words in them, started, stopped or alarm, a
+// reason code and the zone.  We are sent the current state of every
+// zone on connecting, so only pass on ones that differ from the last
+// we saw for that zone.
+const stateChanged = function(line) {
+  const content = line.split(/\s/)
+  const zone = content[2] || ''
+  if (line === lastState[zone]) {
+    return
   }
-},10)
+  lastState[zone] = line
+  if (content[0] === 'alarm') {
+    pending.push(`*Water Alarm*\nPump for ${zone} is still running\nReason: ${content[1]}`)
+  } else {
+    pending.push(`*Pump Status Changed*\nPump for ${zone} is now ${content[0]}\nReason: ${content[1]}`)
+  }
+  scheduleSend(batchDelay)
+}
+
+// Subscribe to the daemon, coming back whenever it goes away
+const connect = function() {
+  let buffered = ""
+  const sock = net.createConnection(socketPath)
+
+  sock.on('connect', () => {
+    connectDelay = retryMin
+  })
+  sock.on('data', (data) => {
+    buffered += data.toString()
+    const lines = buffered.split('\n')
+    buffered = lines.pop()
+    lines.filter((line) => line.length).forEach(stateChanged)
+  })
+  sock.on('error', (error) => {
+    console.error(`waterfuse socket: ${error.message}`)
+  })
+  sock.on('close', () => {
+    setTimeout(connect, connectDelay)
+    connectDelay = Math.min(connectDelay * 2, retryMax)
+  })
+}
+
+connect()
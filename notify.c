@@ -0,0 +1,139 @@
+/**
+ * State change notifications, see notify.h.
+ *
+ * Everything is non-blocking.  A subscriber that can't keep up, or
+ * has gone away, is dropped rather than holding up the main loop; it
+ * gets the current state again when it reconnects.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "notify.h"
+
+static int notify_epfd = -1;
+static int listen_fd = -1;
+static int clients[NOTIFY_CLIENTS];
+static char current[1024];
+static int current_len = 0;
+
+static void
+dropClient(int i) {
+  epoll_ctl(notify_epfd, EPOLL_CTL_DEL, clients[i], NULL);
+  close(clients[i]);
+  clients[i] = -1;
+}
+
+static int
+sendClient(int i, const char * msg, int len) {
+  if (send(clients[i], msg, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+    dropClient(i);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Listen on path, watching it and our subscribers through epfd.
+ */
+int
+notifyOpen(int epfd, const char * path) {
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  int i;
+
+  for (i = 0; i < NOTIFY_CLIENTS; i++) {
+    clients[i] = -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+   || listen(listen_fd, NOTIFY_CLIENTS) < 0) {
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  notify_epfd = epfd;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+/**
+ * Deal with activity on fd if it is one of ours, returns non-zero if
+ * it was.  Subscribers have nothing to say, so anything readable from
+ * them is either discarded or means they have hung up.
+ */
+int
+notifyEvent(int fd) {
+  struct epoll_event ev;
+  char junk[64];
+  int i, client;
+  ssize_t n;
+
+  if (listen_fd < 0) {
+    return 0;
+  }
+  if (fd == listen_fd) {
+    while ((client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      for (i = 0; i < NOTIFY_CLIENTS && clients[i] >= 0; i++)
+        ;
+      if (i == NOTIFY_CLIENTS) {
+        close(client);
+        continue;
+      }
+      clients[i] = client;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.fd = client;
+      epoll_ctl(notify_epfd, EPOLL_CTL_ADD, client, &ev);
+      if (current_len) {
+        sendClient(i, current, current_len);
+      }
+    }
+    return 1;
+  }
+  for (i = 0; i < NOTIFY_CLIENTS; i++) {
+    if (clients[i] == fd) {
+      n = recv(fd, junk, sizeof(junk), MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        dropClient(i);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Send a state line to every subscriber, and keep all, the lines for
+ * every zone, for new ones.
+ */
+void
+notifyPublish(const char * msg, int len, const char * all, int all_len) {
+  int i;
+
+  if (all_len > (int)sizeof(current)) {
+    all_len = sizeof(current);
+  }
+  memcpy(current, all, all_len);
+  current_len = all_len;
+  if (listen_fd < 0) {
+    return;
+  }
+  for (i = 0; i < NOTIFY_CLIENTS; i++) {
+    if (clients[i] >= 0) {
+      sendClient(i, msg, len);
+    }
+  }
+}
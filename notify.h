@@ -0,0 +1,17 @@
+/**
+ * State change notifications over a Unix domain socket.
+ *
+ * Subscribers just connect and read.  Every state line that goes to
+ * the state file is sent to each of them, and a new subscriber is
+ * sent the current state of every zone straight away.
+ */
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#define NOTIFY_CLIENTS 8 // Subscribers we will hold at once
+
+int notifyOpen(int epfd, const char * path);
+int notifyEvent(int fd);
+void notifyPublish(const char * msg, int len, const char * all, int all_len);
+
+#endif
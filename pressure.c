@@ -0,0 +1,190 @@
+/**
+ * Pressure sampling, see pressure.h.
+ *
+ * Settings are written by the loop and read by the sampling thread at
+ * the start of each batch, so a reload takes effect within a batch.
+ * Everything else belongs to the thread, apart from the latest value
+ * and a fall waiting for the loop.  The filter keeps four fraction
+ * bits so a slow change isn't lost to rounding.
+ */
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "pressure.h"
+#include "hal.h"
+#include "zone.h"
+
+#define NS 1000000000LL
+#define FRAC 4 // Fraction bits in the filtered value
+
+struct pressure_zone {
+  // Set by the loop
+  atomic_int pin;
+  atomic_int drop;          // Fall that trips, 0 for no rule
+  atomic_int window;        // Seconds
+  // For the loop
+  atomic_int latest;        // Filtered value, -1 until there is one
+  _Atomic int64_t tripped;  // When a fall was seen, 0 if none is waiting
+  // The thread's own
+  int falling;              // The last sample was a fall
+  int64_t value;            // Filtered, FRAC fraction bits
+  unsigned int n;           // Samples so far, stops counting at PRESSURE_RING
+  unsigned int head;
+  int64_t ring[PRESSURE_RING];
+};
+
+static struct pressure_zone zone[MAX_ZONES];
+static atomic_int rate = PRESSURE_RATE;
+static pressure_read_fn read_fn;
+static void (*wake_fn)(void);
+
+/**
+ * Take in the average of a batch, returns non-zero when that makes a
+ * fall that hasn't already been reported.
+ */
+static int
+addSample(struct pressure_zone * p, int64_t mean, int per_sec) {
+  unsigned int i, back;
+  int64_t top;
+  int drop, falling;
+
+  if (p->n == 0) {
+    p->value = mean << FRAC;
+  } else {
+    p->value += ((mean << FRAC) - p->value) / PRESSURE_WEIGHT;
+  }
+  p->ring[p->head++ & (PRESSURE_RING - 1)] = p->value;
+  if (p->n < PRESSURE_RING) {
+    p->n++;
+  }
+  atomic_store_explicit(&p->latest, p->value >> FRAC, memory_order_relaxed);
+  if ((drop = atomic_load_explicit(&p->drop, memory_order_relaxed)) <= 0) {
+    p->falling = 0;
+    return 0;
+  }
+  // Highest over the window, which the config has checked fits
+  back = (unsigned int)atomic_load_explicit(&p->window, memory_order_relaxed) * per_sec / PRESSURE_BATCH + 1;
+  if (back > p->n) {
+    back = p->n;
+  }
+  top = p->value;
+  for (i = 1; i <= back; i++) {
+    if (p->ring[(p->head - i) & (PRESSURE_RING - 1)] > top) {
+      top = p->ring[(p->head - i) & (PRESSURE_RING - 1)];
+    }
+  }
+  falling = top - p->value >= (int64_t)drop << FRAC;
+  // Only the start of a fall counts, not every batch it goes on for
+  if (falling && !p->falling) {
+    p->falling = 1;
+    return 1;
+  }
+  p->falling = falling;
+  return 0;
+}
+
+static void *
+pressureThread(void * arg) {
+  struct pressure_zone * p;
+  struct timespec until;
+  int64_t t, real, sum[MAX_ZONES];
+  int pins[MAX_ZONES];
+  int i, z, per_sec, wake;
+
+  t = halNow();
+  while (1) {
+    per_sec = atomic_load_explicit(&rate, memory_order_relaxed);
+    for (z = 0; z < MAX_ZONES; z++) {
+      pins[z] = atomic_load_explicit(&zone[z].drop, memory_order_relaxed) > 0
+        ? atomic_load_explicit(&zone[z].pin, memory_order_relaxed) : -1;
+      sum[z] = 0;
+    }
+    for (i = 0; i < PRESSURE_BATCH; i++) {
+      for (z = 0; z < MAX_ZONES; z++) {
+        if (pins[z] >= 0) {
+          sum[z] += read_fn(pins[z]);
+        }
+      }
+    }
+    wake = 0;
+    for (z = 0; z < MAX_ZONES; z++) {
+      p = &zone[z];
+      if (pins[z] >= 0 && addSample(p, sum[z] / PRESSURE_BATCH, per_sec)) {
+        atomic_store_explicit(&p->tripped, halNow(), memory_order_release);
+        wake = 1;
+      }
+    }
+    if (wake) {
+      wake_fn();
+    }
+    // On the hal clock, so the simulator samples as often as it should,
+    // and starting again from now rather than rushing to catch up
+    t += (int64_t)PRESSURE_BATCH * NS / per_sec;
+    if (t < halNow()) {
+      t = halNow();
+    }
+    real = halRealFor(t);
+    until.tv_sec = real / NS;
+    until.tv_nsec = real % NS;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+      ;
+  }
+  return NULL;
+}
+
+/**
+ * Start sampling with read, calling wake whenever there is a fall for
+ * the loop to take.
+ */
+int
+pressureStart(pressure_read_fn read, void (*wake)(void)) {
+  pthread_t thread;
+  int z, err;
+
+  read_fn = read;
+  wake_fn = wake;
+  for (z = 0; z < MAX_ZONES; z++) {
+    atomic_store(&zone[z].latest, -1);
+  }
+  if ((err = pthread_create(&thread, NULL, pressureThread, NULL)) != 0) {
+    errno = err;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/**
+ * A fall of drop within window seconds on pin trips zone, drop 0 to
+ * leave it be.  Zones without a rule aren't read at all.
+ */
+void
+pressureRules(int z, int pin, int drop, int window) {
+  atomic_store(&zone[z].pin, pin);
+  atomic_store(&zone[z].window, window);
+  atomic_store(&zone[z].drop, drop);
+}
+
+void
+pressureRate(int r) {
+  atomic_store(&rate, r > 0 ? r : PRESSURE_RATE);
+}
+
+/**
+ * Latest filtered pressure for zone, -1 if it isn't being read.
+ */
+int
+pressureLatest(int z) {
+  return atomic_load(&zone[z].drop) > 0 ? atomic_load(&zone[z].latest) : -1;
+}
+
+/**
+ * When a fall was seen on zone, on the hal clock, if there has been
+ * one since the last look, otherwise 0.
+ */
+int64_t
+pressureTripped(int z) {
+  return atomic_exchange_explicit(&zone[z].tripped, 0, memory_order_acquire);
+}
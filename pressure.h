@@ -0,0 +1,34 @@
+/**
+ * Pressure sampling, kept right out of the pulse path.
+ *
+ * A thread of its own, at ordinary priority, reads each zone's sensor
+ * PRESSURE_BATCH times back to back, once every PRESSURE_BATCH / rate
+ * seconds.  Each batch is averaged down to one sample, which goes
+ * through a low-pass filter into the zone's ring.  A zone whose
+ * filtered pressure falls by drop or more below the highest it has
+ * been within window seconds, as it does when a main bursts, has the
+ * fall noted and the loop woken, long before the meter could have
+ * counted enough pulses to tell.  The loop takes falls with
+ * pressureTripped() and decides what they mean.  Pressure is in
+ * whatever units the ADC reads in.
+ */
+#ifndef PRESSURE_H
+#define PRESSURE_H
+
+#include <stdint.h>
+
+#define PRESSURE_RATE 100  // Reads a second, unless the config says otherwise
+#define PRESSURE_BATCH 8   // Reads taken together and averaged into one sample
+#define PRESSURE_RING 1024 // Filtered samples kept for each zone
+#define PRESSURE_WEIGHT 4  // Each new sample counts for 1/4 of the filtered value
+#define PRESSURE_WINDOW 5  // Seconds a fall has to happen within, as a default
+
+typedef int (*pressure_read_fn)(int pin);
+
+int pressureStart(pressure_read_fn read, void (*wake)(void));
+void pressureRules(int zone, int pin, int drop, int window);
+void pressureRate(int rate);
+int pressureLatest(int zone);
+int64_t pressureTripped(int zone);
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * Single producer, single consumer ring of pulse timestamps.
+ *
+ * The ISR thread pushes a monotonic timestamp for every pulse and the
+ * main loop drains them in batches.  Head and tail are free running
+ * counters, each on its own cache line, so neither side ever writes a
+ * line the other is spinning on.  If the ring fills up the pulse is
+ * still counted in dropped, only its timestamp is lost.
+ */
+#ifndef PULSERING_H
+#define PULSERING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define PULSE_RING_SIZE 4096 // Must be a power of two
+#define PULSE_RING_MASK (PULSE_RING_SIZE - 1)
+#define PULSE_RING_NEVER 0x7fffffffU // Far enough ahead never to be reached
+#define CACHE_LINE 64
+
+struct pulse_ring {
+  // Producer side
+  _Alignas(CACHE_LINE) atomic_uint head;
+  atomic_uint dropped;
+  unsigned int woke_at;   // wake_at value we last kicked the consumer for
+  unsigned int woke_tail; // tail value when we last kicked for backlog
+  // Consumer side
+  _Alignas(CACHE_LINE) atomic_uint tail;
+  atomic_uint wake_at;    // head value the consumer wants a kick at
+  _Alignas(CACHE_LINE) int64_t stamp[PULSE_RING_SIZE];
+};
+
+/**
+ * Add a pulse, returns non-zero when the consumer should be woken,
+ * either because it asked to be at this count or because the ring is
+ * getting on for full.
+ */
+static inline int
+ringPush(struct pulse_ring * r, int64_t ts) {
+  unsigned int head, tail, want;
+
+  head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail >= PULSE_RING_SIZE) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+  } else {
+    r->stamp[head & PULSE_RING_MASK] = ts;
+    head++;
+    // Pairs with the store to wake_at in ringWakeAt()
+    atomic_store_explicit(&r->head, head, memory_order_seq_cst);
+  }
+  want = atomic_load_explicit(&r->wake_at, memory_order_seq_cst);
+  if ((int)(head - want) >= 0 && want != r->woke_at) {
+    r->woke_at = want;
+    return 1;
+  }
+  if (head - tail >= PULSE_RING_SIZE / 2 && tail != r->woke_tail) {
+    r->woke_tail = tail;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Copy out up to max timestamps, returns how many were taken.
+ */
+static inline unsigned int
+ringDrain(struct pulse_ring * r, int64_t * out, unsigned int max) {
+  unsigned int head, tail, n, i;
+
+  tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  head = atomic_load_explicit(&r->head, memory_order_acquire);
+  n = head - tail;
+  if (n > max) {
+    n = max;
+  }
+  for (i = 0; i < n; i++) {
+    out[i] = r->stamp[(tail + i) & PULSE_RING_MASK];
+  }
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+  return n;
+}
+
+/**
+ * Pulses that arrived while the ring was full, cleared as they are read.
+ */
+static inline unsigned int
+ringDropped(struct pulse_ring * r) {
+  return atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+}
+
+/**
+ * Ask to be woken once count more pulses are waiting.  Returns non-zero
+ * if that many are already there, in which case no kick will come.
+ */
+static inline int
+ringWakeAt(struct pulse_ring * r, unsigned int count) {
+  unsigned int tail, want;
+
+  tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  want = tail + (count < PULSE_RING_NEVER ? count : PULSE_RING_NEVER);
+  atomic_store_explicit(&r->wake_at, want, memory_order_seq_cst);
+  return (int)(atomic_load_explicit(&r->head, memory_order_seq_cst) - want) >= 0;
+}
+
+#endif
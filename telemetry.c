@@ -0,0 +1,52 @@
+/**
+ * Live counters in shared memory, see telemetry.h.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+
+/**
+ * Create (or take over) the segment, returns NULL if we can't.
+ */
+struct telemetry *
+telemetryOpen(const char * name) {
+  struct telemetry * t;
+  int fd;
+
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(*t)) < 0) {
+    close(fd);
+    return NULL;
+  }
+  t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (t == MAP_FAILED) {
+    return NULL;
+  }
+  // Readers check magic last, so clear it while the rest is set up
+  t->magic = 0;
+  atomic_thread_fence(memory_order_release);
+  memset((char *)t + sizeof(t->magic), 0, sizeof(*t) - sizeof(t->magic));
+  t->version = TELEMETRY_VERSION;
+  t->size = sizeof(*t);
+  t->pid = getpid();
+  atomic_thread_fence(memory_order_release);
+  t->magic = TELEMETRY_MAGIC;
+  return t;
+}
+
+void
+telemetryBegin(struct telemetry * t) {
+  atomic_fetch_add_explicit(&t->seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+void
+telemetryEnd(struct telemetry * t) {
+  atomic_fetch_add_explicit(&t->seq, 1, memory_order_release);
+}
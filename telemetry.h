@@ -0,0 +1,89 @@
+/**
+ * Live counters in a POSIX shared memory segment.
+ *
+ * The layout is fixed and versioned so other programs can map
+ * /dev/shm/waterfuse read-only and poll it as often as they like
+ * without a syscall.  Updates are covered by a sequence lock: seq is
+ * odd while an update is under way, and a reader that sees it change
+ * across its copy just tries again.  The histograms are bumped as
+ * things happen rather than under the lock, so a copy of one may be a
+ * count or two behind the others.  Each zone has a block of its own,
+ * the loop and its histograms are shared.  The loop only wakes for
+ * pulses when a rule needs a look, so while any zone is flowing it also
+ * wakes every TELEMETRY_INTERVAL to bring the live figures up to date,
+ * and they are never older than that.  The metrics and the uplink are
+ * taken from the same figures.
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "histogram.h"
+#include "zone.h"
+
+#define TELEMETRY_NAME "/waterfuse"
+#define TELEMETRY_SIM_NAME "/waterfuse-sim" // Simulator runs stay out of the live one
+#define TELEMETRY_MAGIC 0x57465445 // "WFTE"
+#define TELEMETRY_VERSION 5
+#define TELEMETRY_INTERVAL 1 // Most seconds the live figures lag while there is flow
+
+struct telemetry_zone {
+  char name[ZONE_NAME];
+  uint64_t volume;        // Microlitres this flow session
+  uint64_t total_volume;  // Microlitres since we started
+  uint64_t total_clicks;
+  int32_t clicks_per_litre; // Before any calibration
+  int32_t flow_rate;      // Millilitres per minute
+  uint8_t triggered;
+  uint8_t counting;
+  uint8_t stop_reason;    // Last cutoff reason, index into stop_msg
+  uint8_t reset_reason;   // Last reset source, index into reset_msg
+  uint8_t alarmed;
+  uint8_t spare[3];
+  uint32_t cutoffs;
+};
+
+struct telemetry {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;          // sizeof(struct telemetry) as written
+  uint32_t pid;
+  atomic_uint seq;
+  uint32_t zones;         // How many of zone[] are in use
+  int64_t updated;        // CLOCK_REALTIME of the last update, ns
+  struct telemetry_zone zone[MAX_ZONES];
+  uint64_t loops;         // Main loop iterations
+  int64_t loop_last;      // Time spent on the last iteration, ns
+  int64_t loop_max;
+  int64_t loop_total;
+  int64_t lag_max;        // Longest pass the health monitor has seen, ns
+  uint32_t backlog_max;   // Most pulses it has seen waiting in one ring
+  uint32_t stalls;        // Times it found the loop stuck and turned the pumps off
+  struct hist loop_hist;     // Main loop iterations
+  struct hist delivery_hist; // Pulse timestamp to the loop taking it
+  struct hist log_hist;      // Queueing a log line
+  struct hist state_hist;    // Publishing the state
+  struct hist relay_hist;    // Switching the relay
+};
+
+struct telemetry * telemetryOpen(const char * name);
+void telemetryBegin(struct telemetry * t);
+void telemetryEnd(struct telemetry * t);
+
+/**
+ * Take a consistent copy of a live segment.
+ */
+static inline void
+telemetryRead(const struct telemetry * t, struct telemetry * out) {
+  unsigned int before, after;
+
+  do {
+    before = atomic_load_explicit((atomic_uint *)&t->seq, memory_order_acquire);
+    __builtin_memcpy(out, (const void *)t, sizeof(*out));
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit((atomic_uint *)&t->seq, memory_order_relaxed);
+  } while ((before & 1) || before != after);
+}
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * Tests for the debounced buttons in button.c.
+ */
+#include "check.h"
+#include "button.h"
+
+#define MS 1000000LL
+
+static struct button b;
+
+static void
+testPress(void) {
+  btnInit(&b, 2);
+  CHECK_EQ(btnCheck(&b, 0, 0, 30 * MS, 0), BTN_NONE);
+  // Bouncing pushes the settle time on from each edge
+  btnEdge(&b, 10 * MS);
+  CHECK_EQ(btnCheck(&b, 11 * MS, 1, 30 * MS, 0), BTN_NONE);
+  CHECK_EQ(btnNext(&b, 0), 40 * MS);
+  btnEdge(&b, 20 * MS);
+  CHECK_EQ(btnCheck(&b, 41 * MS, 1, 30 * MS, 0), BTN_NONE);
+  CHECK_EQ(btnNext(&b, 0), 50 * MS);
+  CHECK_EQ(btnCheck(&b, 50 * MS, 1, 30 * MS, 0), BTN_PRESS);
+  CHECK_EQ(btnNext(&b, 0), 0);
+  // Held, then let go, is the one press
+  CHECK_EQ(btnCheck(&b, 900 * MS, 1, 30 * MS, 0), BTN_NONE);
+  btnEdge(&b, 1000 * MS);
+  CHECK_EQ(btnCheck(&b, 1030 * MS, 0, 30 * MS, 0), BTN_NONE);
+  CHECK(!b.pressed);
+  // A bounce that comes to nothing
+  btnEdge(&b, 2000 * MS);
+  CHECK_EQ(btnCheck(&b, 2030 * MS, 0, 30 * MS, 0), BTN_NONE);
+}
+
+static void
+testPolled(void) {
+  btnInit(&b, 2);
+  CHECK_EQ(btnCheck(&b, 100 * MS, 1, 30 * MS, 0), BTN_NONE);
+  CHECK_EQ(btnCheck(&b, 129 * MS, 1, 30 * MS, 0), BTN_NONE);
+  CHECK_EQ(btnCheck(&b, 130 * MS, 1, 30 * MS, 0), BTN_PRESS);
+}
+
+/**
+ * With long presses in use a short press counts when it is let go, and
+ * a long one as soon as it has been held long enough, and not again.
+ */
+static void
+testLong(void) {
+  int64_t hold = 3000 * MS;
+
+  btnInit(&b, 2);
+  btnEdge(&b, 1 * MS);
+  CHECK_EQ(btnCheck(&b, 31 * MS, 1, 30 * MS, hold), BTN_NONE);
+  CHECK_EQ(btnNext(&b, hold), 31 * MS + hold);
+  btnEdge(&b, 500 * MS);
+  CHECK_EQ(btnCheck(&b, 530 * MS, 0, 30 * MS, hold), BTN_PRESS);
+
+  btnEdge(&b, 1000 * MS);
+  CHECK_EQ(btnCheck(&b, 1030 * MS, 1, 30 * MS, hold), BTN_NONE);
+  CHECK_EQ(btnCheck(&b, 1029 * MS + hold, 1, 30 * MS, hold), BTN_NONE);
+  CHECK_EQ(btnCheck(&b, 1030 * MS + hold, 1, 30 * MS, hold), BTN_LONG);
+  CHECK_EQ(btnCheck(&b, 2000 * MS + hold, 1, 30 * MS, hold), BTN_NONE);
+  CHECK_EQ(btnNext(&b, hold), 0);
+  btnEdge(&b, 3000 * MS + hold);
+  CHECK_EQ(btnCheck(&b, 3030 * MS + hold, 0, 30 * MS, hold), BTN_NONE);
+}
+
+int
+main(void) {
+  testPress();
+  testPolled();
+  testLong();
+  return checkDone("button");
+}
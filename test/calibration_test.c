@@ -0,0 +1,41 @@
+/**
+ * Tests for the meter calibration tables in calibration.c.
+ */
+#include "check.h"
+#include "calibration.h"
+
+#define MS 1000000LL
+
+static struct calibration cal;
+
+int
+main(void) {
+  struct cal_point points[2] = { { 20, 400 }, { 5, 500 } };
+  uint32_t step, last;
+  int64_t gap;
+  int bad = 0;
+
+  // One figure for every rate
+  calBuild(&cal, 450, NULL, 0);
+  CHECK_EQ(cal.idle, 568889);
+  CHECK_EQ(calStep(&cal, 0), cal.idle);
+  CHECK_EQ(calStep(&cal, 7 * MS), cal.idle);
+  CHECK_EQ(calStep(&cal, 900 * MS), cal.idle);
+  CHECK_EQ(calPulses(&cal, CAL_UL), 449);
+  CHECK_EQ(calPulses(&cal, 1), 1);
+
+  // Points out of order, with the ends held beyond them
+  calBuild(&cal, 450, points, 2);
+  CHECK_EQ(calStep(&cal, 100 * MS), 512000);
+  CHECK_EQ(calStep(&cal, 1 * MS), 640000);
+  CHECK_EQ(cal.most, 640000);
+  // And in between each faster pulse worth no less than a slower one
+  last = calStep(&cal, 30 * MS);
+  for (gap = 30 * MS; gap > 5 * MS; gap -= 100000) {
+    step = calStep(&cal, gap);
+    bad += step < last || step < 512000 || step > 640000;
+    last = step;
+  }
+  CHECK_EQ(bad, 0);
+  return checkDone("calibration");
+}
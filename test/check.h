@@ -0,0 +1,37 @@
+/**
+ * Just enough of a harness for the tests in here.
+ *
+ * Each test is a program of its own, built against the module it
+ * tests and nothing else.  CHECK() and CHECK_EQ() report a failure
+ * with where it happened and carry on, so one run shows everything
+ * that is wrong, and checkDone() gives main() what to return.
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      check_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(got, want) do { \
+    long long got_ = (got), want_ = (want); \
+    if (got_ != want_) { \
+      fprintf(stderr, "%s:%d: %s is %lld, not %lld\n", __FILE__, __LINE__, #got, got_, want_); \
+      check_failures++; \
+    } \
+  } while (0)
+
+static inline int
+checkDone(const char * name) {
+  printf("%s: %s\n", name, check_failures ? "FAILED" : "ok");
+  return check_failures != 0;
+}
+
+#endif
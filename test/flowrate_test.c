@@ -0,0 +1,53 @@
+/**
+ * Tests for the flow rate estimate in flowrate.c.
+ */
+#include "check.h"
+#include "flowrate.h"
+
+#define MS 1000000LL
+
+static struct flow_rate r;
+
+int
+main(void) {
+  int64_t t = 1000 * MS;
+  int i;
+
+  rateInit(&r);
+  // Nothing to say until it has warmed up
+  for (i = 0; i < RATE_WARM; i++, t += 100 * MS) {
+    rateAdd(&r, t);
+    CHECK_EQ(rateGap(&r, t), 0);
+  }
+  rateAdd(&r, t);
+  CHECK_EQ(rateGap(&r, t), 100 * MS);
+
+  // A bounce hardly moves it
+  rateAdd(&r, t + 1 * MS);
+  t += 100 * MS;
+  rateAdd(&r, t);
+  CHECK(rateGap(&r, t) > 99 * MS && rateGap(&r, t) <= 100 * MS);
+
+  // Gone quiet, so the rate falls away
+  CHECK(rateGap(&r, t + 300 * MS) <= 100 * MS);
+  CHECK_EQ(rateGap(&r, t + 500 * MS), 500 * MS);
+
+  // Short gaps that keep coming are the flow having gone up
+  for (i = 0; i < RATE_RESEED; i++) {
+    t += 10 * MS;
+    rateAdd(&r, t);
+  }
+  CHECK_EQ(r.gap, 10 * MS);
+  CHECK_EQ(rateGap(&r, t), 0);
+  for (i = 0; i < RATE_WARM; i++) {
+    t += 10 * MS;
+    rateAdd(&r, t);
+  }
+  CHECK_EQ(rateGap(&r, t), 10 * MS);
+
+  // And a long one is the flow having stopped
+  t += 2000 * MS;
+  rateAdd(&r, t);
+  CHECK_EQ(rateGap(&r, t), 0);
+  return checkDone("flowrate");
+}
@@ -0,0 +1,193 @@
+/**
+ * Tests for the windowed flow accounting in flowwindow.c.
+ */
+#include <string.h>
+#include "check.h"
+#include "flowwindow.h"
+
+static struct flow_window fw;
+
+/**
+ * What the window ending at t ought to add up to, from what was put
+ * in each second.
+ */
+static uint64_t
+windowSum(const uint32_t * added, int64_t from, int64_t t, int window) {
+  uint64_t sum = 0;
+  int64_t s;
+
+  for (s = t - window + 1; s <= t; s++) {
+    if (s >= from) {
+      sum += added[s - from];
+    }
+  }
+  return sum;
+}
+
+static uint64_t
+allBuckets(void) {
+  uint64_t sum = 0;
+  int i;
+
+  for (i = 0; i < FW_BUCKETS; i++) {
+    sum += fw.bucket[i];
+  }
+  return sum;
+}
+
+static void
+testSession(void) {
+  fwInit(&fw, 1000, 60);
+  CHECK_EQ(fwSetRule(&fw, 0, FW_VOLUME, 100, 0, 1), 0);
+  CHECK_EQ(fwHeadroom(&fw, 1000), 1);
+  CHECK_EQ(fwAdd(&fw, 1000, 60), 0);
+  CHECK(fw.counting);
+  CHECK_EQ(fw.first, 1000);
+  CHECK_EQ(fwHeadroom(&fw, 1000), 40);
+  CHECK_EQ(fwAdd(&fw, 1001, 39), 0);
+  CHECK_EQ(fwAdd(&fw, 1001, 1), 1);
+  CHECK_EQ(fw.session, 100);
+
+  // Quiet for the gap and no more ends it
+  CHECK_EQ(fwSessionEnd(&fw), 1062);
+  CHECK_EQ(fwIdle(&fw, 1061), 0);
+  CHECK(fw.counting);
+  CHECK_EQ(fwIdle(&fw, 1062), 1);
+  CHECK(!fw.counting);
+  CHECK_EQ(fw.session, 0);
+  CHECK_EQ(fwSessionEnd(&fw), -1);
+
+  // As does flow turning up after it without an idle in between
+  fwAdd(&fw, 2000, 5);
+  fwAdd(&fw, 2100, 7);
+  CHECK_EQ(fw.first, 2100);
+  CHECK_EQ(fw.session, 7);
+}
+
+static void
+testContinuous(void) {
+  fwInit(&fw, 1000, 60);
+  fwSetRule(&fw, 0, FW_CONTINUOUS, 0, 10, 2);
+  CHECK_EQ(fwTimeLimit(&fw), -1);
+  CHECK_EQ(fwAdd(&fw, 1000, 1), 0);
+  CHECK_EQ(fwTimeLimit(&fw), 1011);
+  CHECK_EQ(fwAdd(&fw, 1010, 1), 0);
+  CHECK_EQ(fwHeadroom(&fw, 1010), UINT64_MAX);
+  CHECK_EQ(fwHeadroom(&fw, 1011), 1);
+  CHECK_EQ(fwAdd(&fw, 1011, 1), 2);
+}
+
+/**
+ * Window sums as the seconds go round the end of the bucket array,
+ * with flow in some seconds and not others.
+ */
+static void
+testWrap(void) {
+  static uint32_t added[1000];
+  int64_t from = FW_BUCKETS - 300, t, last = 0;
+  int bad = 0;
+
+  memset(added, 0, sizeof(added));
+  fwInit(&fw, from, 3600);
+  fwSetRule(&fw, 0, FW_VOLUME, UINT64_MAX, 100, 3);
+  for (t = from; t < from + 900; t += t % 53 == 0 ? 30 : 1 + (t % 3 == 0)) {
+    added[t - from] = t % 7 + 1;
+    if (fwAdd(&fw, t, t % 7 + 1) != 0) {
+      bad++;
+    }
+    if (fw.rule[0].sum != windowSum(added, from, t, 100)) {
+      bad++;
+    }
+    last = t;
+  }
+  CHECK_EQ(bad, 0);
+  CHECK_EQ(fw.now, last);
+  CHECK((last & FW_MASK) < (from & FW_MASK));
+
+  // Idle time takes what leaves the window off as well
+  t = fw.now + 40;
+  fwIdle(&fw, t);
+  CHECK_EQ(fw.rule[0].sum, windowSum(added, from, t, 100));
+
+  // Setting a rule up works its sum out from what is already there
+  CHECK_EQ(fwSetRule(&fw, 1, FW_VOLUME, UINT64_MAX, 300, 4), 0);
+  CHECK_EQ(fw.nrules, 2);
+  CHECK_EQ(fw.rule[1].sum, windowSum(added, from, t, 300));
+  CHECK_EQ(fwSetRule(&fw, 1, FW_VOLUME, 1, FW_BUCKETS, 4), -1);
+  CHECK_EQ(fwSetRule(&fw, FW_MAX_RULES, FW_VOLUME, 1, 10, 4), -1);
+}
+
+/**
+ * Gaps longer than a window, and longer than all the history we keep.
+ */
+static void
+testGaps(void) {
+  int64_t t = 5000;
+
+  fwInit(&fw, t, 60);
+  fwSetRule(&fw, 0, FW_VOLUME, UINT64_MAX, 100, 3);
+  for (; t < 5200; t++) {
+    fwAdd(&fw, t, 10);
+  }
+  CHECK_EQ(fw.rule[0].sum, 1000);
+
+  // Out of the window, but the buckets are still walked
+  t += 500;
+  CHECK_EQ(fwAdd(&fw, t, 3), 0);
+  CHECK_EQ(fw.rule[0].sum, 3);
+  CHECK_EQ(allBuckets(), 2000 + 3);
+
+  // Round to the buckets the first flow went in, which are cleared
+  // on the way
+  t = 5000 + FW_BUCKETS + 50;
+  CHECK_EQ(fwAdd(&fw, t, 1), 0);
+  CHECK_EQ(fw.rule[0].sum, 1);
+  CHECK_EQ(allBuckets(), 149 * 10 + 3 + 1);
+
+  // Longer than the history, which is all forgotten at once
+  t += 5 * FW_BUCKETS + 17;
+  CHECK_EQ(fwAdd(&fw, t, 7), 0);
+  CHECK_EQ(fw.rule[0].sum, 7);
+  CHECK_EQ(allBuckets(), 7);
+  CHECK_EQ(fw.first, t);
+
+  // Late flow goes in the second we are on
+  CHECK_EQ(fwAdd(&fw, t - 5, 2), 0);
+  CHECK_EQ(fw.last, t);
+  CHECK_EQ(fw.bucket[t & FW_MASK], 9);
+  CHECK_EQ(fw.rule[0].sum, 9);
+}
+
+static void
+testReset(void) {
+  int64_t t;
+
+  fwInit(&fw, 100, 60);
+  fwSetRule(&fw, 0, FW_VOLUME, 50, 0, 1);
+  fwSetRule(&fw, 1, FW_VOLUME, 100, 600, 3);
+  for (t = 100; t < 110; t++) {
+    fwAdd(&fw, t, 4);
+  }
+  CHECK_EQ(fwHeadroom(&fw, t), 10);
+  fwReset(&fw);
+  CHECK(!fw.counting);
+  CHECK_EQ(fw.session, 0);
+  CHECK_EQ(fw.rule[1].sum, 0);
+  CHECK_EQ(allBuckets(), 0);
+  CHECK_EQ(fwHeadroom(&fw, t), 1);
+  // Every rule has its whole budget back
+  CHECK_EQ(fwAdd(&fw, t, 49), 0);
+  CHECK_EQ(fw.first, t);
+  CHECK_EQ(fw.rule[1].sum, 49);
+  CHECK_EQ(fwAdd(&fw, t + 1, 1), 1);
+}
+
+int
+main(void) {
+  testSession();
+  testContinuous();
+  testWrap();
+  testGaps();
+  testReset();
+  return checkDone("flowwindow");
+}
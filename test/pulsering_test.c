@@ -0,0 +1,87 @@
+/**
+ * Tests for the pulse timestamp ring in pulsering.h, from one thread.
+ */
+#include <string.h>
+#include "check.h"
+#include "pulsering.h"
+
+static struct pulse_ring ring;
+static int64_t out[PULSE_RING_SIZE];
+
+static void
+testOrder(void) {
+  int64_t next = 1, want = 1;
+  unsigned int i, n, bad = 0;
+
+  memset(&ring, 0, sizeof(ring));
+  ringWakeAt(&ring, PULSE_RING_NEVER);
+  // Round the end of the stamps a few times, drained in odd sized bites
+  while (next < 5 * PULSE_RING_SIZE) {
+    for (i = 0; i < 100; i++) {
+      ringPush(&ring, next++);
+    }
+    while ((n = ringDrain(&ring, out, 37)) > 0) {
+      for (i = 0; i < n; i++) {
+        bad += out[i] != want++;
+      }
+    }
+  }
+  CHECK_EQ(bad, 0);
+  CHECK_EQ(want, next);
+  CHECK_EQ(ringDropped(&ring), 0);
+}
+
+static void
+testFull(void) {
+  unsigned int i;
+
+  memset(&ring, 0, sizeof(ring));
+  ringWakeAt(&ring, PULSE_RING_NEVER);
+  for (i = 0; i < PULSE_RING_SIZE + 3; i++) {
+    ringPush(&ring, i + 1);
+  }
+  CHECK_EQ(ringDropped(&ring), 3);
+  CHECK_EQ(ringDropped(&ring), 0);
+  // The newest are the ones lost
+  CHECK_EQ(ringDrain(&ring, out, PULSE_RING_SIZE), PULSE_RING_SIZE);
+  CHECK_EQ(out[0], 1);
+  CHECK_EQ(out[PULSE_RING_SIZE - 1], PULSE_RING_SIZE);
+}
+
+/**
+ * The producer kicks once when the count asked for is reached, and
+ * once for each time the consumer moves on while it is half full.
+ */
+static void
+testWake(void) {
+  unsigned int i, kicks = 0;
+
+  memset(&ring, 0, sizeof(ring));
+  CHECK_EQ(ringWakeAt(&ring, 3), 0);
+  CHECK_EQ(ringPush(&ring, 1), 0);
+  CHECK_EQ(ringPush(&ring, 2), 0);
+  CHECK_EQ(ringPush(&ring, 3), 1);
+  CHECK_EQ(ringPush(&ring, 4), 0);
+  CHECK_EQ(ringDrain(&ring, out, 10), 4);
+  CHECK_EQ(ringWakeAt(&ring, 1), 0);
+  CHECK_EQ(ringPush(&ring, 5), 1);
+  // Already there
+  CHECK_EQ(ringWakeAt(&ring, 1), 1);
+
+  ringWakeAt(&ring, PULSE_RING_NEVER);
+  for (i = 0; i < PULSE_RING_SIZE / 2 + 10; i++) {
+    kicks += ringPush(&ring, i);
+  }
+  CHECK_EQ(kicks, 1);
+  ringDrain(&ring, out, 1);
+  CHECK_EQ(ringPush(&ring, 0), 1);
+  CHECK_EQ(ringPush(&ring, 0), 0);
+}
+
+int
+main(void) {
+  testOrder();
+  testFull();
+  testWake();
+  return checkDone("pulsering");
+}
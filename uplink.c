@@ -0,0 +1,204 @@
+/**
+ * UDP telemetry, see uplink.h.
+ *
+ * The packet is built from the shared memory telemetry the loop has
+ * just written, so nothing new has to be gathered for it.  The socket
+ * is connected, which lets a collector that isn't listening show up as
+ * an error on a later send rather than each packet going nowhere.
+ * Like every other drop, that is counted and the next packet tries
+ * again.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "uplink.h"
+#include "telemetry.h"
+
+#define NS 1000000000LL
+
+struct uplink_state {
+  uint8_t triggered;
+  uint8_t counting;
+  uint8_t alarmed;
+  uint64_t total_clicks;
+};
+
+static int uplink_fd = -1;
+static struct uplink_packet packet;
+static struct uplink_state last[MAX_ZONES];
+static uint32_t changes[MAX_ZONES];
+static uint32_t seq = 0;
+static int64_t interval = (int64_t)UPLINK_INTERVAL * NS;
+static int64_t sent_at = 0;   // hal clock
+static int pending = 0;       // Something has changed since the last packet
+static int primed = 0;        // last[] has been filled in, there is something to compare with
+static unsigned int dropped = 0;
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER; // The health monitor sends too
+
+/**
+ * Connect to dest, "HOST", "HOST:PORT" or "[ADDRESS]:PORT", to send
+ * packets from site, which started at boot.
+ */
+int
+uplinkOpen(const char * dest, const char * site, int64_t boot) {
+  struct addrinfo hints, * res, * ai;
+  char host[UPLINK_DEST], port[8], * p;
+  int err;
+
+  snprintf(host, sizeof(host), "%s", dest[0] == '[' ? dest + 1 : dest);
+  snprintf(port, sizeof(port), "%d", UPLINK_PORT);
+  if ((p = strchr(host, dest[0] == '[' ? ']' : ':')) != NULL) {
+    *p++ = 0;
+    if (*p == ':') {
+      p++;
+    }
+    if (*p) {
+      snprintf(port, sizeof(port), "%s", p);
+    }
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+    errno = err == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+    return -1;
+  }
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((uplink_fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+      continue;
+    }
+    if (connect(uplink_fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(uplink_fd);
+    uplink_fd = -1;
+  }
+  freeaddrinfo(res);
+  if (uplink_fd < 0) {
+    return -1;
+  }
+  memset(&packet, 0, sizeof(packet));
+  packet.magic = htole32(UPLINK_MAGIC);
+  packet.version = htole16(UPLINK_VERSION);
+  packet.size = htole16(sizeof(packet));
+  packet.boot = htole64(boot);
+  snprintf(packet.site, sizeof(packet.site), "%s", site);
+  pending = 1;
+  return 0;
+}
+
+void
+uplinkInterval(int secs) {
+  interval = (int64_t)(secs > 0 ? secs : UPLINK_INTERVAL) * NS;
+}
+
+static void
+sendPacket(const struct telemetry * t) {
+  const struct telemetry_zone * tz;
+  struct uplink_zone * uz;
+  unsigned int z;
+
+  pthread_mutex_lock(&send_lock);
+  packet.seq = htole32(seq++);
+  packet.zones = htole32(t->zones);
+  packet.sent = htole64(t->updated);
+  packet.lag_max = htole32(t->lag_max / 1000);
+  packet.backlog_max = htole32(t->backlog_max);
+  packet.stalls = htole32(t->stalls);
+  packet.flags = 0;
+  for (z = 0; z < t->zones && z < MAX_ZONES; z++) {
+    tz = &t->zone[z];
+    uz = &packet.zone[z];
+    memcpy(uz->name, tz->name, sizeof(uz->name));
+    uz->volume = htole64(tz->volume);
+    uz->total_volume = htole64(tz->total_volume);
+    uz->total_clicks = htole64(tz->total_clicks);
+    uz->flow_rate = htole32(tz->flow_rate);
+    uz->cutoffs = htole32(tz->cutoffs);
+    uz->changes = htole32(changes[z]);
+    uz->triggered = tz->triggered;
+    uz->counting = tz->counting;
+    uz->stop_reason = tz->stop_reason;
+    uz->reset_reason = tz->reset_reason;
+    uz->alarmed = tz->alarmed;
+  }
+  if (write(uplink_fd, &packet, sizeof(packet)) != sizeof(packet)) {
+    dropped++;
+  }
+  pthread_mutex_unlock(&send_lock);
+}
+
+/**
+ * Tell the collector the loop has been stuck for lag ns, from the
+ * health monitor's thread.  The rest is what the last packet said.
+ * If the loop is stuck part way through a send of its own the next
+ * look will do.
+ */
+void
+uplinkStalled(int64_t lag) {
+  if (uplink_fd < 0 || pthread_mutex_trylock(&send_lock) != 0) {
+    return;
+  }
+  packet.seq = htole32(seq++);
+  if (lag / 1000 > le32toh(packet.lag_max)) {
+    packet.lag_max = htole32(lag / 1000);
+  }
+  packet.stalls = htole32(le32toh(packet.stalls) + 1);
+  packet.flags = htole32(UPLINK_STALLED);
+  if (write(uplink_fd, &packet, sizeof(packet)) != sizeof(packet)) {
+    dropped++;
+  }
+  pthread_mutex_unlock(&send_lock);
+}
+
+/**
+ * Look over what the loop has just published at now, on the hal clock,
+ * and send a packet if it is time for one.  Returns when to be called
+ * again, 0 if there is nowhere to send to.
+ */
+int64_t
+uplinkUpdate(const struct telemetry * t, int64_t now) {
+  const struct telemetry_zone * tz;
+  struct uplink_state * was;
+  unsigned int z;
+  int urgent = 0;
+
+  if (uplink_fd < 0) {
+    return 0;
+  }
+  for (z = 0; z < t->zones && z < MAX_ZONES; z++) {
+    tz = &t->zone[z];
+    was = &last[z];
+    if (primed && (tz->triggered != was->triggered || tz->counting != was->counting || tz->alarmed != was->alarmed)) {
+      changes[z]++;
+      urgent = 1;
+    }
+    if (tz->total_clicks != was->total_clicks) {
+      pending = 1;
+    }
+    was->triggered = tz->triggered;
+    was->counting = tz->counting;
+    was->alarmed = tz->alarmed;
+    was->total_clicks = tz->total_clicks;
+  }
+  primed = 1;
+  if (urgent || (pending && now - sent_at >= interval) || now - sent_at >= (int64_t)UPLINK_KEEPALIVE * NS) {
+    sendPacket(t);
+    sent_at = now;
+    pending = 0;
+  }
+  return sent_at + (pending ? interval : (int64_t)UPLINK_KEEPALIVE * NS);
+}
+
+/**
+ * Packets that couldn't be sent.
+ */
+unsigned int
+uplinkDropped(void) {
+  return dropped;
+}
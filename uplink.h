@@ -0,0 +1,118 @@
+/**
+ * Telemetry for a collector on another machine, over UDP.
+ *
+ * Each datagram is one struct uplink_packet, the same size every time,
+ * with all a collector needs to know about the site: the counters,
+ * flow rate and state of each zone, and how many times that state has
+ * changed.  Nothing is ever sent again, and as the counters go out
+ * rather than what they went up by, a lost packet only means the next
+ * one brings the news.  A zone starting, stopping, being cut off or
+ * raising an alarm goes out straight away.  Otherwise changes are held
+ * back so steady flow sends no more than one packet every interval,
+ * and with nothing happening at all there is one every
+ * UPLINK_KEEPALIVE seconds so the collector knows the site is there.
+ * Sends never block, a packet the socket has no room for is dropped.
+ * The health monitor sends one of its own, from its own thread, when it
+ * finds the loop stuck.  Fields are little endian.  wfcollect is the
+ * collector.
+ */
+#ifndef UPLINK_H
+#define UPLINK_H
+
+#include <stdint.h>
+#include <endian.h>
+#include "zone.h"
+
+#define UPLINK_MAGIC 0x31554657 // "WFU1"
+#define UPLINK_VERSION 2
+#define UPLINK_PORT 7453        // Unless the collector line says otherwise
+#define UPLINK_INTERVAL 10      // Seconds between packets under steady flow, as a default
+#define UPLINK_KEEPALIVE 60     // Seconds between packets with nothing to say
+#define UPLINK_SITE 16
+#define UPLINK_DEST 64          // Longest HOST:PORT
+#define UPLINK_STALLED 1        // flags: the loop is stuck, and the pumps have been turned off
+
+struct uplink_zone {
+  char name[ZONE_NAME];
+  uint64_t volume;        // Microlitres this flow session
+  uint64_t total_volume;  // Microlitres since the daemon started
+  uint64_t total_clicks;
+  int32_t flow_rate;      // Millilitres per minute
+  uint32_t cutoffs;
+  uint32_t changes;       // State changes since the daemon started
+  uint8_t triggered;
+  uint8_t counting;
+  uint8_t stop_reason;    // Index into stop_msg
+  uint8_t reset_reason;   // Index into reset_msg
+  uint8_t alarmed;
+  uint8_t spare[7];
+};
+
+struct uplink_packet {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;          // sizeof(struct uplink_packet)
+  uint32_t seq;           // One more every packet, from 0 when the daemon starts
+  uint32_t zones;         // How many of zone[] are in use
+  int64_t boot;           // CLOCK_REALTIME ns the daemon started at
+  int64_t sent;           // CLOCK_REALTIME ns
+  uint32_t lag_max;       // Longest pass of the loop, microseconds
+  uint32_t backlog_max;   // Most pulses seen waiting in one ring
+  uint32_t stalls;        // Times the loop was found stuck
+  uint32_t flags;
+  char site[UPLINK_SITE];
+  struct uplink_zone zone[MAX_ZONES];
+};
+
+struct telemetry;
+
+int uplinkOpen(const char * dest, const char * site, int64_t boot);
+void uplinkInterval(int secs);
+int64_t uplinkUpdate(const struct telemetry * t, int64_t now);
+void uplinkStalled(int64_t lag);
+unsigned int uplinkDropped(void);
+
+/**
+ * Turn a packet as it came off the wire into one we can read, returns
+ * -1 if it isn't one of ours.
+ */
+static inline int
+uplinkDecode(struct uplink_packet * p, int len) {
+  struct uplink_zone * uz;
+  unsigned int z;
+
+  if (len != sizeof(*p)) {
+    return -1;
+  }
+  p->magic = le32toh(p->magic);
+  p->version = le16toh(p->version);
+  p->size = le16toh(p->size);
+  if (p->magic != UPLINK_MAGIC || p->version != UPLINK_VERSION || p->size != sizeof(*p)) {
+    return -1;
+  }
+  p->seq = le32toh(p->seq);
+  p->zones = le32toh(p->zones);
+  p->boot = le64toh(p->boot);
+  p->sent = le64toh(p->sent);
+  p->lag_max = le32toh(p->lag_max);
+  p->backlog_max = le32toh(p->backlog_max);
+  p->stalls = le32toh(p->stalls);
+  p->flags = le32toh(p->flags);
+  if (p->zones > MAX_ZONES) {
+    return -1;
+  }
+  p->site[UPLINK_SITE - 1] = 0;
+  for (z = 0; z < p->zones; z++) {
+    uz = &p->zone[z];
+    uz->name[ZONE_NAME - 1] = 0;
+    uz->volume = le64toh(uz->volume);
+    uz->total_volume = le64toh(uz->total_volume);
+    uz->total_clicks = le64toh(uz->total_clicks);
+    uz->flow_rate = le32toh(uz->flow_rate);
+    uz->cutoffs = le32toh(uz->cutoffs);
+    uz->changes = le32toh(uz->changes);
+  }
+  return 0;
+}
+
+#endif
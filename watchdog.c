@@ -0,0 +1,104 @@
+/**
+ * systemd and hardware watchdogs, see watchdog.h.
+ *
+ * This is the little of sd_notify() we need, so there is no libsystemd
+ * to link against.  Failures are only ever reported on opening,
+ * a ping that can't go out is the watchdog's problem to notice.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/watchdog.h>
+#include "watchdog.h"
+
+#define NS 1000000000LL
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_len;
+static int sd_watchdog = 0; // systemd wants pings
+static int dev_fd = -1;
+
+/**
+ * Find systemd's socket, if we were started by it, returning how often
+ * (ns) it wants pings, 0 for never.
+ */
+int64_t
+watchdogSystemd(void) {
+  const char * path = getenv("NOTIFY_SOCKET"), * usec = getenv("WATCHDOG_USEC");
+
+  if (path && (path[0] == '/' || path[0] == '@') && strlen(path) < sizeof(notify_addr.sun_path)
+   && (notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) >= 0) {
+    memset(&notify_addr, 0, sizeof(notify_addr));
+    notify_addr.sun_family = AF_UNIX;
+    strcpy(notify_addr.sun_path, path);
+    // Abstract namespace
+    if (path[0] == '@') {
+      notify_addr.sun_path[0] = 0;
+    }
+    notify_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    if (usec && atoll(usec) > 0) {
+      sd_watchdog = 1;
+      return atoll(usec) * 1000 / 2;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Open a hardware watchdog, returning how often (ns) it wants pings.
+ * Once it is open the board resets if the pings stop.
+ */
+int64_t
+watchdogDevice(const char * device) {
+  int secs;
+
+  if ((dev_fd = open(device, O_WRONLY | O_CLOEXEC)) < 0) {
+    return -1;
+  }
+  if (ioctl(dev_fd, WDIOC_GETTIMEOUT, &secs) < 0 || secs <= 0) {
+    secs = WATCHDOG_TIMEOUT;
+  }
+  return (int64_t)secs * NS / 2;
+}
+
+/**
+ * Tell systemd, if it is listening, something like "READY=1".
+ */
+void
+watchdogNotify(const char * state) {
+  if (notify_fd >= 0) {
+    sendto(notify_fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&notify_addr, notify_len);
+  }
+}
+
+void
+watchdogPing(void) {
+  if (sd_watchdog) {
+    watchdogNotify("WATCHDOG=1");
+  }
+  if (dev_fd >= 0) {
+    write(dev_fd, "", 1);
+  }
+}
+
+/**
+ * We are going on purpose.
+ */
+void
+watchdogClose(void) {
+  watchdogNotify("STOPPING=1");
+  if (dev_fd >= 0) {
+    write(dev_fd, "V", 1);
+    close(dev_fd);
+    dev_fd = -1;
+  }
+}
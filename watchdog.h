@@ -0,0 +1,25 @@
+/**
+ * Watchdogs that restart us, or the whole machine, if the loop stops.
+ *
+ * Under systemd with WatchdogSec= set, pings are WATCHDOG=1 datagrams
+ * on $NOTIFY_SOCKET, and READY=1 and STOPPING=1 go the same way for a
+ * Type=notify unit.  A hardware watchdog device, if the config names
+ * one, is pinged with a write, and told with a "V" that we meant to go
+ * when we exit cleanly, so that it doesn't reset the board.  Both want
+ * pings at no more than half their timeout.  Pings only ever come from
+ * the main loop, so it stopping is what they see.
+ */
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+
+#define WATCHDOG_TIMEOUT 15 // Seconds, for a device that won't say
+
+int64_t watchdogSystemd(void);
+int64_t watchdogDevice(const char * device);
+void watchdogNotify(const char * state);
+void watchdogPing(void);
+void watchdogClose(void);
+
+#endif
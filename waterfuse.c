@@ -4,12 +4,15 @@
  *
  * An interrupt handler counts clicks from the flow meter
  * after so many litres happen 
+ *
+ * One loop looks after every zone, each a meter and the relay for its
+ * pump with limits of its own, see zone.h.
  */
+#define _GNU_SOURCE // CPU affinity
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
-#include <wiringPi.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,39 +20,236 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#include "pulsering.h"
+#include "gpiodev.h"
+#include "flowwindow.h"
+#include "flowrate.h"
+#include "logger.h"
+#include "logring.h"
+#include "telemetry.h"
+#include "notify.h"
+#include "history.h"
+#include "checkpoint.h"
+#include "hal.h"
+#include "bench.h"
+#include "zone.h"
+#include "config.h"
+#include "control.h"
+#include "metrics.h"
+#include "button.h"
+#include "capture.h"
+#include "pressure.h"
+#include "uplink.h"
+#include "health.h"
+#include "watchdog.h"
+
+#define MAX_EVENTS 8 // Events handled per epoll_wait
+#define PULSE_BATCH 256 // Pulse timestamps drained per pass
+#define RATE_BATCH 128 // Most pulses between looks at the rate when max_rate is set
+#define STATE_LINE 64 // Longest state line for a zone
+#define NS 1000000000LL
+#define RUN_DIR "/var/run/waterfuse"
+
+// The latency histograms can be left out of the build altogether, as
+// log lines above LOG_MAX can, see the lean profile in the Makefile
+#ifndef INSTRUMENT
+#define INSTRUMENT 1
+#endif
+
+enum command {
+  CMD_RELOAD = 1,  // Reopen the log and read the config again
+  CMD_STATS = 2,   // Log the stats
+  CMD_QUIT = 4     // Wind up cleanly
+};
 
-#define FLOW_METER 0 // Pin for flow meter input
-#define POWER_RELAY 1 // Pin for relay to pump output
-#define RESET_BUTTON 2
-#define PRESSURE_SENSOR 3
-#define CLICKS_PER_LITRE 450 // Number of pulses per litre
-#define MAX_FLOW 200 // Maximum number of litres in a given time period
-#define RESET_PERIOD 600 // Quiescent time to reset counters
-#define MAX_TIME 900 // Time during which the max flow can be achieved
-
-volatile unsigned int clicks = 0;
-volatile unsigned int reset = 0;
-unsigned char triggered = 0;
-unsigned char counting = 0;
-int last_click_time = 0;
-int last_click_count = 0;
-int first_click_time = 0;
-int total_clicks = 0;
-int clicks_per_litre = CLICKS_PER_LITRE;
-int max_litres = MAX_FLOW;
-int reset_period = RESET_PERIOD;
-int time_limit = MAX_TIME;
+unsigned int commands = 0; // Waiting for the next pass of the loop
+unsigned char reset_queued[MAX_ZONES]; // Reset reason for each zone, likewise
+unsigned char stop_queued[MAX_ZONES];  // Stop reason
+struct zones zones;
+const char * config_file = CONFIG_FILE;
+// From the command line, -1 where not given, laid over the config file
+int cmd_litres = -1, cmd_cpl = -1, cmd_time = -1, cmd_reset = -1, cmd_gpio_line = -1;
+int cmd_realtime = -1, cmd_realtime_cpu = -1, cmd_verbose = 0;
+char zone_state[MAX_ZONES][STATE_LINE];
+int zone_state_len[MAX_ZONES];
 int daemonise = 1;
 int verbose = 0;
+int gpio_chip = GPIO_CHIP;
+int realtime = 0; // SCHED_FIFO priority for the control path, 0 for none
+int realtime_cpu = -1; // Core to keep the control path on, -1 for any
+int log_ring = 0; // Kilobytes of ring log, 0 to log as text
+int metrics_port = 0; // TCP port /metrics is served on, 0 for none
+char metrics_address[METRICS_ADDRESS] = ""; // And the address, empty for loopback
+char collector[UPLINK_DEST] = ""; // Where UDP telemetry goes, empty for nowhere
+char site[UPLINK_SITE] = "";
+int collector_interval = UPLINK_INTERVAL;
+int max_lag = HEALTH_MAX_LAG; // ms a pass can take before the pumps go off
+char watchdog_device[WATCHDOG_DEVICE] = "";
+const struct hal * hal = NULL;
+const char * sim_trace = NULL; // Pulse trace for the simulator
+int sim_speed = 1;
+atomic_int finished = 0; // Pulse source has run out
+atomic_int meter_lost[MAX_ZONES]; // Its pulse thread has given up, keeps the zone stopped
+struct button buttons[MAX_ZONES]; // One for each pin, zones may share
+int nbuttons = 0;
+int button_edges = 1; // Buttons wake us, rather than being polled
+int debounce = BUTTON_DEBOUNCE; // ms a button has to stay put to count
+int long_press = 0; // Seconds held that stops the pumps, 0 for no long press
+int capture = 0; // Pulses are to be captured
+int capturing = 0; // And are being
+int pressure_rate = PRESSURE_RATE; // Pressure reads a second
+int sampling = 0; // The pressure thread is running
+FILE * bench_file = NULL; // Latency samples for wfbench
+const char * run_dir = RUN_DIR;
+char state_file[256];
+char state_temp[256];
+char notify_path[256];
+char control_path[256];
+char pid_file[256];
+char history_file[256];
+char checkpoint_file[256];
+char log_ring_file[256];
+char capture_file[256];
+int wake_fd = -1;
+struct pulse_ring pulses[MAX_ZONES];
+struct telemetry local_telemetry; // Somewhere to count if the segment can't be had
+struct telemetry * telemetry = &local_telemetry;
 
+/**
+ * Kick the main loop out of epoll_wait.
+ */
 void
-handleClick(void) {
-  clicks++;
+wakeLoop(void) {
+  uint64_t one = 1;
+  write(wake_fd, &one, sizeof(one));
 }
 
+/**
+ * Put the pulse into the ring, only waking the main loop when it has
+ * asked to be or the ring needs emptying.
+ */
 void
-handleReset(void) {
-  reset = 1;
+handlePulse(int zone, int64_t ts) {
+  if (ringPush(&pulses[zone], ts)) {
+    wakeLoop();
+  }
+}
+
+/**
+ * A button has gone down or up, the loop works out what it means once
+ * it has settled.
+ */
+void
+buttonEdge(int pin) {
+  int i;
+
+  for (i = 0; i < nbuttons; i++) {
+    if (buttons[i].pin == pin) {
+      btnEdge(&buttons[i], halNow());
+    }
+  }
+  wakeLoop();
+}
+
+/**
+ * Only the simulator ever runs out of pulses, and that is our cue to
+ * wind up.
+ */
+void
+pulsesDone(void) {
+  // Every pulse is in the ring by the time this is seen
+  atomic_store(&finished, 1);
+  wakeLoop();
+}
+
+/**
+ * A zone's flow meter can't be read any more, it stays stopped until
+ * we are restarted.
+ */
+void
+meterLost(int zone) {
+  atomic_store(&meter_lost[zone], 1);
+  wakeLoop();
+}
+
+/**
+ * Note a tripped rule, the first one to trip is the one we report.
+ */
+void
+noteTrip(int z, int reason, int64_t ts) {
+  if (reason && !zones.stop_reason[z]) {
+    zones.stop_reason[z] = reason;
+    zones.trip_stamp[z] = ts;
+  }
+}
+
+/**
+ * Only wfbench asks for these, see bench.h.
+ */
+void
+benchSample(int kind, int64_t value) {
+  struct bench_sample s = { kind, 0, value };
+
+  fwrite(&s, sizeof(s), 1, bench_file);
+}
+
+/**
+ * Pull everything out of a zone's pulse ring into its flow accounting,
+ * returning the number of clicks and updating the flow rate.  Each
+ * pulse counts for the volume the calibration has for the rate we are
+ * at, in microlitres with the fraction carried on to the next.
+ */
+unsigned int
+drainPulses(int z, int64_t now) {
+  struct flow_rate * rate = &zones.rate[z];
+  const struct calibration * cal = &zones.cal[z];
+  int64_t stamps[PULSE_BATCH];
+  int64_t to_real, drained, gap;
+  uint64_t volume = 0, dropped;
+  uint32_t step = zones.volume_frac[z];
+  unsigned int i, n, total = 0;
+
+  // History goes by the wall clock
+  drained = halNow();
+  to_real = halRealtime() - drained;
+  while ((n = ringDrain(&pulses[z], stamps, PULSE_BATCH)) > 0) {
+    for (i = 0; i < n; i++) {
+      capturePulse(z, stamps[i]);
+      noteTrip(z, zonePulse(&zones, z, stamps[i], &step), stamps[i]);
+      volume += step >> CAL_FRAC;
+      historyFlow((stamps[i] + to_real) / NS, z, 1, step >> CAL_FRAC);
+      if (INSTRUMENT) {
+        histRecord(&telemetry->delivery_hist, drained - stamps[i]);
+      }
+      if (bench_file) {
+        benchSample(BENCH_DELIVERY, drained - stamps[i]);
+      }
+    }
+    total += n;
+  }
+  gap = rateGap(rate, drained);
+  zones.flow_rate[z] = gap ? 60.0 * NS / gap * calStep(cal, gap) / ((double)CAL_UL * (1 << CAL_FRAC)) : 0;
+  // Pulses that didn't fit in the ring still count, just not when
+  if ((n = ringDropped(&pulses[z])) > 0) {
+    captureDropped(z, n);
+    noteTrip(z, zoneDropped(&zones, z, n, drained, &step, &dropped), drained);
+    volume += dropped;
+    historyFlow((now * NS + to_real) / NS, z, n, dropped);
+    total += n;
+  }
+  zones.volume_frac[z] = step & ((1 << CAL_FRAC) - 1);
+  zones.total_volume[z] += volume;
+  return total;
 }
 
 void rollLog() {
@@ -65,102 +265,918 @@ void rollLog() {
   close(outfd);
 }
 
-void
-readConfig(void) {
-  FILE * cfg;
-  char buf[1024];
-  int val;
-
-  if ((cfg = fopen("/etc/waterfuse/waterfuse.conf", "r")) != NULL) {
-    while (fscanf(cfg, "%s %d", &buf, &val) != EOF) {
-      if (strcmp("reset_period", buf) == 0) {
-        reset_period = val;
-      } else if (strcmp("max_time", buf) == 0) {
-        time_limit = val * 60;
-      } else if (strcmp("max_litres", buf) == 0) {
-        max_litres = val;
-      } else if (strcmp("clicks_per_litre", buf) == 0) {
-        clicks_per_litre = val;
-      } else if (strcmp("verbosity", buf) == 0) {
-        verbose = val;
-      }
-    }
+/**
+ * Real monotonic time in ns, for timing our own work whatever speed
+ * the hal clock is running at.
+ */
+int64_t
+realNow(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * NS + ts.tv_nsec;
+}
+
+/**
+ * Start timing something for a latency histogram, which costs nothing
+ * in a build without them.
+ */
+static inline int64_t
+latencyStart(void) {
+  return INSTRUMENT ? realNow() : 0;
+}
+
+static inline void
+latencyEnd(struct hist * h, int64_t start) {
+  if (INSTRUMENT) {
+    histRecord(h, realNow() - start);
   }
 }
 
+/**
+ * Log a line at level, by way of printLog() so that levels the build
+ * leaves out never get this far.
+ */
 void
-printLog(int level, const char * fmt, ...) {
+logLine(int level, const char * fmt, ...) {
   va_list args;
-  char buf[1024];
-  struct tm * time_parts;
-  time_t secs;
+  int64_t start;
 
   if (level > verbose) {
     return;
   }
-  // Get the current date/time
-  time(&secs);
-  time_parts = localtime(&secs);
-  // Write out a date string
-  strftime((char *)&buf, sizeof(buf), "%Y-%m-%d %H:%M:%S ", time_parts);
-  printf(buf);
-
+  // Queued for the log thread, which adds the date
+  start = latencyStart();
   va_start(args, fmt);
-  vprintf(fmt, args);
+  logPrintv(fmt, args);
   va_end(args);
-  fflush(stdout);
+  latencyEnd(&telemetry->log_hist, start);
+}
+
+/**
+ * Lay the command line over a freshly loaded config and take it on.
+ * The zones and their pins are fixed once we are running, so after
+ * startup only the limits change.  Returns -1 with cfg->error set if
+ * the result won't do.
+ */
+int
+useConfig(struct config * cfg, int startup) {
+  struct zone_config was;
+  int z, i;
+
+  // Command line limits hold whatever the time of day
+  for (z = 0; z < cfg->count; z++) {
+    if (cmd_litres >= 0) {
+      cfg->zone[z].max_litres = cmd_litres;
+      for (i = 0; i < cfg->zone[z].schedule_count; i++) {
+        cfg->zone[z].schedule[i].max_litres = cmd_litres;
+      }
+    }
+    if (cmd_cpl >= 0) {
+      cfg->zone[z].clicks_per_litre = cmd_cpl;
+    }
+    if (cmd_time >= 0) {
+      cfg->zone[z].time_limit = cmd_time * 60;
+      for (i = 0; i < cfg->zone[z].schedule_count; i++) {
+        cfg->zone[z].schedule[i].time_limit = cmd_time * 60;
+      }
+    }
+    if (cmd_reset >= 0) {
+      cfg->zone[z].reset_period = cmd_reset;
+    }
+  }
+  if (cmd_gpio_line >= 0) {
+    cfg->zone[0].gpio_line = cmd_gpio_line;
+  }
+  if (configCheck(cfg) < 0) {
+    return -1;
+  }
+  verbose = (cfg->verbose >= 0 ? cfg->verbose : 0) + cmd_verbose;
+  debounce = cfg->debounce;
+  long_press = cfg->long_press;
+  capture = cfg->capture;
+  pressure_rate = cfg->pressure_rate;
+  pressureRate(pressure_rate);
+  collector_interval = cfg->collector_interval;
+  uplinkInterval(collector_interval);
+  max_lag = cfg->max_lag;
+  healthBound(max_lag);
+  if (startup) {
+    zones.count = cfg->count;
+    memcpy(zones.config, cfg->zone, sizeof(cfg->zone));
+    gpio_chip = cfg->gpio_chip;
+    realtime = cmd_realtime >= 0 ? cmd_realtime : cfg->realtime;
+    realtime_cpu = cmd_realtime_cpu >= 0 ? cmd_realtime_cpu : cfg->realtime_cpu;
+    log_ring = cfg->log_ring;
+    metrics_port = cfg->metrics_port;
+    strcpy(metrics_address, cfg->metrics_address);
+    strcpy(collector, cfg->collector);
+    strcpy(site, cfg->site);
+    strcpy(watchdog_device, cfg->watchdog_device);
+    if (!site[0]) {
+      gethostname(site, sizeof(site) - 1);
+    }
+    return 0;
+  }
+  if (cfg->count != zones.count) {
+    printLog(0, "Config has %d zones rather than %d, restart to change them\n", cfg->count, zones.count);
+  }
+  for (z = 0; z < zones.count && z < cfg->count; z++) {
+    was = zones.config[z];
+    zones.config[z] = cfg->zone[z];
+    memcpy(zones.config[z].name, was.name, sizeof(was.name));
+    zones.config[z].flow_pin = was.flow_pin;
+    zones.config[z].relay_pin = was.relay_pin;
+    zones.config[z].button_pin = was.button_pin;
+    zones.config[z].gpio_line = was.gpio_line;
+    zones.config[z].pressure_pin = was.pressure_pin;
+  }
+  return 0;
+}
+
+/**
+ * Say once if the capture has started to have gaps in it, the count is
+ * in the stats.
+ */
+void
+checkCapture(void) {
+  static int told = 0;
+  int err;
+
+  if (!told && captureFailed(&err)) {
+    printLog(0, "Writing pulses to %s failed (%s), the capture has gaps\n", capture_file, strerror(err));
+    told = 1;
+  }
+}
+
+/**
+ * Start or stop capturing pulses to match the config.
+ */
+void
+setCapture(void) {
+  if (capture && !capturing) {
+    if (captureOpen(capture_file, zones.count, halRealtime(), halNow()) < 0) {
+      printLog(0, "Unable to capture pulses to %s: %s\n", capture_file, strerror(errno));
+      return;
+    }
+    capturing = 1;
+    printLog(1, "Capturing pulses to %s\n", capture_file);
+  } else if (!capture && capturing) {
+    captureClose();
+    capturing = 0;
+    printLog(1, "Pulse capture stopped\n");
+  }
+}
+
+/**
+ * Log lines about a zone start with its name, once there is more than
+ * one of them.
+ */
+const char *
+zoneTag(int z) {
+  static char tag[MAX_ZONES][ZONE_NAME + 2];
+
+  if (zones.count < 2) {
+    return "";
+  }
+  snprintf(tag[z], sizeof(tag[z]), "%s: ", zones.config[z].name);
+  return tag[z];
+}
+
+/**
+ * Publish the state by writing a new file and renaming it over the
+ * old one, so anyone watching never sees it empty or half written.
+ * The file has a line for every zone, subscribers on the notify socket
+ * get just the one that changed.
+ */
+void
+putState(int z, const char * buf, int len) {
+  char all[MAX_ZONES * STATE_LINE];
+  int i, fd, all_len = 0;
+
+  memcpy(zone_state[z], buf, len);
+  zone_state_len[z] = len;
+  for (i = 0; i < zones.count; i++) {
+    memcpy(all + all_len, zone_state[i], zone_state_len[i]);
+    all_len += zone_state_len[i];
+  }
+  notifyPublish(buf, len, all, all_len);
+  controlPublish(buf, len);
+  if ((fd = open(state_temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    printLog(0, "Unable to write state: %s\n", strerror(errno));
+    return;
+  }
+  if (write(fd, all, all_len) != all_len) {
+    printLog(0, "Unable to write state: %s\n", strerror(errno));
+    close(fd);
+    unlink(state_temp);
+    return;
+  }
+  close(fd);
+  if (rename(state_temp, state_file) < 0) {
+    printLog(0, "Unable to publish state: %s\n", strerror(errno));
+  }
 }
 
+/**
+ * State and reason for a zone, its name is added on the end.
+ */
 void
-writeState(const char * fmt, ...) {
+writeState(int z, const char * fmt, ...) {
   va_list args;
-  char buf[1024];
-  FILE * statefile;
+  char buf[STATE_LINE];
+  int len;
+  int64_t start;
 
-  statefile = fopen("/var/run/waterfuse/waterfuse.state", "w");
+  start = latencyStart();
   va_start(args, fmt);
-  vfprintf(statefile, fmt, args);
+  len = vsnprintf(buf, sizeof(buf), fmt, args);
   va_end(args);
-  fclose(statefile);
+  if (len < (int)sizeof(buf)) {
+    len += snprintf(buf + len, sizeof(buf) - len, "\t%s\n", zones.config[z].name);
+  }
+  if (len >= (int)sizeof(buf)) {
+    len = sizeof(buf) - 1;
+    buf[len - 1] = '\n';
+  }
+  putState(z, buf, len);
+  latencyEnd(&telemetry->state_hist, start);
+}
+
+void
+setRelay(int z, int value) {
+  int64_t start;
+
+  start = latencyStart();
+  hal->digitalWrite(zones.config[z].relay_pin, value);
+  latencyEnd(&telemetry->relay_hist, start);
+}
+
+/**
+ * One line per histogram, in microseconds.
+ */
+void
+showHist(int level, const char * name, const struct hist * h) {
+  printLog(level, "%s_us: count %llu, p50 %.1f, p99 %.1f, max %.1f\n", name,
+    (unsigned long long)h->count, histPercentile(h, 50) / 1e3,
+    histPercentile(h, 99) / 1e3, h->max / 1e3);
 }
 
 void
 showStats(int level) {
-  int now;
-  now = time(0);
-  printLog(level, "last_click_time: %d seconds ago\n", now - last_click_time);
-  printLog(level, "first_click_time: %d seconds ago\n", now - first_click_time);
-  printLog(level, "last_click_count: %d\n", last_click_count);
-  printLog(level, "total_litres: %d\n", total_clicks / clicks_per_litre);
+  struct flow_window * flow;
+  int now, z, err;
+  now = halNow() / NS;
+  for (z = 0; z < zones.count; z++) {
+    flow = &zones.flow[z];
+    printLog(level, "%slast_click_time: %d seconds ago\n", zoneTag(z), (int)(now - flow->last));
+    printLog(level, "%sfirst_click_time: %d seconds ago\n", zoneTag(z), (int)(now - flow->first));
+    printLog(level, "%slast_litres: %.3f\n", zoneTag(z), (double)flow->session / CAL_UL);
+    printLog(level, "%stotal_litres: %d\n", zoneTag(z), (int)(zones.total_volume[z] / CAL_UL));
+  }
+  printLog(level, "log_dropped: %u\n", logDropped());
+  printLog(level, "capture_failed: %u\n", captureFailed(&err));
+  printLog(level, "lag_max: %.1f ms, backlog_max %u, stalls %u\n", telemetry->lag_max / 1e6, telemetry->backlog_max, telemetry->stalls);
+  showHist(level, "loop", &telemetry->loop_hist);
+  showHist(level, "delivery", &telemetry->delivery_hist);
+  showHist(level, "log", &telemetry->log_hist);
+  showHist(level, "state", &telemetry->state_hist);
+  showHist(level, "relay", &telemetry->relay_hist);
+}
+
+/**
+ * Turn a zone's limits into flow accounting rules, see zoneRules().
+ */
+void
+setRules(int z) {
+  struct zone_config * c = &zones.config[z];
+
+  if (zoneRules(&zones, z) < 0) {
+    printLog(0, "%swindow_minutes %d is longer than we keep history for\n", zoneTag(z), c->window_minutes);
+  }
+  pressureRules(z, c->pressure_pin, c->pressure_drop, c->pressure_window);
+}
+
+/**
+ * Raise the alarm once a flow session has trickled on for leak_hours
+ * at no more than leak_rate on average, and stand it down when the
+ * flow stops.  Nothing is cut off, a leak is for someone to look at.
+ */
+void
+checkLeak(int z, int64_t now) {
+  struct flow_window * flow = &zones.flow[z];
+  struct zone_config * c = &zones.config[z];
+  int64_t secs = now - flow->first;
+
+  if (zones.alarmed[z] && !flow->counting) {
+    zones.alarmed[z] = 0;
+    printLog(1, "%sLow flow has stopped\n", zoneTag(z));
+    writeState(z, "started\tquiet");
+    return;
+  }
+  if (zones.alarmed[z] || c->leak_rate <= 0 || c->leak_hours <= 0 || !flow->counting || secs < c->leak_hours * 3600) {
+    return;
+  }
+  if (flow->session * 60 / ((uint64_t)secs * (CAL_UL / 1000)) <= (uint64_t)c->leak_rate) {
+    zones.alarmed[z] = 1;
+    printLog(1, "%sLow flow for %d hours, litres:%d, possible leak\n", zoneTag(z), (int)(secs / 3600), (int)(flow->session / CAL_UL));
+    writeState(z, "alarm\tleak");
+    historyEvent(halRealtime() / NS, z, HIST_ALARM, 1, 0, flow->session);
+  }
 }
 
 void
 showConfig(void) {
-  printLog(0, "reset_period: %d\n", reset_period);
-  printLog(0, "time_limit: %d\n", time_limit);
-  printLog(0, "max_litres: %d\n", max_litres);
-  printLog(0, "clicks_per_litre: %d\n", clicks_per_litre);
+  struct zone_config * c;
+  int z, i;
+
+  for (z = 0; z < zones.count; z++) {
+    c = &zones.config[z];
+    printLog(0, "zone: %s\n", c->name);
+    printLog(0, "  pins: flow %d, relay %d, button %d\n", c->flow_pin, c->relay_pin, c->button_pin);
+    printLog(0, "  reset_period: %d\n", c->reset_period);
+    printLog(0, "  time_limit: %d\n", c->time_limit);
+    printLog(0, "  max_litres: %d\n", c->max_litres);
+    for (i = 0; i < c->schedule_count; i++) {
+      printLog(0, "  schedule: from %02d:%02d, %d litres in %d minutes\n", c->schedule[i].at / 3600,
+        c->schedule[i].at / 60 % 60, c->schedule[i].max_litres, c->schedule[i].time_limit / 60);
+    }
+    if (c->window_litres > 0 && c->window_minutes > 0) {
+      printLog(0, "  window: %d litres in %d minutes\n", c->window_litres, c->window_minutes);
+    }
+    if (c->max_rate > 0) {
+      printLog(0, "  max_rate: %d litres a minute\n", c->max_rate);
+    }
+    if (c->leak_rate > 0 && c->leak_hours > 0) {
+      printLog(0, "  leak: %d ml a minute for %d hours\n", c->leak_rate, c->leak_hours);
+    }
+    if (c->pressure_drop > 0) {
+      printLog(0, "  pressure: pin %d, drop %d within %d seconds\n", c->pressure_pin, c->pressure_drop, c->pressure_window);
+    }
+    printLog(0, "  clicks_per_litre: %d\n", c->clicks_per_litre);
+    for (i = 0; i < c->cal_points; i++) {
+      printLog(0, "  calibrate: %d clicks a litre at %d litres a minute\n", c->cal[i].clicks_per_litre, c->cal[i].rate);
+    }
+    if (c->gpio_line >= 0) {
+      printLog(0, "  gpio: chip %d line %d\n", gpio_chip, c->gpio_line);
+    }
+  }
   printLog(0, "verbose: %d\n", verbose);
+  if (verbose > LOG_MAX) {
+    printLog(0, "  this build only logs up to %d\n", LOG_MAX);
+  }
+  if (realtime > 0) {
+    printLog(0, "realtime: priority %d, cpu %d\n", realtime, realtime_cpu);
+  }
+  if (capture) {
+    printLog(0, "capture: %s\n", capture_file);
+  }
+  if (log_ring > 0) {
+    printLog(0, "log_ring: %d kilobytes in %s\n", log_ring, log_ring_file);
+  }
+  if (metrics_port > 0) {
+    printLog(0, "metrics_port: %d on %s\n", metrics_port, metrics_address[0] ? metrics_address : "loopback");
+  }
+  if (collector[0]) {
+    printLog(0, "collector: %s as %s, every %d seconds\n", collector, site, collector_interval);
+  }
+  printLog(0, "max_lag: %d ms\n", max_lag);
+  if (watchdog_device[0]) {
+    printLog(0, "watchdog_device: %s\n", watchdog_device);
+  }
+  printLog(0, "buttons: debounce %d ms, long press %d seconds\n", debounce, long_press);
+  printLog(0, "pressure_rate: %d reads a second\n", pressure_rate);
+}
+
+int
+setPriority(int prio) {
+  struct sched_param sp;
+  int err;
+
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = prio;
+  if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)) != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
 }
 
+/**
+ * Opt-in real-time mode for the control path.  This runs just before
+ * the pulse source starts, so its thread inherits the lot, and after
+ * the log and history threads exist, so they don't.  The pulse thread
+ * is given a level above the loop so a pulse is never held up behind
+ * it (wiringPi's own ISR thread sets itself up with piHiPri anyway).
+ * None of it is essential, so lacking the privileges is only a warning.
+ */
 void
-signalHandler(int sig) {
-  switch (sig) {
-    case SIGHUP:
-      rollLog();
-      readConfig();
-      break;
-    case SIGUSR1:
-      reset = 2;
-      break;
-    case SIGUSR2:
-      showStats(0);
-      break;
-    case SIGCONT:
-      digitalWrite(POWER_RELAY, LOW);
-      triggered=1;
-      break;
+startRealtime(void) {
+  cpu_set_t cpus;
+  int max;
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    printLog(0, "Warning: unable to lock memory: %s\n", strerror(errno));
+  }
+  if (realtime_cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(realtime_cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+      printLog(0, "Warning: unable to pin to cpu %d: %s\n", realtime_cpu, strerror(errno));
     }
+  }
+  max = sched_get_priority_max(SCHED_FIFO);
+  if (realtime >= max) {
+    realtime = max - 1;
+  }
+  if (setPriority(realtime + 1) < 0) {
+    printLog(0, "Warning: unable to set real-time priority %d: %s\n", realtime, strerror(errno));
+    realtime = 0;
+  }
+}
+
+/**
+ * Signals come in through a signalfd and only ever queue a command, so
+ * nothing runs in signal context and the loop applies them all at the
+ * same point in its pass.
+ */
+void
+readSignals(int fd) {
+  struct signalfd_siginfo si[8];
+  ssize_t len;
+  int i;
+
+  while ((len = read(fd, si, sizeof(si))) > 0) {
+    for (i = 0; i < len / (ssize_t)sizeof(si[0]); i++) {
+      switch (si[i].ssi_signo) {
+        case SIGHUP:
+          commands |= CMD_RELOAD;
+          break;
+        case SIGUSR1:
+          memset(reset_queued, RESET_SIGNAL, sizeof(reset_queued));
+          break;
+        case SIGUSR2:
+          commands |= CMD_STATS;
+          break;
+        case SIGCONT:
+          memset(stop_queued, STOP_SIGNAL, sizeof(stop_queued));
+          break;
+        case SIGTERM:
+        case SIGINT:
+          commands |= CMD_QUIT;
+          break;
+      }
+    }
+  }
+}
+
+/**
+ * Arm a timer to fire in secs seconds, repeating if interval is set.
+ * A zero or negative value disarms it.
+ */
+void
+armTimer(int fd, int secs, int interval) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (secs > 0) {
+    halDuration(secs * NS, &its.it_value);
+    if (interval) {
+      its.it_interval = its.it_value;
+    }
+  }
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+/**
+ * Arm a timer to fire once, ns from now.  Anything already due fires
+ * straight away.
+ */
+void
+armTimerNs(int fd, int64_t ns) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  halDuration(ns > 0 ? ns : 1, &its.it_value);
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+/**
+ * Add an fd to the epoll set, we only ever care about it being readable.
+ */
+int
+watchFd(int epfd, int fd) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Create a monotonic timer that is watched by the main loop.
+ */
+int
+newTimer(int epfd) {
+  int fd;
+
+  if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    return -1;
+  }
+  if (watchFd(epfd, fd) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Put each zone's schedule entry for the time of day in force, making
+ * its rules again if that is a change, and have fd go off when the
+ * next change is due.  Nothing else ever looks at the schedule.
+ */
+void
+applySchedule(int fd) {
+  struct schedule_entry * s;
+  time_t t = halRealtime() / NS, when, next = 0;
+  int z, was;
+
+  for (z = 0; z < zones.count; z++) {
+    was = zones.period[z];
+    if ((when = zoneSchedule(&zones, z, t)) && (!next || when < next)) {
+      next = when;
+    }
+    if (zones.period[z] != was) {
+      setRules(z);
+      if (zones.period[z] >= 0) {
+        s = &zones.config[z].schedule[zones.period[z]];
+        printLog(1, "%sSchedule from %02d:%02d, max_litres %d, max_time %d\n", zoneTag(z),
+          s->at / 3600, s->at / 60 % 60, s->max_litres, s->time_limit / 60);
+      }
+    }
+  }
+  armTimer(fd, next ? next - t : 0, 0);
+}
+
+/**
+ * The health monitor has found the loop stuck.  This is on the
+ * monitor's thread, so it only turns the pumps off and tells the
+ * collector, which needs nothing from the loop.  The rest is left for
+ * the loop to do when it comes back, see healthStalled().
+ */
+void
+failSafe(int64_t lag) {
+  int z;
+
+  for (z = 0; z < zones.count; z++) {
+    hal->digitalWrite(zones.config[z].relay_pin, HAL_LOW);
+  }
+  uplinkStalled(lag);
+  // For the first pass it can get to
+  wakeLoop();
+}
+
+/**
+ * Copy the live counters out to the shared memory segment, along
+ * with how long this pass of the main loop took.
+ */
+void
+publishTelemetry(int64_t busy) {
+  struct telemetry * t = telemetry;
+  struct telemetry_zone * tz;
+  struct health_stats health;
+  int z;
+
+  telemetryBegin(t);
+  t->updated = halRealtime();
+  t->zones = zones.count;
+  for (z = 0; z < zones.count; z++) {
+    tz = &t->zone[z];
+    memcpy(tz->name, zones.config[z].name, sizeof(tz->name));
+    tz->volume = zones.flow[z].session;
+    tz->total_volume = zones.total_volume[z];
+    tz->total_clicks = zones.total_clicks[z];
+    tz->clicks_per_litre = zones.config[z].clicks_per_litre;
+    tz->flow_rate = zones.flow_rate[z] * 1000;
+    tz->triggered = zones.triggered[z];
+    tz->counting = zones.flow[z].counting;
+    tz->stop_reason = zones.stop_reason[z];
+    tz->reset_reason = zones.reset_reason[z];
+    tz->alarmed = zones.alarmed[z];
+    tz->cutoffs = zones.cutoffs[z];
+  }
+  healthRead(&health);
+  t->lag_max = health.lag_max;
+  t->backlog_max = health.backlog_max;
+  t->stalls = health.stalls;
+  t->loops++;
+  t->loop_last = busy;
+  if (busy > t->loop_max) {
+    t->loop_max = busy;
+  }
+  t->loop_total += busy;
+  if (INSTRUMENT) {
+    histRecord(&t->loop_hist, busy);
+  }
+  telemetryEnd(t);
+}
+
+/**
+ * Checkpoint everything we would need to carry on after a restart.
+ */
+void
+saveCheckpoint(void) {
+  static struct checkpoint cp;
+
+  cp.zones = zones.count;
+  memcpy(cp.total_clicks, zones.total_clicks, sizeof(cp.total_clicks));
+  memcpy(cp.total_volume, zones.total_volume, sizeof(cp.total_volume));
+  memcpy(cp.cutoffs, zones.cutoffs, sizeof(cp.cutoffs));
+  memcpy(cp.triggered, zones.triggered, sizeof(cp.triggered));
+  memcpy(cp.stop_reason, zones.stop_reason, sizeof(cp.stop_reason));
+  memcpy(cp.reset_reason, zones.reset_reason, sizeof(cp.reset_reason));
+  cp.mono = halNow();
+  cp.real = halRealtime();
+  checkpointSave(&cp, zones.flow);
+}
+
+/**
+ * Pick up where a previous run left off, returns non-zero if we did.
+ * Zones go by their place in the config, so if the number of them has
+ * changed there is no telling which is which and we start afresh.
+ */
+int
+restoreCheckpoint(void) {
+  static struct checkpoint cp;
+  int z;
+
+  if (checkpointRestore(&cp, halNow(), halRealtime()) < 0) {
+    return 0;
+  }
+  if (cp.zones != (uint32_t)zones.count) {
+    printLog(0, "Checkpoint is for %u zones rather than %d, ignoring it\n", cp.zones, zones.count);
+    return 0;
+  }
+  memcpy(zones.total_clicks, cp.total_clicks, sizeof(cp.total_clicks));
+  memcpy(zones.total_volume, cp.total_volume, sizeof(cp.total_volume));
+  memcpy(zones.cutoffs, cp.cutoffs, sizeof(cp.cutoffs));
+  memcpy(zones.triggered, cp.triggered, sizeof(cp.triggered));
+  memcpy(zones.stop_reason, cp.stop_reason, sizeof(cp.stop_reason));
+  memcpy(zones.reset_reason, cp.reset_reason, sizeof(cp.reset_reason));
+  for (z = 0; z < zones.count; z++) {
+    checkpointFlow(z, &zones.flow[z]);
+  }
+  return 1;
+}
+
+/**
+ * Add a line to a control reply, never running past size.
+ */
+int
+addLine(char * out, int size, int len, const char * fmt, ...) {
+  va_list args;
+  int n;
+
+  if (len >= size) {
+    return len;
+  }
+  va_start(args, fmt);
+  n = vsnprintf(out + len, size - len, fmt, args);
+  va_end(args);
+  return n < size - len ? len + n : size;
+}
+
+/**
+ * Answer a request on the control socket, see control.h.  Resets and
+ * stops are queued like the signal ones, and so take effect further on
+ * in this same pass of the loop.
+ */
+int
+controlRequest(int type, const char * arg, char * out, int size) {
+  struct flow_window * flow;
+  struct zone_config * c;
+  struct schedule_entry * s;
+  int z, i, err, first = 0, last = zones.count, len = 0;
+
+  if (*arg) {
+    for (z = 0; z < zones.count && strcmp(zones.config[z].name, arg) != 0; z++)
+      ;
+    if (z == zones.count) {
+      return -ENOENT;
+    }
+    first = z;
+    last = z + 1;
+  }
+  switch (type) {
+    case CTL_STATS:
+      for (z = first; z < last; z++) {
+        flow = &zones.flow[z];
+        c = &zones.config[z];
+        len = addLine(out, size, len, "zone %s\n", c->name);
+        len = addLine(out, size, len, "triggered %d\n", zones.triggered[z]);
+        len = addLine(out, size, len, "counting %d\n", flow->counting);
+        len = addLine(out, size, len, "alarmed %d\n", zones.alarmed[z]);
+        len = addLine(out, size, len, "stop_reason %s\n", zones.stop_reason[z] ? stop_msg[zones.stop_reason[z]] : "none");
+        len = addLine(out, size, len, "reset_reason %s\n", zones.reset_reason[z] ? reset_msg[zones.reset_reason[z]] : "none");
+        len = addLine(out, size, len, "litres %.3f\n", (double)flow->session / CAL_UL);
+        len = addLine(out, size, len, "seconds %d\n", flow->counting ? (int)(flow->last - flow->first) : 0);
+        len = addLine(out, size, len, "total_clicks %llu\n", (unsigned long long)zones.total_clicks[z]);
+        len = addLine(out, size, len, "total_litres %.3f\n", (double)zones.total_volume[z] / CAL_UL);
+        len = addLine(out, size, len, "flow_rate %.3f\n", zones.flow_rate[z]);
+        if (pressureLatest(z) >= 0) {
+          len = addLine(out, size, len, "pressure %d\n", pressureLatest(z));
+        }
+        if (zones.period[z] >= 0) {
+          s = &c->schedule[zones.period[z]];
+          len = addLine(out, size, len, "schedule %02d:%02d\n", s->at / 3600, s->at / 60 % 60);
+        }
+        len = addLine(out, size, len, "cutoffs %u\n", zones.cutoffs[z]);
+      }
+      len = addLine(out, size, len, "log_dropped %u\n", logDropped());
+      if (collector[0]) {
+        len = addLine(out, size, len, "uplink_dropped %u\n", uplinkDropped());
+      }
+      len = addLine(out, size, len, "lag_max_ms %.1f\n", telemetry->lag_max / 1e6);
+      len = addLine(out, size, len, "backlog_max %u\n", telemetry->backlog_max);
+      len = addLine(out, size, len, "stalls %u\n", telemetry->stalls);
+      return len;
+    case CTL_RESET:
+      for (z = first; z < last; z++) {
+        reset_queued[z] = RESET_CONTROL;
+      }
+      return 0;
+    case CTL_STOP:
+      for (z = first; z < last; z++) {
+        stop_queued[z] = STOP_CONTROL;
+      }
+      return 0;
+    case CTL_CONFIG:
+      // As it would be written in the config file
+      len = addLine(out, size, len, "verbosity %d\n", verbose);
+      len = addLine(out, size, len, "button_debounce %d\n", debounce);
+      len = addLine(out, size, len, "long_press %d\n", long_press);
+      len = addLine(out, size, len, "capture %d\n", capture);
+      len = addLine(out, size, len, "capture_failed %u\n", captureFailed(&err));
+      len = addLine(out, size, len, "pressure_rate %d\n", pressure_rate);
+      if (collector[0]) {
+        len = addLine(out, size, len, "collector %s\nsite %s\n", collector, site);
+      }
+      len = addLine(out, size, len, "collector_interval %d\n", collector_interval);
+      len = addLine(out, size, len, "max_lag %d\n", max_lag);
+      if (watchdog_device[0]) {
+        len = addLine(out, size, len, "watchdog_device %s\n", watchdog_device);
+      }
+      for (z = first; z < last; z++) {
+        c = &zones.config[z];
+        len = addLine(out, size, len, "zone %s\n", c->name);
+        len = addLine(out, size, len, "clicks_per_litre %d\n", c->clicks_per_litre);
+        for (i = 0; i < c->cal_points; i++) {
+          len = addLine(out, size, len, "calibrate %d %d\n", c->cal[i].rate, c->cal[i].clicks_per_litre);
+        }
+        len = addLine(out, size, len, "max_litres %d\n", c->max_litres);
+        len = addLine(out, size, len, "max_time %d\n", c->time_limit / 60);
+        for (i = 0; i < c->schedule_count; i++) {
+          s = &c->schedule[i];
+          len = addLine(out, size, len, "schedule %02d:%02d %d %d\n", s->at / 3600, s->at / 60 % 60, s->max_litres, s->time_limit / 60);
+        }
+        len = addLine(out, size, len, "reset_period %d\n", c->reset_period);
+        len = addLine(out, size, len, "window_litres %d\n", c->window_litres);
+        len = addLine(out, size, len, "window_minutes %d\n", c->window_minutes);
+        len = addLine(out, size, len, "max_rate %d\n", c->max_rate);
+        len = addLine(out, size, len, "leak_rate %d\n", c->leak_rate);
+        len = addLine(out, size, len, "leak_hours %d\n", c->leak_hours);
+        len = addLine(out, size, len, "flow_pin %d\n", c->flow_pin);
+        len = addLine(out, size, len, "relay_pin %d\n", c->relay_pin);
+        len = addLine(out, size, len, "button_pin %d\n", c->button_pin);
+        len = addLine(out, size, len, "gpio_line %d\n", c->gpio_line);
+        len = addLine(out, size, len, "pressure_pin %d\n", c->pressure_pin);
+        len = addLine(out, size, len, "pressure_drop %d\n", c->pressure_drop);
+        len = addLine(out, size, len, "pressure_window %d\n", c->pressure_window);
+      }
+      return len;
+    case CTL_SUBSCRIBE:
+      for (z = 0; z < zones.count; z++) {
+        len = addLine(out, size, len, "%.*s", zone_state_len[z], zone_state[z]);
+      }
+      return len;
+  }
+  return -EINVAL;
+}
+
+/**
+ * A latency histogram as a Prometheus one, with a bucket for each power
+ * of two from about a microsecond up.
+ */
+int
+addHist(char * out, int size, int len, const char * name, const char * help, const struct hist * h) {
+  uint64_t below = 0;
+  int i, e;
+
+  len = addLine(out, size, len, "# HELP waterfuse_%s_seconds %s\n# TYPE waterfuse_%s_seconds histogram\n", name, help, name);
+  for (i = 0, e = 10; e <= HIST_MAX_EXP; e++) {
+    // Everything in the buckets so far is under 2^e ns
+    for (; i < (e - HIST_SUB_BITS + 1) * HIST_SUB; i++) {
+      below += h->bucket[i];
+    }
+    len = addLine(out, size, len, "waterfuse_%s_seconds_bucket{le=\"%.9g\"} %llu\n", name, (double)(1LL << e) / NS, (unsigned long long)below);
+  }
+  len = addLine(out, size, len, "waterfuse_%s_seconds_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+  len = addLine(out, size, len, "waterfuse_%s_seconds_sum %.9f\n", name, (double)h->sum / NS);
+  return addLine(out, size, len, "waterfuse_%s_seconds_count %llu\n", name, (unsigned long long)h->count);
+}
+
+/**
+ * The /metrics page, see metrics.h.
+ */
+int
+renderMetrics(char * out, int size) {
+  struct flow_window * flow;
+  const char * name;
+  int z, r, len = 0;
+
+  len = addLine(out, size, len, "# HELP waterfuse_litres_total Water through the meter.\n# TYPE waterfuse_litres_total counter\n");
+  for (z = 0; z < zones.count; z++) {
+    len = addLine(out, size, len, "waterfuse_litres_total{zone=\"%s\"} %.3f\n", zones.config[z].name, (double)zones.total_volume[z] / CAL_UL);
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_session_litres Water in the current flow session.\n# TYPE waterfuse_session_litres gauge\n");
+  for (z = 0; z < zones.count; z++) {
+    len = addLine(out, size, len, "waterfuse_session_litres{zone=\"%s\"} %.3f\n", zones.config[z].name, (double)zones.flow[z].session / CAL_UL);
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_window_litres Water within window_minutes.\n# TYPE waterfuse_window_litres gauge\n");
+  for (z = 0; z < zones.count; z++) {
+    flow = &zones.flow[z];
+    if (flow->rule[2].kind == FW_VOLUME) {
+      len = addLine(out, size, len, "waterfuse_window_litres{zone=\"%s\"} %.3f\n", zones.config[z].name, (double)flow->rule[2].sum / CAL_UL);
+    }
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_flow_rate Litres a minute.\n# TYPE waterfuse_flow_rate gauge\n");
+  for (z = 0; z < zones.count; z++) {
+    len = addLine(out, size, len, "waterfuse_flow_rate{zone=\"%s\"} %.3f\n", zones.config[z].name, zones.flow_rate[z]);
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_pressure Filtered pressure, in ADC counts.\n# TYPE waterfuse_pressure gauge\n");
+  for (z = 0; z < zones.count; z++) {
+    if (pressureLatest(z) >= 0) {
+      len = addLine(out, size, len, "waterfuse_pressure{zone=\"%s\"} %d\n", zones.config[z].name, pressureLatest(z));
+    }
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_triggered Pump cut off.\n# TYPE waterfuse_triggered gauge\n");
+  for (z = 0; z < zones.count; z++) {
+    len = addLine(out, size, len, "waterfuse_triggered{zone=\"%s\"} %d\n", zones.config[z].name, zones.triggered[z]);
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_cutoffs_total Cutoffs since starting, by reason.\n# TYPE waterfuse_cutoffs_total counter\n");
+  for (z = 0; z < zones.count; z++) {
+    name = zones.config[z].name;
+    for (r = STOP_VOLUME; r < STOP_REASONS; r++) {
+      len = addLine(out, size, len, "waterfuse_cutoffs_total{zone=\"%s\",reason=\"%s\"} %u\n", name, stop_msg[r], zones.cutoff_count[z][r]);
+    }
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_resets_total Resets since starting, by source.\n# TYPE waterfuse_resets_total counter\n");
+  for (z = 0; z < zones.count; z++) {
+    name = zones.config[z].name;
+    for (r = RESET_BUTTON; r < RESET_REASONS; r++) {
+      len = addLine(out, size, len, "waterfuse_resets_total{zone=\"%s\",source=\"%s\"} %u\n", name, reset_msg[r], zones.reset_count[z][r]);
+    }
+  }
+  len = addLine(out, size, len, "# HELP waterfuse_log_dropped_total Log lines lost to a full queue.\n# TYPE waterfuse_log_dropped_total counter\n");
+  len = addLine(out, size, len, "waterfuse_log_dropped_total %u\n", logDropped());
+  len = addLine(out, size, len, "# HELP waterfuse_loop_lag_max_seconds Longest pass of the loop the health monitor has seen.\n# TYPE waterfuse_loop_lag_max_seconds gauge\n");
+  len = addLine(out, size, len, "waterfuse_loop_lag_max_seconds %.6f\n", telemetry->lag_max / 1e9);
+  len = addLine(out, size, len, "# HELP waterfuse_pulse_backlog_max Most pulses seen waiting in one ring.\n# TYPE waterfuse_pulse_backlog_max gauge\n");
+  len = addLine(out, size, len, "waterfuse_pulse_backlog_max %u\n", telemetry->backlog_max);
+  len = addLine(out, size, len, "# HELP waterfuse_stalls_total Times the loop was found stuck and the pumps turned off.\n# TYPE waterfuse_stalls_total counter\n");
+  len = addLine(out, size, len, "waterfuse_stalls_total %u\n", telemetry->stalls);
+  len = addHist(out, size, len, "loop", "Main loop passes.", &telemetry->loop_hist);
+  len = addHist(out, size, len, "delivery", "Pulse to the loop taking it.", &telemetry->delivery_hist);
+  len = addHist(out, size, len, "log", "Queueing a log line.", &telemetry->log_hist);
+  len = addHist(out, size, len, "state", "Publishing the state.", &telemetry->state_hist);
+  return addHist(out, size, len, "relay", "Switching the relay.", &telemetry->relay_hist);
+}
+
+/**
+ * Everything we keep on disk moves under dir when one is given, so a
+ * simulator run can't touch the real daemon's files.
+ */
+void
+setPaths(const char * dir) {
+  if (dir) {
+    run_dir = dir;
+  }
+  snprintf(state_file, sizeof(state_file), "%s/waterfuse.state", run_dir);
+  snprintf(state_temp, sizeof(state_temp), "%s/.waterfuse.state", run_dir);
+  snprintf(notify_path, sizeof(notify_path), "%s/waterfuse.sock", run_dir);
+  snprintf(control_path, sizeof(control_path), "%s/waterfuse.ctl", run_dir);
+  snprintf(pid_file, sizeof(pid_file), "%s/waterfuse.pid", run_dir);
+  snprintf(history_file, sizeof(history_file), "%s", dir ? dir : HISTORY_FILE);
+  snprintf(checkpoint_file, sizeof(checkpoint_file), "%s", dir ? dir : CHECKPOINT_FILE);
+  snprintf(log_ring_file, sizeof(log_ring_file), "%s", dir ? dir : LOGRING_FILE);
+  snprintf(capture_file, sizeof(capture_file), "%s", dir ? dir : CAPTURE_FILE);
+  if (dir) {
+    strncat(log_ring_file, "/waterfuse.ring", sizeof(log_ring_file) - strlen(log_ring_file) - 1);
+    strncat(capture_file, "/pulses", sizeof(capture_file) - strlen(capture_file) - 1);
+    strncat(history_file, "/history", sizeof(history_file) - strlen(history_file) - 1);
+    strncat(checkpoint_file, "/checkpoint", sizeof(checkpoint_file) - strlen(checkpoint_file) - 1);
+  }
 }
 
 void
@@ -170,55 +1186,265 @@ createPidFile(void) {
   struct stat st;
 
   pid = getpid();
-  if (stat("/var/run/waterfuse", &st) < 0) {
-    mkdir("/var/run/waterfuse", 0755);
+  if (stat(run_dir, &st) < 0) {
+    mkdir(run_dir, 0755);
   }
 
-  pidfile = fopen("/var/run/waterfuse/waterfuse.pid", "w");
+  pidfile = fopen(pid_file, "w");
   fprintf(pidfile, "%d\n", pid);
   fclose(pidfile);
 }
 
+/**
+ * Turn what the buttons have done into resets and stops for the zones
+ * on them, queued like any others.  A press only resets zones that are
+ * cut off, a long press stops every zone on the button.  Returns when
+ * the buttons next need looking at, in ns, 0 for not until an edge.
+ */
+int64_t
+checkButtons(int64_t now) {
+  struct button * b;
+  int64_t when, next = 0;
+  int i, z;
+
+  for (i = 0; i < nbuttons; i++) {
+    b = &buttons[i];
+    switch (btnCheck(b, now, hal->digitalRead(b->pin) == HAL_LOW, debounce * NS / 1000, long_press * NS)) {
+      case BTN_PRESS:
+        for (z = 0; z < zones.count; z++) {
+          if (zones.config[z].button_pin == b->pin && zones.triggered[z]) {
+            reset_queued[z] = RESET_BUTTON;
+          }
+        }
+        break;
+      case BTN_LONG:
+        printLog(1, "Long press on button pin %d\n", b->pin);
+        for (z = 0; z < zones.count; z++) {
+          if (zones.config[z].button_pin == b->pin) {
+            stop_queued[z] = STOP_BUTTON;
+          }
+        }
+        break;
+    }
+    when = btnNext(b, long_press * NS);
+    if (when && (!next || when < next)) {
+      next = when;
+    }
+  }
+  return next;
+}
+
+/**
+ * One pass of the loop for a zone: take its pulses, then reset it or
+ * cut it off as need be.  reset_by is non-zero when the zone has been
+ * told to reset.
+ */
+void
+serviceZone(int z, int now, int reset_by) {
+  struct flow_window * flow = &zones.flow[z];
+  unsigned int litres, new_clicks;
+  int seconds_from_first;
+
+  new_clicks = drainPulses(z, now);
+  zones.total_clicks[z] += new_clicks;
+  litres = flow->session / CAL_UL;
+  printLog(3, "%slitres: %.3f, triggered=%d, counting=%d, new=%d, rate=%.1f\n", zoneTag(z), (double)flow->session / CAL_UL, zones.triggered[z], flow->counting, new_clicks, zones.flow_rate[z]);
+  if (reset_by) {
+    zones.triggered[z] = 0;
+    zones.stop_reason[z] = STOP_NONE;
+    fwReset(flow);
+    printLog(2, "%sTurning pump on after reset by %s\n", zoneTag(z), reset_msg[reset_by]);
+    writeState(z, "started\t%s", reset_msg[reset_by]);
+    historyEvent(halRealtime() / NS, z, HIST_RESET, reset_by, 0, 0);
+    zones.reset_reason[z] = reset_by;
+    zones.reset_count[z][reset_by]++;
+    zones.alarmed[z] = 0;
+    setRelay(z, HAL_HIGH);
+  }
+  if (!zones.triggered[z]) {
+    if (zones.stop_reason[z]) {
+      zones.triggered[z] = 1;
+      // The pump first, everything after it can take as long as the card does
+      setRelay(z, HAL_LOW);
+      if (bench_file) {
+        benchSample(BENCH_CUTOFF, (halNow() - zones.trip_stamp[z]) / halSpeed());
+      }
+      zones.cutoffs[z]++;
+      zones.cutoff_count[z][zones.stop_reason[z]]++;
+      seconds_from_first = flow->last - flow->first;
+      printLog(2,"%sTurning pump off (%s) litres:%d, seconds:%d\n", zoneTag(z), stop_msg[zones.stop_reason[z]], litres, seconds_from_first);
+      writeState(z, "stopped\t%s", stop_msg[zones.stop_reason[z]]);
+      historyEvent(halRealtime() / NS, z, HIST_CUTOFF, zones.stop_reason[z], 0, flow->session);
+      showStats(2);
+    } else {
+      fwIdle(flow, now);
+      checkLeak(z, now);
+    }
+  }
+}
+
+/**
+ * Work out what a zone next needs the loop for.  While counting that
+ * is the click that could trip a rule, which once the time limit is up
+ * is any click at all, plus a look when the flow should have been
+ * quiet for reset_period or the leak alarm is due.  When idle it is
+ * just the first click, and when triggered only the reset button needs
+ * polling.  Returns the time of the next look, 0 for none.
+ */
+int64_t
+scheduleZone(int z, int now) {
+  struct flow_window * flow = &zones.flow[z];
+  struct zone_config * c = &zones.config[z];
+  int64_t when, next = 0;
+  uint64_t room;
+
+  if (zones.triggered[z]) {
+    ringWakeAt(&pulses[z], PULSE_RING_NEVER);
+    return 0;
+  }
+  when = fwSessionEnd(flow);
+  if (when > now) {
+    next = when;
+  }
+  when = fwTimeLimit(flow);
+  if (when > now && (!next || when < next)) {
+    next = when;
+  }
+  when = flow->first + c->leak_hours * 3600;
+  if (c->leak_rate > 0 && c->leak_hours > 0 && flow->counting && !zones.alarmed[z]
+   && when > now && (!next || when < next)) {
+    next = when;
+  }
+  // Headroom is in microlitres, the ring counts pulses
+  room = calPulses(&zones.cal[z], fwHeadroom(flow, now));
+  // A burst has to be seen while it is still a burst
+  if (zones.rate_gap[z] && room > RATE_BATCH) {
+    room = RATE_BATCH;
+  }
+  // The ISR may have gone past the new threshold already
+  if (ringWakeAt(&pulses[z], room < PULSE_RING_NEVER ? room : PULSE_RING_NEVER)) {
+    wakeLoop();
+  }
+  return next;
+}
+
 int
 main(int argc, char **argv) {
-  unsigned int litres = 0;
-  int stop_reason = 0;
   int opt;
   int now;
-  int seconds_from_first, seconds, time_periods, new_clicks;
-  struct sigaction sa;
-  int total_litres;
-  int pressure;
-  char * reset_msg[3] = { "", "button", "signal" };
-  char * stop_msg[3] = { "", "volume", "time" };
-
-  // Grab config from our config file first
-  readConfig();
-
-  // Now allow command-line overrides
-  while ((opt = getopt(argc, argv, "l:c:r:t:vd")) != -1) {
+  int64_t when, next, button_next, fell, uplink_next, uplink_armed = 0, stalled, ping_every;
+  int64_t woke;
+  sigset_t signals;
+  int epfd, sig_fd, deadline_fd, button_fd, history_fd, checkpoint_fd, publish_fd, schedule_fd, uplink_fd, watchdog_fd;
+  unsigned int counting, triggered, saved_counting, saved_triggered;
+  int64_t saved;
+  uint64_t total_clicks;
+  int i, z, nev, fd, reset_by, traces, scraped;
+  unsigned int todo;
+  int button_armed = 0, checkpoint_armed = 0, publish_armed = 0;
+  const char * dir = NULL;
+  const char * p;
+  char buf[64];
+  struct zone_config * c;
+  struct config cfg, * reload;
+  struct telemetry * t;
+  struct timespec cpu;
+  int done;
+  uint64_t expiries;
+  struct epoll_event events[MAX_EVENTS];
+
+  logInit();
+
+  // Command-line settings win over the config file, the limits are for
+  // every zone
+  while ((opt = getopt(argc, argv, "l:c:r:t:g:f:S:x:D:B:R:C:vd")) != -1) {
     switch (opt) {
       case 'l':
-        max_litres = atoi(optarg);
+        cmd_litres = atoi(optarg);
 	break;
       case 'c':
-        clicks_per_litre = atoi(optarg);
+        cmd_cpl = atoi(optarg);
 	break;
       case 't':
-        time_limit = atoi(optarg) * 60;
+        cmd_time = atoi(optarg);
 	break;
       case 'r':
-        reset_period = atoi(optarg);
+        cmd_reset = atoi(optarg);
+	break;
+      case 'g':
+        cmd_gpio_line = atoi(optarg);
+	break;
+      case 'f':
+        config_file = optarg;
+	break;
+      case 'S':
+        sim_trace = optarg;
+	break;
+      case 'x':
+        sim_speed = atoi(optarg);
+	break;
+      case 'D':
+        dir = optarg;
+	break;
+      case 'B':
+        if ((bench_file = fopen(optarg, "w")) == NULL) {
+          fprintf(stderr, "Unable to open %s: %s\n", optarg, strerror(errno));
+          return 1;
+        }
 	break;
       case 'd':
         daemonise = 0;
 	break;
+      case 'R':
+        cmd_realtime = atoi(optarg);
+	break;
+      case 'C':
+        cmd_realtime_cpu = atoi(optarg);
+	break;
       case 'v':
-        verbose++;
+        cmd_verbose++;
 	break;
     }
   }
 
+  setPaths(dir);
+  if (configLoad(config_file, &cfg) < 0 || useConfig(&cfg, 1) < 0) {
+    fprintf(stderr, "Unable to use config: %s\n", cfg.error);
+    return 1;
+  }
+
+  // A trace means the simulator, otherwise whatever drives real pins
+  if ((hal = halFind(sim_trace ? "sim" : NULL)) == NULL) {
+    fprintf(stderr, "No %s pin backend in this build\n", sim_trace ? "simulator" : "hardware");
+    return 1;
+  }
+  if (sim_trace) {
+    // One trace per zone, in order
+    for (traces = 1, p = sim_trace; (p = strchr(p, ',')) != NULL; p++) {
+      traces++;
+    }
+    if (traces > zones.count) {
+      fprintf(stderr, "%d traces for only %d zones\n", traces, zones.count);
+      return 1;
+    }
+  }
+  if (hal->setup(sim_trace) < 0) {
+    fprintf(stderr, "Unable to set up %s pins: %s\n", hal->name, strerror(errno));
+    return 1;
+  }
+  // Before anything reads the clock
+  halSetSpeed(sim_trace ? sim_speed : 1);
+
+  // Blocked before any thread starts, so they all come to the signalfd
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  sigaddset(&signals, SIGCONT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+
   // Now we switch to daemon;
   if (daemonise) {
     close(0);
@@ -226,118 +1452,382 @@ main(int argc, char **argv) {
     daemon(1, 1);
   }
 
-  // And print out our config
-  printLog(0, "Starting\n");
-  writeState("started\tstartup\n");
-  showConfig();
+  // A ring log is never reopened, so the text log only gets what goes
+  // straight to stderr
+  if (log_ring > 0 && logRing(log_ring_file, (size_t)log_ring * 1024) < 0) {
+    fprintf(stderr, "Unable to use ring log %s, logging as text: %s\n", log_ring_file, strerror(errno));
+    log_ring = 0;
+  }
 
-  // Create pidfile
+  // Threads don't survive daemon(), so the log writer starts here
+  if (logStart(1) < 0) {
+    fprintf(stderr, "Unable to start log thread: %s\n", strerror(errno));
+    return 1;
+  }
+
+  // Create pidfile, which also makes sure the state directory is there
   createPidFile();
 
+  // Live counters for anyone who wants them, we can do without
+  if ((t = telemetryOpen(sim_trace ? TELEMETRY_SIM_NAME : TELEMETRY_NAME)) == NULL) {
+    printLog(0, "Unable to create telemetry segment: %s\n", strerror(errno));
+  } else {
+    // Startup logging has been timed already, bring it along
+    t->log_hist = local_telemetry.log_hist;
+    telemetry = t;
+  }
 
-  // Set up reset handler
-  sa.sa_handler = signalHandler;
-  sa.sa_flags = SA_RESTART|SA_NODEFER;
-  sigaction(SIGHUP, &sa, NULL);
-  sigaction(SIGUSR1, &sa, NULL);
-  sigaction(SIGUSR2, &sa, NULL);
-  sigaction(SIGCONT, &sa, NULL);
+  if (historyOpen(history_file) < 0) {
+    printLog(0, "Unable to open history %s: %s\n", history_file, strerror(errno));
+  }
 
-  // Later versions die internally, no need to check result
-  wiringPiSetup();
+  // Carry on from the last checkpoint if there is one, so a restart
+  // neither loses the volume so far nor turns the pumps back on
+  for (z = 0; z < zones.count; z++) {
+    fwInit(&zones.flow[z], halNow() / NS, zones.config[z].reset_period);
+    rateInit(&zones.rate[z]);
+  }
+  if (checkpointOpen(checkpoint_file) < 0) {
+    printLog(0, "Unable to open checkpoint %s: %s\n", checkpoint_file, strerror(errno));
+  }
+  if (restoreCheckpoint()) {
+    for (z = 0; z < zones.count; z++) {
+      printLog(0, "%sRestored checkpoint: triggered=%d, counting=%d, litres=%.3f, total_clicks=%llu\n", zoneTag(z),
+        zones.triggered[z], zones.flow[z].counting, (double)zones.flow[z].session / CAL_UL, (unsigned long long)zones.total_clicks[z]);
+    }
+  }
+  for (z = 0; z < zones.count; z++) {
+    zoneSchedule(&zones, z, halRealtime() / NS);
+    setRules(z);
+  }
+  setCapture();
 
-  // Set up ISR
-  if (wiringPiISR(FLOW_METER, INT_EDGE_RISING, &handleClick) < 0) {
-    fprintf(stderr, "Unable to create flow meter interrupt: %s\n", strerror(errno));
-    return 1;
+  // And print out our config
+  printLog(0, "Starting\n");
+  historyEvent(halRealtime() / NS, 0, HIST_START, 0, 0, 0);
+  for (z = 0; z < zones.count; z++) {
+    if (zones.triggered[z]) {
+      writeState(z, "stopped\t%s", stop_msg[zones.stop_reason[z]]);
+    } else {
+      writeState(z, "started\tstartup");
+    }
   }
+  showConfig();
 
-  pinMode(RESET_BUTTON, INPUT);
-  pullUpDnControl (RESET_BUTTON, PUD_UP);
-  /*
-  if (wiringPiISR(RESET_BUTTON, INT_EDGE_FALLING, &handleReset) < 0) {
-    fprintf(stderr, "Unable to create pushbutton interrupt: %s\n", strerror(errno));
+  // Event loop plumbing, the ISR kicks wake_fd, signals come in on
+  // sig_fd and everything else that needs a look at a later time is a
+  // one-shot timer
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+   || (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+   || watchFd(epfd, wake_fd) < 0
+   || (sig_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0
+   || watchFd(epfd, sig_fd) < 0
+   || (deadline_fd = newTimer(epfd)) < 0
+   || (button_fd = newTimer(epfd)) < 0
+   || (history_fd = newTimer(epfd)) < 0
+   || (checkpoint_fd = newTimer(epfd)) < 0
+   || (publish_fd = newTimer(epfd)) < 0
+   || (schedule_fd = newTimer(epfd)) < 0
+   || (uplink_fd = newTimer(epfd)) < 0
+   || (watchdog_fd = newTimer(epfd)) < 0) {
+    fprintf(stderr, "Unable to set up event loop: %s\n", strerror(errno));
     return 1;
   }
-  */
+  applySchedule(schedule_fd);
+  if (notifyOpen(epfd, notify_path) < 0) {
+    printLog(0, "Unable to create notify socket: %s\n", strerror(errno));
+  }
+  if (controlOpen(epfd, control_path, &controlRequest) < 0) {
+    printLog(0, "Unable to create control socket: %s\n", strerror(errno));
+  }
+  if (metrics_port > 0 && metricsOpen(epfd, metrics_address, metrics_port, &renderMetrics) < 0) {
+    printLog(0, "Unable to listen for metrics on %s port %d: %s\n", metrics_address[0] ? metrics_address : "loopback", metrics_port, strerror(errno));
+  }
+  if (collector[0] && uplinkOpen(collector, site, halRealtime()) < 0) {
+    printLog(0, "Unable to send telemetry to %s: %s\n", collector, strerror(errno));
+  }
+  // Before real-time mode, the loader thread is no part of the control path
+  if (configStart(config_file, &wakeLoop) < 0) {
+    printLog(0, "Unable to start config loader: %s\n", strerror(errno));
+  }
+  // Nor is the health monitor, which has to be able to run when it isn't
+  if (healthStart(pulses, zones.count, &failSafe) < 0) {
+    printLog(0, "Unable to start health monitor: %s\n", strerror(errno));
+  }
+  // Nor is pressure sampling, which only needs to be there if it is used
+  for (z = 0; z < zones.count && zones.config[z].pressure_drop <= 0; z++)
+    ;
+  if (z < zones.count) {
+    if (pressureStart(hal->analogRead, &wakeLoop) < 0) {
+      printLog(0, "Unable to start pressure sampling: %s\n", strerror(errno));
+    } else {
+      sampling = 1;
+    }
+  }
+
+  for (z = 0; z < zones.count; z++) {
+    ringWakeAt(&pulses[z], 1);
+  }
+
+  if (realtime > 0) {
+    startRealtime();
+  }
+
+  // Set up pulse input, preferring kernel edge events if asked for
+  for (z = 0; z < zones.count; z++) {
+    c = &zones.config[z];
+    if (c->gpio_line >= 0 && gpioDevStart(gpio_chip, c->gpio_line, z, &handlePulse, &meterLost) < 0) {
+      printLog(0, "%sUnable to use gpiochip%d line %d (%s), falling back to %s\n", zoneTag(z), gpio_chip, c->gpio_line, strerror(errno), hal->name);
+      c->gpio_line = -1;
+    }
+    if (c->gpio_line < 0 && hal->pulseStart(z, c->flow_pin, &handlePulse, &pulsesDone) < 0) {
+      fprintf(stderr, "Unable to create flow meter interrupt for %s: %s\n", c->name, strerror(errno));
+      return 1;
+    }
+  }
+  // The pulse threads have their priority, now drop to ours
+  if (realtime > 0 && setPriority(realtime) < 0) {
+    printLog(0, "Warning: unable to set real-time priority %d: %s\n", realtime, strerror(errno));
+  }
 
-  // Set up output for relay and fire it up
-  pinMode(POWER_RELAY, OUTPUT);
-  // pinMode(PRESSURE_SENSOR, INPUT);
-  digitalWrite(POWER_RELAY, HIGH);
+  for (z = 0; z < zones.count; z++) {
+    c = &zones.config[z];
+    hal->pinMode(c->button_pin, HAL_INPUT);
+    hal->pullUpDn(c->button_pin, HAL_PUD_UP);
+    for (i = 0; i < nbuttons && buttons[i].pin != c->button_pin; i++)
+      ;
+    if (i == nbuttons) {
+      btnInit(&buttons[nbuttons++], c->button_pin);
+    }
+
+    // Set up output for relay and fire it up
+    hal->pinMode(c->relay_pin, HAL_OUTPUT);
+    setRelay(z, zones.triggered[z] ? HAL_LOW : HAL_HIGH);
+  }
+  // No need to poll buttons that tell us when they move
+  for (i = 0; i < nbuttons; i++) {
+    if (hal->edgeStart(buttons[i].pin, &buttonEdge) < 0) {
+      printLog(0, "Unable to watch button pin %d, polling buttons instead\n", buttons[i].pin);
+      button_edges = 0;
+    }
+  }
+  saved = halNow() / NS;
+  // Bit per zone, starting out different so the first pass saves
+  saved_counting = ~0u;
+  saved_triggered = 0;
+  for (z = 0; z < zones.count; z++) {
+    saved_triggered |= (unsigned int)zones.triggered[z] << z;
+  }
 
+  // Watchdogs are only ever pinged from here on in, by the loop
+  ping_every = watchdogSystemd();
+  if (watchdog_device[0]) {
+    if ((when = watchdogDevice(watchdog_device)) < 0) {
+      printLog(0, "Unable to open watchdog %s: %s\n", watchdog_device, strerror(errno));
+    } else if (!ping_every || when < ping_every) {
+      ping_every = when;
+    }
+  }
+  if (ping_every) {
+    armTimerNs(watchdog_fd, ping_every);
+  }
+  snprintf(buf, sizeof(buf), "READY=1\nMAINPID=%d", (int)getpid());
+  watchdogNotify(buf);
 
   while (1) {
-    now = time(0);
+    /*
+     * Nothing here runs until there is something to look at: the ISR
+     * reaching wake_clicks, one of the timers expiring or a signal
+     * turning up on sig_fd.  The health monitor times every pass.
+     */
+    healthIdle();
+    nev = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    healthPass(realNow());
+    if (nev < 0 && errno != EINTR) {
+      printLog(0, "epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+    woke = realNow();
+    done = atomic_load(&finished);
+    // A pass that was only for a scrape changes nothing it would show
+    scraped = 0;
+    for (i = 0; i < nev; i++) {
+      fd = events[i].data.fd;
+      if (metricsEvent(fd, events[i].events)) {
+        scraped++;
+        continue;
+      }
+      if (notifyEvent(fd) || controlEvent(fd, events[i].events)) {
+        continue;
+      }
+      if (fd == sig_fd) {
+        readSignals(fd);
+        continue;
+      }
+      // Timers and the eventfd all hand back a 64 bit count, all
+      // we need to know is that something wants a look
+      read(fd, &expiries, sizeof(expiries));
+      if (fd == schedule_fd) {
+        applySchedule(schedule_fd);
+      } else if (fd == watchdog_fd) {
+        watchdogPing();
+        armTimerNs(watchdog_fd, ping_every);
+      }
+    }
+    now = halNow() / NS;
     /*
      * When we first fire up - counting is false, also after a rest
      * or after a period of inactivity, we set counting to false.
      * If we are counting (flow is happening) we need to check against
-     * time of day and 
+     * the limits for the time of day, which schedule_fd has already
+     * put in force.
      */
-    // pressure = analogRead(PRESSURE_SENSOR);
-    // printLog(3, "Pressure returns %d\n", pressure);
-    seconds = now - last_click_time;  
-    new_clicks = clicks - last_click_count;
-    last_click_count = clicks;
-    total_clicks += new_clicks;
-    total_litres = total_clicks / clicks_per_litre;
-    litres = clicks / clicks_per_litre;
-    printLog(3, "clicks: %d, litres: %d, triggered=%d, counting=%d, new=%d\n", clicks, litres, triggered, counting, new_clicks);
-    if (triggered && digitalRead(RESET_BUTTON) == 0) {
-      reset = 1;
-    }
-    if (reset) {
-      triggered = 0;
-      clicks = 0;
-      counting = 0;
-      last_click_count = 0;
-      new_clicks = 0;
-      last_click_time = now;
-      first_click_time = now;
-      printLog(2, "Turning pump on after reset by %s\n", reset_msg[reset]);
-      writeState("started\t%s\n", reset_msg[reset]);
-      reset = 0;
-      digitalWrite(POWER_RELAY, HIGH);
-    }
-    if (!triggered) {
-      if (counting) {
-	if (! new_clicks ) {
-	  if (seconds > reset_period) {
-	    counting = 0;
-	    clicks = 0;
-	    last_click_count = 0;
-	  }
-	} else {
-	  last_click_time = now;
-	  seconds_from_first = last_click_time - first_click_time;
-          stop_reason = 0;
-          if (litres > max_litres) {
-            stop_reason = 1;
-          }
-          if (seconds_from_first > time_limit) {
-            stop_reason = 2;
+    // Commands only ever take effect here, whatever brought them in
+    todo = commands;
+    commands = 0;
+    if (todo & CMD_RELOAD) {
+      // The loader thread does the reading
+      if (!log_ring) {
+        rollLog();
+      }
+      configReload();
+    }
+    // A new config only ever goes in here, between passes over the zones
+    if ((reload = configTake()) != NULL) {
+      if (reload->error[0] || useConfig(reload, 0) < 0) {
+        printLog(0, "Config not reloaded: %s\n", reload->error);
+      } else {
+        // Schedule entries first, for the rules to be made from
+        applySchedule(schedule_fd);
+        for (z = 0; z < zones.count; z++) {
+          setRules(z);
+          if (zones.config[z].pressure_drop > 0 && !sampling) {
+            printLog(0, "%sPressure is only read if a zone has pressure_drop at startup, restart to use it\n", zoneTag(z));
           }
-          if (stop_reason) {
-	    triggered = 1;
-	    printLog(2,"Turning pump off (%s) litres:%d, seconds:%d\n", stop_msg[stop_reason], litres, seconds_from_first);
-            writeState("stopped\t%s\n", stop_msg[stop_reason]);
-	    showStats(2);
-	    digitalWrite(POWER_RELAY, LOW);
-	  }
-	}
-      } else { // Not counting yet
-	if ( new_clicks) {
-	  counting = 1;
-	  first_click_time = now;
-	  last_click_time = now;
-	}
+        }
+        setCapture();
+        printLog(1, "Config reloaded\n");
+      }
+      free(reload);
+    }
+    // The pumps are already off if the loop was stuck, stop the zones
+    // properly now that it is going again
+    if ((stalled = healthStalled()) != 0) {
+      printLog(0, "Loop was stuck for more than %d ms, pumps turned off\n", max_lag);
+    }
+    next = 0;
+    counting = triggered = 0;
+    button_next = checkButtons(halNow());
+    for (z = 0; z < zones.count; z++) {
+      // Stopping wins if both come in together
+      reset_by = RESET_NONE;
+      if (stop_queued[z]) {
+        noteTrip(z, stop_queued[z], halNow());
+      } else {
+        reset_by = reset_queued[z];
+      }
+      stop_queued[z] = STOP_NONE;
+      reset_queued[z] = RESET_NONE;
+      if (atomic_load(&meter_lost[z])) {
+        noteTrip(z, STOP_METER, halNow());
+        reset_by = RESET_NONE;
+      }
+      if ((fell = pressureTripped(z)) != 0) {
+        noteTrip(z, STOP_PRESSURE, fell);
+      }
+      if (stalled) {
+        noteTrip(z, STOP_STALLED, stalled);
+      }
+      serviceZone(z, now, reset_by);
+      when = scheduleZone(z, now);
+      if (when && (!next || when < next)) {
+        next = when;
+      }
+      counting |= (unsigned int)zones.flow[z].counting << z;
+      triggered |= (unsigned int)zones.triggered[z] << z;
+    }
+
+    // One timer for whichever zone needs looking at soonest.  With
+    // nothing flowing and the buttons able to wake us that is none at
+    // all, so an idle daemon sleeps until flow, a signal or a request
+    armTimer(deadline_fd, next ? next - now : 0, 0);
+    if (button_next) {
+      // Settling or being held down
+      armTimerNs(button_fd, button_next - halNow());
+      button_armed = 1;
+    } else if (!button_edges && (triggered || long_press)) {
+      // Polled buttons only matter while they can do something
+      armTimer(button_fd, 1, 0);
+      button_armed = 1;
+    } else if (button_armed) {
+      armTimer(button_fd, 0, 0);
+      button_armed = 0;
+    }
+    // Keep a checkpoint no more than CHECKPOINT_INTERVAL old while
+    // there is flow, and whenever we change state.  The capture goes
+    // out with it, so the pulses behind a cutoff are on disk with it
+    if (counting != saved_counting || triggered != saved_triggered
+     || (counting && now - saved >= CHECKPOINT_INTERVAL)) {
+      saveCheckpoint();
+      captureSync();
+      checkCapture();
+      saved = now;
+      saved_triggered = triggered;
+      saved_counting = counting;
+      if ((counting != 0) != checkpoint_armed) {
+        checkpoint_armed = counting != 0;
+        armTimer(checkpoint_fd, checkpoint_armed ? CHECKPOINT_INTERVAL : 0, 1);
       }
     }
-    delay(1000);
+
+    // Come back to write out the minute's usage once it is over
+    armTimer(history_fd, historyFlush(halRealtime() / NS), 0);
+    // Pulses come in without waking us until a rule wants a look, so
+    // while there is flow come back anyway to keep what we show current
+    if ((counting != 0) != publish_armed) {
+      publish_armed = counting != 0;
+      armTimer(publish_fd, publish_armed ? TELEMETRY_INTERVAL : 0, 1);
+    }
+    publishTelemetry(realNow() - woke);
+    // The collector hears of changes straight away, and of steady flow
+    // every collector_interval
+    if ((uplink_next = uplinkUpdate(telemetry, halNow())) != uplink_armed) {
+      armTimerNs(uplink_fd, uplink_next - halNow());
+      uplink_armed = uplink_next;
+    }
+    if (scraped < nev) {
+      metricsChanged();
+    }
+    if (todo & CMD_STATS) {
+      showStats(0);
+    }
+    if (done) {
+      printLog(0, "Pulse trace finished\n");
+      showStats(0);
+      break;
+    }
+    if (todo & CMD_QUIT) {
+      printLog(0, "Shutting down\n");
+      break;
+    }
   }
 
-  writeState("stopped\tshutdown\n");
+  total_clicks = 0;
+  for (z = 0; z < zones.count; z++) {
+    writeState(z, "stopped\tshutdown");
+    historyEvent(halRealtime() / NS, z, HIST_SHUTDOWN, 0, zones.total_clicks[z], zones.total_volume[z]);
+    total_clicks += zones.total_clicks[z];
+  }
+  historyClose();
+  captureClose();
+  watchdogClose();
+  if (bench_file) {
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    benchSample(BENCH_LOOP_CPU, (int64_t)cpu.tv_sec * NS + cpu.tv_nsec);
+    benchSample(BENCH_PULSES, total_clicks);
+    fclose(bench_file);
+  }
+  logStop();
 
   return 0;
 }
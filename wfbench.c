@@ -0,0 +1,274 @@
+/**
+ * Cutoff latency and loop cost across a spread of flow rates.
+ *
+ * Each rate gets its own run of waterfuse-sim with a trace that flows
+ * until the volume limit trips, presses the button and goes again, so
+ * one run gives a cutoff per cycle.  The daemon writes its samples out
+ * with -B (see bench.h) and we report percentiles of those along with
+ * CPU used per million pulses, both by the main loop alone and by the
+ * whole process including the simulator's pulse thread.
+ *
+ * The simulated clock is sped up for the slow rates so that every run
+ * sees pulses at roughly the same real rate, -p, and nothing takes too
+ * long.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "bench.h"
+
+#define CLICKS_PER_LITRE 450
+#define MAX_RATES 16
+#define NS 1000000000LL
+
+struct run {
+  double rate;
+  int speed;
+  int64_t pulses;
+  int64_t loop_cpu;
+  int64_t cpu;
+  int64_t * delivery;
+  int64_t * cutoff;
+  size_t ndelivery;
+  size_t ncutoff;
+};
+
+static int
+compare(const void * a, const void * b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Nearest rank percentile of a sorted array.
+ */
+static int64_t
+percentile(const int64_t * v, size_t n, int p) {
+  if (n == 0) {
+    return 0;
+  }
+  return v[(n - 1) * p / 100];
+}
+
+static int
+writeTrace(const char * path, double rate, int litres, int cycles) {
+  FILE * f;
+
+  if ((f = fopen(path, "w")) == NULL) {
+    return -1;
+  }
+  // Run on just past the trip, then reset and go again
+  fprintf(f, "clicks_per_litre %d\n", CLICKS_PER_LITRE);
+  fprintf(f, "flow %.3f %.3f\n", rate, (litres + 1) * 60.0 / rate + 1);
+  fprintf(f, "idle 1\n");
+  fprintf(f, "press 2\n");
+  fprintf(f, "idle 1\n");
+  if (cycles > 1) {
+    fprintf(f, "repeat %d\n", cycles - 1);
+  }
+  return fclose(f);
+}
+
+static int
+readSamples(const char * path, struct run * r) {
+  struct bench_sample s;
+  FILE * f;
+  size_t max = 0;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  while (fread(&s, sizeof(s), 1, f) == 1) {
+    switch (s.kind) {
+      case BENCH_DELIVERY:
+        if (r->ndelivery == max) {
+          max = max ? max * 2 : 65536;
+          if ((r->delivery = realloc(r->delivery, max * sizeof(*r->delivery))) == NULL) {
+            fclose(f);
+            return -1;
+          }
+        }
+        r->delivery[r->ndelivery++] = s.value;
+	break;
+      case BENCH_CUTOFF:
+        if ((r->cutoff = realloc(r->cutoff, (r->ncutoff + 1) * sizeof(*r->cutoff))) == NULL) {
+          fclose(f);
+          return -1;
+        }
+        r->cutoff[r->ncutoff++] = s.value;
+	break;
+      case BENCH_LOOP_CPU:
+        r->loop_cpu = s.value;
+	break;
+      case BENCH_PULSES:
+        r->pulses = s.value;
+	break;
+    }
+  }
+  fclose(f);
+  qsort(r->delivery, r->ndelivery, sizeof(*r->delivery), compare);
+  qsort(r->cutoff, r->ncutoff, sizeof(*r->cutoff), compare);
+  return 0;
+}
+
+static void
+removeDir(const char * dir) {
+  char path[512];
+  struct dirent * ent;
+  DIR * d;
+
+  if ((d = opendir(dir)) != NULL) {
+    while ((ent = readdir(d)) != NULL) {
+      if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        unlink(path);
+      }
+    }
+    closedir(d);
+  }
+  rmdir(dir);
+}
+
+/**
+ * One run of the simulator at the given rate, returns -1 if it didn't
+ * go to plan.
+ */
+static int
+runRate(const char * sim, struct run * r, int litres, int cycles, int target) {
+  char dir[] = "/tmp/wfbench.XXXXXX";
+  char trace[64], samples[64], speed[16], limit[16], cpl[16];
+  struct rusage ru;
+  pid_t pid;
+  int status, fd, ok = -1;
+
+  if (mkdtemp(dir) == NULL) {
+    return -1;
+  }
+  snprintf(trace, sizeof(trace), "%s/trace", dir);
+  snprintf(samples, sizeof(samples), "%s/samples", dir);
+  r->speed = target / (r->rate * CLICKS_PER_LITRE / 60);
+  if (r->speed < 1) {
+    r->speed = 1;
+  }
+  snprintf(speed, sizeof(speed), "%d", r->speed);
+  snprintf(limit, sizeof(limit), "%d", litres);
+  snprintf(cpl, sizeof(cpl), "%d", CLICKS_PER_LITRE);
+  if (writeTrace(trace, r->rate, litres, cycles) < 0) {
+    fprintf(stderr, "Unable to write %s: %s\n", trace, strerror(errno));
+    removeDir(dir);
+    return -1;
+  }
+
+  if ((pid = fork()) < 0) {
+    removeDir(dir);
+    return -1;
+  }
+  if (pid == 0) {
+    // Its log is of no interest, only the samples
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+      close(fd);
+    }
+    // The time limit is pushed well out of the way of the volume one
+    execl(sim, sim, "-d", "-D", dir, "-S", trace, "-x", speed, "-B", samples,
+      "-l", limit, "-c", cpl, "-t", "100000", (char *)NULL);
+    _exit(127);
+  }
+  if (wait4(pid, &status, 0, &ru) < 0) {
+    removeDir(dir);
+    return -1;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s failed at %.0f L/min (status %d)\n", sim, r->rate, status);
+  } else if (readSamples(samples, r) < 0) {
+    fprintf(stderr, "Unable to read %s: %s\n", samples, strerror(errno));
+  } else {
+    r->cpu = ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NS
+      + ((int64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+    ok = 0;
+  }
+  removeDir(dir);
+  return ok;
+}
+
+int
+main(int argc, char **argv) {
+  const char * sim = "./waterfuse-sim";
+  char rates[] = "1,2,5,10,20,50,100";
+  char * list = rates, * word;
+  struct run runs[MAX_RATES], * r;
+  int litres = 5, cycles = 20, target = 5000;
+  int opt, i, n = 0, failed = 0;
+  double per;
+
+  while ((opt = getopt(argc, argv, "s:r:l:n:p:")) != -1) {
+    switch (opt) {
+      case 's':
+        sim = optarg;
+	break;
+      case 'r':
+        list = optarg;
+	break;
+      case 'l':
+        litres = atoi(optarg);
+	break;
+      case 'n':
+        cycles = atoi(optarg);
+	break;
+      case 'p':
+        target = atoi(optarg);
+	break;
+      default:
+        fprintf(stderr, "Usage: %s [-s sim] [-r rate,rate,...] [-l litres] [-n cycles] [-p pulses/sec]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (litres < 1 || cycles < 1 || target < 1) {
+    fprintf(stderr, "litres, cycles and pulses/sec all need to be at least 1\n");
+    return 1;
+  }
+
+  memset(runs, 0, sizeof(runs));
+  for (word = strtok(list, ","); word && n < MAX_RATES; word = strtok(NULL, ",")) {
+    if ((runs[n].rate = atof(word)) > 0) {
+      n++;
+    }
+  }
+
+  printf("%7s %6s %8s %7s %27s %27s %19s\n", "", "", "", "",
+    "cutoff (us)", "delivery (ms)", "cpu/Mpulse (ms)");
+  printf("%7s %6s %8s %7s %8s %8s %9s %8s %8s %9s %9s %9s\n", "L/min", "speed", "pulses", "cutoffs",
+    "p50", "p99", "max", "p50", "p99", "max", "loop", "total");
+  for (i = 0; i < n; i++) {
+    r = &runs[i];
+    if (runRate(sim, r, litres, cycles, target) < 0) {
+      failed = 1;
+      continue;
+    }
+    // ns per pulse is ms per million
+    per = r->pulses > 0 ? 1.0 / r->pulses : 0;
+    printf("%7.1f %6d %8lld %7zu %8.1f %8.1f %9.1f %8.2f %8.2f %9.2f %9.1f %9.1f\n",
+      r->rate, r->speed, (long long)r->pulses, r->ncutoff,
+      percentile(r->cutoff, r->ncutoff, 50) / 1e3,
+      percentile(r->cutoff, r->ncutoff, 99) / 1e3,
+      r->ncutoff ? r->cutoff[r->ncutoff - 1] / 1e3 : 0,
+      percentile(r->delivery, r->ndelivery, 50) / 1e6,
+      percentile(r->delivery, r->ndelivery, 99) / 1e6,
+      r->ndelivery ? r->delivery[r->ndelivery - 1] / 1e6 : 0,
+      r->loop_cpu * per, r->cpu * per);
+    fflush(stdout);
+    free(r->delivery);
+    free(r->cutoff);
+  }
+  return failed;
+}
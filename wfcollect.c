@@ -0,0 +1,232 @@
+/**
+ * Collect UDP telemetry from waterfuse sites, see uplink.h.
+ *
+ * Listens on UPLINK_PORT, or -p, and keeps the latest packet from each
+ * site that sends to it.  Cutoffs, resets and alarms are printed as the
+ * packets saying so come in, with -v zones starting and stopping too,
+ * and every -i seconds there is a table of every zone of every site
+ * with the fleet's totals under it.  Lost packets are counted from the
+ * gaps in a site's sequence numbers, and a site that starts again from
+ * a new boot time has been restarted.  One not heard from in -s
+ * seconds is shown as silent, and one whose loop has got stuck is
+ * shown as stalled until it is going again.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "uplink.h"
+
+#define SITES 64 // Sites we keep track of
+
+struct site {
+  struct uplink_packet last;
+  time_t heard;
+  uint64_t packets;
+  uint64_t lost;
+  unsigned int restarts;
+};
+
+struct site sites[SITES];
+int nsites = 0;
+int changes = 0; // Print starts and stops as well
+
+void
+printWhen(time_t t, const char * site, const char * zone) {
+  char buf[32];
+  struct tm parts;
+
+  localtime_r(&t, &parts);
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &parts);
+  printf("%s %-*s %-*s ", buf, UPLINK_SITE - 1, site, ZONE_NAME - 1, zone);
+}
+
+const char *
+stateName(const struct uplink_zone * uz) {
+  static char buf[24];
+
+  if (uz->triggered) {
+    snprintf(buf, sizeof(buf), "stopped %s", uz->stop_reason < STOP_REASONS ? stop_msg[uz->stop_reason] : "?");
+    return buf;
+  }
+  if (uz->alarmed) {
+    return "leak";
+  }
+  return uz->counting ? "flowing" : "idle";
+}
+
+/**
+ * Print what has happened to a zone between two packets.
+ */
+void
+zoneEvents(time_t t, const char * site, const struct uplink_zone * was, const struct uplink_zone * uz) {
+  if (uz->triggered && !was->triggered) {
+    printWhen(t, site, uz->name);
+    printf("cutoff   %-8s %8.1f L\n", uz->stop_reason < STOP_REASONS ? stop_msg[uz->stop_reason] : "?", (double)uz->volume / 1000000);
+  } else if (!uz->triggered && was->triggered) {
+    printWhen(t, site, uz->name);
+    printf("reset    %s\n", uz->reset_reason < RESET_REASONS ? reset_msg[uz->reset_reason] : "?");
+  }
+  if (uz->alarmed != was->alarmed) {
+    printWhen(t, site, uz->name);
+    printf("alarm    %s\n", uz->alarmed ? "leak" : "over");
+  }
+  if (changes && uz->counting != was->counting) {
+    printWhen(t, site, uz->name);
+    printf("%s\n", uz->counting ? "started" : "stopped");
+  }
+  // Ones that happened and were over by the time a packet got through
+  if (uz->changes - was->changes > 1) {
+    printWhen(t, site, uz->name);
+    printf("missed   %u changes\n", uz->changes - was->changes - 1);
+  }
+}
+
+void
+takePacket(struct uplink_packet * p, const struct sockaddr_in6 * from) {
+  struct site * s;
+  char addr[INET6_ADDRSTRLEN];
+  time_t t = time(NULL);
+  unsigned int z;
+  int i;
+
+  inet_ntop(AF_INET6, &from->sin6_addr, addr, sizeof(addr));
+  for (i = 0; i < nsites && strcmp(sites[i].last.site, p->site) != 0; i++)
+    ;
+  s = &sites[i];
+  if (i == nsites) {
+    if (nsites == SITES) {
+      return;
+    }
+    nsites++;
+    memset(s, 0, sizeof(*s));
+    s->last = *p;
+    printWhen(t, p->site, "");
+    printf("heard from %s\n", addr);
+  } else if (p->boot != s->last.boot) {
+    s->restarts++;
+    printWhen(t, p->site, "");
+    printf("restarted, from %s\n", addr);
+    s->last = *p;
+  } else if (p->seq <= s->last.seq) {
+    // Behind one we already have
+    return;
+  } else {
+    s->lost += p->seq - s->last.seq - 1;
+    if (p->stalls > s->last.stalls) {
+      printWhen(t, p->site, "");
+      printf("stalled  loop stuck for %.1f s, pumps off\n", p->lag_max / 1e6);
+    }
+    for (z = 0; z < p->zones && z < s->last.zones; z++) {
+      zoneEvents(t, p->site, &s->last.zone[z], &p->zone[z]);
+    }
+    s->last = *p;
+  }
+  s->packets++;
+  s->heard = t;
+  fflush(stdout);
+}
+
+void
+printFleet(int silent_after) {
+  const struct uplink_zone * uz;
+  struct site * s;
+  time_t t = time(NULL);
+  uint64_t lost = 0, packets = 0;
+  double rate = 0, litres = 0;
+  int i, silent = 0, flowing = 0, stopped = 0;
+  unsigned int z, restarts = 0, stalls = 0;
+
+  printf("\n%-*s %-*s %6s %-16s %8s %10s %12s %7s\n", UPLINK_SITE - 1, "site", ZONE_NAME - 1, "zone",
+    "heard", "state", "L/min", "session L", "total L", "cutoffs");
+  for (i = 0; i < nsites; i++) {
+    s = &sites[i];
+    if (t - s->heard > silent_after) {
+      silent++;
+    }
+    for (z = 0; z < s->last.zones; z++) {
+      uz = &s->last.zone[z];
+      printf("%-*s %-*s %5llds %-16s %8.2f %10.1f %12.1f %7u\n", UPLINK_SITE - 1, z ? "" : s->last.site, ZONE_NAME - 1, uz->name,
+        (long long)(t - s->heard), t - s->heard > silent_after ? "silent"
+        : s->last.flags & UPLINK_STALLED ? "stalled" : stateName(uz), uz->flow_rate / 1000.0,
+        (double)uz->volume / 1000000, (double)uz->total_volume / 1000000, uz->cutoffs);
+      flowing += uz->counting && !uz->triggered;
+      stopped += uz->triggered;
+      rate += uz->flow_rate / 1000.0;
+      litres += (double)uz->total_volume / 1000000;
+    }
+    lost += s->lost;
+    packets += s->packets;
+    restarts += s->restarts;
+    stalls += s->last.stalls;
+  }
+  printf("%d sites, %d silent, %d zones flowing, %d stopped, %.2f L/min, %.1f L, %llu packets, %llu lost, %u restarts, %u stalls\n\n",
+    nsites, silent, flowing, stopped, rate, litres, (unsigned long long)packets, (unsigned long long)lost, restarts, stalls);
+  fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+  struct sockaddr_in6 addr, from;
+  struct uplink_packet p;
+  struct pollfd pfd;
+  socklen_t from_len;
+  time_t next;
+  int port = UPLINK_PORT, every = 30, silent_after = 3 * UPLINK_KEEPALIVE;
+  int opt, fd, len, off = 0;
+
+  while ((opt = getopt(argc, argv, "p:i:s:v")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+	break;
+      case 'i':
+        every = atoi(optarg);
+	break;
+      case 's':
+        silent_after = atoi(optarg);
+	break;
+      case 'v':
+        changes = 1;
+	break;
+      default:
+        fprintf(stderr, "Usage: %s [-p port] [-i seconds] [-s seconds] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  // IPv4 senders turn up as mapped addresses
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if ((fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0
+   || setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0
+   || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Unable to listen on port %d: %s\n", port, strerror(errno));
+    return 1;
+  }
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  next = time(NULL) + every;
+  while (1) {
+    if (poll(&pfd, 1, every > 0 ? (next > time(NULL) ? (next - time(NULL)) * 1000 : 0) : -1) > 0) {
+      from_len = sizeof(from);
+      if ((len = recvfrom(fd, &p, sizeof(p), MSG_TRUNC, (struct sockaddr *)&from, &from_len)) > 0
+       && uplinkDecode(&p, len) == 0) {
+        takePacket(&p, &from);
+      }
+    }
+    if (every > 0 && time(NULL) >= next) {
+      printFleet(silent_after);
+      next = time(NULL) + every;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * Talk to a running waterfuse over its control socket.
+ *
+ *   wfctl [-D dir] stats|reset|stop|config|subscribe [zone]
+ *
+ * Prints the reply, and with subscribe every state change after it
+ * until interrupted.  -D is the daemon's run directory, as it was
+ * given with -D.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+
+#define RUN_DIR "/var/run/waterfuse"
+
+const char * command_name[] = { "", "stats", "reset", "stop", "config", "subscribe" };
+
+static int
+readFull(int fd, void * buf, size_t len) {
+  ssize_t n;
+  size_t got = 0;
+
+  while (got < len) {
+    if ((n = read(fd, (char *)buf + got, len - got)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    got += n;
+  }
+  return 0;
+}
+
+/**
+ * Read one frame, returning the payload length or -1.
+ */
+static int
+readFrame(int fd, struct control_header * h, char * buf) {
+  int len;
+
+  if (readFull(fd, h, sizeof(*h)) < 0) {
+    return -1;
+  }
+  len = ntohs(h->len);
+  if (len > CONTROL_MAX || readFull(fd, buf, len) < 0) {
+    return -1;
+  }
+  return len;
+}
+
+int
+main(int argc, char **argv) {
+  static char buf[CONTROL_MAX];
+  struct sockaddr_un addr;
+  struct control_header h;
+  const char * dir = RUN_DIR;
+  const char * zone = "";
+  int opt, fd, type, len;
+
+  while ((opt = getopt(argc, argv, "D:")) != -1) {
+    switch (opt) {
+      case 'D':
+        dir = optarg;
+	break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+  for (type = CTL_STATS; type <= CTL_SUBSCRIBE; type++) {
+    if (optind < argc && strcmp(argv[optind], command_name[type]) == 0) {
+      break;
+    }
+  }
+  if (optind >= argc || type > CTL_SUBSCRIBE || argc - optind > 2) {
+    fprintf(stderr, "Usage: %s [-D dir] stats|reset|stop|config|subscribe [zone]\n", argv[0]);
+    return 1;
+  }
+  if (optind + 1 < argc) {
+    zone = argv[optind + 1];
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/waterfuse.ctl", dir);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+   || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Unable to connect to %s: %s\n", addr.sun_path, strerror(errno));
+    return 1;
+  }
+  h.type = type;
+  h.status = 0;
+  h.len = htons(strlen(zone));
+  if (write(fd, &h, sizeof(h)) != sizeof(h) || write(fd, zone, strlen(zone)) != (ssize_t)strlen(zone)) {
+    fprintf(stderr, "Unable to send request: %s\n", strerror(errno));
+    return 1;
+  }
+  if ((len = readFrame(fd, &h, buf)) < 0) {
+    fprintf(stderr, "No reply from waterfuse\n");
+    return 1;
+  }
+  if (h.status) {
+    fprintf(stderr, "%s%s%s: %s\n", command_name[type], *zone ? " " : "", zone, strerror(h.status));
+    return 1;
+  }
+  fwrite(buf, 1, len, stdout);
+  if (type == CTL_SUBSCRIBE) {
+    fflush(stdout);
+    while ((len = readFrame(fd, &h, buf)) >= 0) {
+      fwrite(buf, 1, len, stdout);
+      fflush(stdout);
+    }
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,150 @@
+/**
+ * Answer questions about water use from the waterfuse history file.
+ *
+ * By default prints litres used per day.  -m gives per-minute usage,
+ * -e lists cutoffs, resets and restarts, -n limits it all to the
+ * last so many days and -z to one zone.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+const char * type_msg[7] = { "", "usage", "cutoff", "reset", "start", "shutdown", "alarm" };
+const char * alarm_msg[2] = { "", "leak" };
+
+const char *
+reasonName(const struct history_record * rec) {
+  if (rec->type == HIST_CUTOFF && rec->reason < STOP_REASONS) {
+    return stop_msg[rec->reason];
+  }
+  if (rec->type == HIST_RESET && rec->reason < RESET_REASONS) {
+    return reset_msg[rec->reason];
+  }
+  if (rec->type == HIST_ALARM && rec->reason < 2) {
+    return alarm_msg[rec->reason];
+  }
+  return "";
+}
+
+void
+printDay(time_t day, uint64_t ml, unsigned int cutoffs) {
+  char buf[32];
+  struct tm parts;
+
+  localtime_r(&day, &parts);
+  strftime(buf, sizeof(buf), "%Y-%m-%d", &parts);
+  printf("%s %10.1f L  %u cutoffs\n", buf, ml / 1000.0, cutoffs);
+}
+
+int
+main(int argc, char **argv) {
+  const char * path = HISTORY_FILE;
+  const struct history_record * rec;
+  const struct history_header * hdr;
+  struct stat st;
+  struct tm parts;
+  char buf[32];
+  time_t since = 0, day = 0, t;
+  uint64_t i, count, day_ml = 0, total_ml = 0;
+  unsigned int day_cutoffs = 0;
+  int events = 0, minutes = 0, zone = -1;
+  int opt, fd;
+  void * map;
+
+  while ((opt = getopt(argc, argv, "f:n:emz:")) != -1) {
+    switch (opt) {
+      case 'f':
+        path = optarg;
+	break;
+      case 'n':
+        since = time(0) - atoi(optarg) * 86400;
+	break;
+      case 'e':
+        events = 1;
+	break;
+      case 'm':
+        minutes = 1;
+	break;
+      case 'z':
+        zone = atoi(optarg);
+	break;
+      default:
+        fprintf(stderr, "Usage: %s [-f file] [-n days] [-e] [-m] [-z zone]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (st.st_size < (off_t)sizeof(*rec)) {
+    fprintf(stderr, "%s is not a history file\n", path);
+    return 1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  hdr = map;
+  if (hdr->magic != HISTORY_MAGIC || hdr->record_size != sizeof(*rec)) {
+    fprintf(stderr, "%s is not a history file\n", path);
+    return 1;
+  }
+  rec = map;
+  count = st.st_size / sizeof(*rec);
+
+  for (i = 1; i < count && rec[i].type != HIST_NONE; i++) {
+    if (rec[i].time < since) {
+      continue;
+    }
+    // A start is for every zone
+    if (zone >= 0 && rec[i].zone != zone && rec[i].type != HIST_START) {
+      continue;
+    }
+    t = rec[i].time;
+    if (events || minutes) {
+      if ((events && rec[i].type != HIST_USAGE) || (minutes && rec[i].type == HIST_USAGE)) {
+        localtime_r(&t, &parts);
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &parts);
+        printf("%s %-8s %-7s %2u %8.1f L\n", buf, type_msg[rec[i].type < 7 ? rec[i].type : 0],
+          reasonName(&rec[i]), rec[i].zone, rec[i].ml / 1000.0);
+      }
+      continue;
+    }
+    // Daily totals, breaking on local midnight
+    localtime_r(&t, &parts);
+    parts.tm_hour = parts.tm_min = parts.tm_sec = 0;
+    parts.tm_isdst = -1;
+    t = mktime(&parts);
+    if (t != day) {
+      if (day) {
+        printDay(day, day_ml, day_cutoffs);
+      }
+      day = t;
+      day_ml = 0;
+      day_cutoffs = 0;
+    }
+    if (rec[i].type == HIST_USAGE) {
+      day_ml += rec[i].ml;
+      total_ml += rec[i].ml;
+    } else if (rec[i].type == HIST_CUTOFF) {
+      day_cutoffs++;
+    }
+  }
+  if (day) {
+    printDay(day, day_ml, day_cutoffs);
+    printf("total      %10.1f L\n", total_ml / 1000.0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * Print the waterfuse ring log as text.
+ *
+ *   wflog [-f file] [-n lines] [-F]
+ *
+ * Dates are only put on here, the daemon just keeps the time.  -n
+ * limits it to the last so many lines and -F carries on printing new
+ * ones as they come in, like tail -f.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logring.h"
+
+#define LINE_MAX_TEXT 4096
+
+/**
+ * Print the record at pos, returning where the next one starts.  If
+ * the writer has dropped it meanwhile we skip on to the oldest left.
+ */
+static uint64_t
+printRecord(const struct logring_header * h, uint64_t pos) {
+  static char text[LINE_MAX_TEXT];
+  static time_t last = -1;
+  static char date[32];
+  struct logring_record rec;
+  struct tm parts;
+  uint64_t tail;
+  size_t len;
+
+  logRingCopy(h, pos, &rec, sizeof(rec));
+  len = rec.len < sizeof(text) ? rec.len : sizeof(text);
+  logRingCopy(h, pos + sizeof(rec), text, len);
+  // The copies are done before tail is looked at again
+  atomic_thread_fence(memory_order_acquire);
+  tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+  if (tail > pos) {
+    fprintf(stderr, "(%llu bytes of log overwritten while reading)\n", (unsigned long long)(tail - pos));
+    return tail;
+  }
+  if (rec.stamp != last) {
+    last = rec.stamp;
+    localtime_r(&last, &parts);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S ", &parts);
+  }
+  fputs(date, stdout);
+  fwrite(text, 1, len, stdout);
+  return pos + LOGRING_ALIGN(sizeof(rec) + rec.len);
+}
+
+int
+main(int argc, char **argv) {
+  const char * path = LOGRING_FILE;
+  const struct logring_header * h;
+  struct logring_record rec;
+  struct stat st;
+  uint64_t pos, head, count, skip;
+  int lines = -1, follow = 0;
+  int opt, fd;
+  void * map;
+
+  while ((opt = getopt(argc, argv, "f:n:F")) != -1) {
+    switch (opt) {
+      case 'f':
+        path = optarg;
+	break;
+      case 'n':
+        lines = atoi(optarg);
+	break;
+      case 'F':
+        follow = 1;
+	break;
+      default:
+        fprintf(stderr, "Usage: %s [-f file] [-n lines] [-F]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (st.st_size <= (off_t)sizeof(*h)) {
+    fprintf(stderr, "%s is not a ring log\n", path);
+    return 1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  h = map;
+  if (h->magic != LOGRING_MAGIC || h->version != LOGRING_VERSION
+   || h->size != (uint64_t)st.st_size - sizeof(*h)) {
+    fprintf(stderr, "%s is not a ring log\n", path);
+    return 1;
+  }
+
+  pos = atomic_load_explicit(&h->tail, memory_order_acquire);
+  head = atomic_load_explicit(&h->head, memory_order_acquire);
+  if (lines >= 0) {
+    // Count them first, then skip all but the last few
+    for (count = 0, skip = pos; skip < head; count++) {
+      logRingCopy(h, skip, &rec, sizeof(rec));
+      skip += LOGRING_ALIGN(sizeof(rec) + rec.len);
+    }
+    for (; count > (uint64_t)lines && pos < head; count--) {
+      logRingCopy(h, pos, &rec, sizeof(rec));
+      pos += LOGRING_ALIGN(sizeof(rec) + rec.len);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&h->tail, memory_order_relaxed) > pos) {
+      pos = atomic_load_explicit(&h->tail, memory_order_relaxed);
+    }
+  }
+  while (1) {
+    head = atomic_load_explicit(&h->head, memory_order_acquire);
+    if (head < pos) {
+      // Started afresh under us
+      pos = atomic_load_explicit(&h->tail, memory_order_acquire);
+    }
+    while (pos < head) {
+      pos = printRecord(h, pos);
+    }
+    if (!follow) {
+      break;
+    }
+    fflush(stdout);
+    usleep(250000);
+  }
+  return 0;
+}
@@ -0,0 +1,234 @@
+/**
+ * Play a pulse capture back through the cutoff rules.
+ *
+ * Every pulse in the capture goes through the same rules the daemon
+ * runs, set up from the config file and the same command line limits
+ * as waterfuse takes, as fast as it can be read, so an incident can be
+ * gone over again and limits tried out against what really flowed.
+ * Cutoffs are printed as they happen, and with -s every flow session
+ * as it ends.  A zone that has been cut off is taken as reset once its
+ * flow has stopped for reset_period, which is what someone would have
+ * had to do for the capture to carry on.  Schedule entries change
+ * over at the time of day of the pulse that finds one due.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "zone.h"
+#include "config.h"
+#include "capture.h"
+
+#define NS 1000000000LL
+
+struct replay {
+  time_t change;      // When the next schedule entry takes over, 0 for never
+  uint32_t step;      // Part of a microlitre carried over, CAL_FRAC bits
+  int triggered;
+  int64_t last;       // Latest pulse, ns
+  uint64_t pulses;
+  uint64_t volume;    // Microlitres
+  uint64_t sessions;
+  uint64_t most;      // Largest session, microlitres
+  int64_t longest;    // Longest session, seconds
+  unsigned int cutoffs;
+};
+
+struct zones zones;
+struct replay replay[MAX_ZONES];
+int sessions = 0; // Print every session
+
+void
+printWhen(int64_t ns, int z) {
+  char buf[32];
+  struct tm parts;
+  time_t t = ns / NS;
+
+  localtime_r(&t, &parts);
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &parts);
+  printf("%s %-*s ", buf, ZONE_NAME - 1, zones.config[z].name);
+}
+
+/**
+ * The zone's flow session has come to an end, or been cut off.
+ */
+void
+endSession(int z, const char * what, int reason) {
+  struct flow_window * flow = &zones.flow[z];
+  struct replay * rp = &replay[z];
+  int64_t secs = flow->last - flow->first;
+
+  rp->sessions++;
+  if (flow->session > rp->most) {
+    rp->most = flow->session;
+  }
+  if (secs > rp->longest) {
+    rp->longest = secs;
+  }
+  if (reason || sessions) {
+    printWhen(rp->last, z);
+    printf("%-8s %-7s %8.1f L %6lld s\n", what, stop_msg[reason], (double)flow->session / CAL_UL, (long long)secs);
+  }
+}
+
+/**
+ * Put count pulses on zone z at ts through its rules, as one with its
+ * time if count is 1 and as dropped ones otherwise.
+ */
+void
+feed(int z, int64_t ts, uint64_t count, int timed) {
+  struct flow_window * flow = &zones.flow[z];
+  struct replay * rp = &replay[z];
+  uint64_t volume;
+  int reason;
+
+  if (rp->change && ts / NS >= rp->change) {
+    rp->change = zoneSchedule(&zones, z, ts / NS);
+    zoneRules(&zones, z);
+  }
+  if (rp->triggered && ts / NS - rp->last / NS > zones.config[z].reset_period) {
+    rp->triggered = 0;
+    fwReset(flow);
+  } else if (!rp->triggered && flow->counting && ts / NS - flow->last > flow->gap) {
+    endSession(z, "session", 0);
+  }
+  if (timed) {
+    reason = zonePulse(&zones, z, ts, &rp->step);
+    volume = rp->step >> CAL_FRAC;
+  } else {
+    reason = zoneDropped(&zones, z, count, ts, &rp->step, &volume);
+  }
+  rp->pulses += count;
+  rp->volume += volume;
+  rp->last = ts;
+  if (reason && !rp->triggered) {
+    rp->triggered = 1;
+    rp->cutoffs++;
+    endSession(z, "cutoff", reason);
+  }
+}
+
+int
+main(int argc, char **argv) {
+  const char * config_file = CONFIG_FILE, * path = CAPTURE_FILE;
+  struct capture_reader r;
+  struct capture_event ev;
+  struct config cfg;
+  struct replay * rp;
+  int64_t to_real;
+  int litres = -1, cpl = -1, minutes = -1, reset = -1;
+  int opt, z, i, started[MAX_ZONES] = { 0 };
+
+  while ((opt = getopt(argc, argv, "f:l:c:t:r:s")) != -1) {
+    switch (opt) {
+      case 'f':
+        config_file = optarg;
+	break;
+      case 'l':
+        litres = atoi(optarg);
+	break;
+      case 'c':
+        cpl = atoi(optarg);
+	break;
+      case 't':
+        minutes = atoi(optarg);
+	break;
+      case 'r':
+        reset = atoi(optarg);
+	break;
+      case 's':
+        sessions = 1;
+	break;
+      default:
+        fprintf(stderr, "Usage: %s [-f config] [-l litres] [-c clicks] [-t minutes] [-r seconds] [-s] [capture]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind < argc) {
+    path = argv[optind];
+  }
+
+  // Limits go over the config just as they do for the daemon
+  if (configLoad(config_file, &cfg) < 0) {
+    fprintf(stderr, "Unable to use config: %s\n", cfg.error);
+    return 1;
+  }
+  for (z = 0; z < cfg.count; z++) {
+    if (litres >= 0) {
+      cfg.zone[z].max_litres = litres;
+      for (i = 0; i < cfg.zone[z].schedule_count; i++) {
+        cfg.zone[z].schedule[i].max_litres = litres;
+      }
+    }
+    if (cpl >= 0) {
+      cfg.zone[z].clicks_per_litre = cpl;
+    }
+    if (minutes >= 0) {
+      cfg.zone[z].time_limit = minutes * 60;
+      for (i = 0; i < cfg.zone[z].schedule_count; i++) {
+        cfg.zone[z].schedule[i].time_limit = minutes * 60;
+      }
+    }
+    if (reset >= 0) {
+      cfg.zone[z].reset_period = reset;
+    }
+  }
+  if (configCheck(&cfg) < 0) {
+    fprintf(stderr, "Unable to use config: %s\n", cfg.error);
+    return 1;
+  }
+  if (captureReadOpen(&r, path) < 0) {
+    fprintf(stderr, "Unable to read capture %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (r.header.zones > cfg.count) {
+    fprintf(stderr, "%s has %d zones, the config only %d\n", path, r.header.zones, cfg.count);
+    return 1;
+  }
+  zones.count = cfg.count;
+  memcpy(zones.config, cfg.zone, sizeof(cfg.zone));
+
+  // Everything goes by the wall clock, which carries on from one
+  // segment to the next where the monotonic clock doesn't
+  to_real = r.header.realtime - r.header.monotonic;
+  do {
+    switch (captureRead(&r, &ev)) {
+      case CAP_SEGMENT:
+        // The daemon was restarted, and the rate starts again with it
+        to_real = r.header.realtime - r.header.monotonic;
+        for (z = 0; z < zones.count; z++) {
+          rateInit(&zones.rate[z]);
+        }
+	break;
+      case CAP_PULSE:
+      case CAP_DROPPED:
+        z = ev.zone;
+        if (!started[z]) {
+          fwInit(&zones.flow[z], (ev.ts + to_real) / NS, zones.config[z].reset_period);
+          rateInit(&zones.rate[z]);
+          replay[z].change = zoneSchedule(&zones, z, (ev.ts + to_real) / NS);
+          if (zoneRules(&zones, z) < 0) {
+            fprintf(stderr, "%s: window_minutes %d is longer than we keep history for\n", zones.config[z].name, zones.config[z].window_minutes);
+          }
+          started[z] = 1;
+        }
+        feed(z, ev.ts + to_real, ev.count, ev.kind == CAP_PULSE);
+	break;
+    }
+  } while (ev.kind != CAP_END);
+  captureReadClose(&r);
+
+  for (z = 0; z < zones.count; z++) {
+    rp = &replay[z];
+    if (started[z] && !rp->triggered && zones.flow[z].counting) {
+      endSession(z, "session", 0);
+    }
+    printf("%s: %llu pulses, %.1f L, %llu sessions, largest %.1f L, longest %lld s, %u cutoffs\n", zones.config[z].name,
+      (unsigned long long)rp->pulses, (double)rp->volume / CAL_UL, (unsigned long long)rp->sessions,
+      (double)rp->most / CAL_UL, (long long)rp->longest, rp->cutoffs);
+  }
+
+  return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * Print the live counters from a running waterfuse.
+ *
+ * Maps the telemetry segment read-only and takes a consistent copy,
+ * once or, with -w, every interval seconds.  -s reads the simulator's
+ * segment instead.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+
+void
+showHist(const char * name, const struct hist * h) {
+  printf("%s_us: count %llu, p50 %.1f, p99 %.1f, max %.1f\n", name,
+    (unsigned long long)h->count, histPercentile(h, 50) / 1e3,
+    histPercentile(h, 99) / 1e3, h->max / 1e3);
+}
+
+void
+showZone(const struct telemetry_zone * z) {
+  printf("zone: %.*s\n", ZONE_NAME, z->name);
+  printf("litres: %.3f\n", z->volume / 1e6);
+  printf("total_clicks: %llu\n", (unsigned long long)z->total_clicks);
+  printf("total_litres: %.3f\n", z->total_volume / 1e6);
+  printf("flow_rate: %.3f\n", z->flow_rate / 1000.0);
+  printf("triggered: %d\n", z->triggered);
+  printf("counting: %d\n", z->counting);
+  printf("stop_reason: %s\n", z->stop_reason < STOP_REASONS ? (z->stop_reason ? stop_msg[z->stop_reason] : "none") : "?");
+  printf("reset_reason: %s\n", z->reset_reason < RESET_REASONS ? (z->reset_reason ? reset_msg[z->reset_reason] : "none") : "?");
+  printf("alarmed: %d\n", z->alarmed);
+  printf("cutoffs: %u\n", z->cutoffs);
+}
+
+void
+showTelemetry(const struct telemetry * t) {
+  unsigned int i;
+
+  printf("pid: %u\n", t->pid);
+  printf("updated: %lld\n", (long long)(t->updated / 1000000000LL));
+  for (i = 0; i < t->zones && i < MAX_ZONES; i++) {
+    showZone(&t->zone[i]);
+  }
+  printf("loops: %llu\n", (unsigned long long)t->loops);
+  printf("loop_last_us: %.1f\n", t->loop_last / 1000.0);
+  printf("loop_max_us: %.1f\n", t->loop_max / 1000.0);
+  if (t->loops) {
+    printf("loop_avg_us: %.1f\n", (double)t->loop_total / t->loops / 1000.0);
+  }
+  printf("lag_max_us: %.1f\n", t->lag_max / 1000.0);
+  printf("backlog_max: %u\n", t->backlog_max);
+  printf("stalls: %u\n", t->stalls);
+  showHist("loop", &t->loop_hist);
+  showHist("delivery", &t->delivery_hist);
+  showHist("log", &t->log_hist);
+  showHist("state", &t->state_hist);
+  showHist("relay", &t->relay_hist);
+}
+
+int
+main(int argc, char **argv) {
+  const struct telemetry * live;
+  struct telemetry copy;
+  struct stat st;
+  const char * name = TELEMETRY_NAME;
+  int interval = 0;
+  int opt, fd;
+
+  while ((opt = getopt(argc, argv, "w:s")) != -1) {
+    switch (opt) {
+      case 'w':
+        interval = atoi(optarg);
+	break;
+      case 's':
+        name = TELEMETRY_SIM_NAME;
+	break;
+      default:
+        fprintf(stderr, "Usage: %s [-s] [-w interval]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+    fprintf(stderr, "Unable to open telemetry: %s\n", strerror(errno));
+    return 1;
+  }
+  // Reading past the end of a short one would be a SIGBUS
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*live)) {
+    fprintf(stderr, "Telemetry segment is too small to be one we understand\n");
+    return 1;
+  }
+  live = mmap(NULL, sizeof(*live), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (live == MAP_FAILED) {
+    fprintf(stderr, "Unable to map telemetry: %s\n", strerror(errno));
+    return 1;
+  }
+  if (live->magic != TELEMETRY_MAGIC || live->version != TELEMETRY_VERSION) {
+    fprintf(stderr, "Telemetry segment is not one we understand\n");
+    return 1;
+  }
+
+  do {
+    telemetryRead(live, &copy);
+    showTelemetry(&copy);
+    if (interval > 0) {
+      printf("\n");
+      fflush(stdout);
+      sleep(interval);
+    }
+  } while (interval > 0);
+
+  return 0;
+}
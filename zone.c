@@ -0,0 +1,132 @@
+/**
+ * The cutoff rules for a zone, see zone.h.
+ *
+ * This is everything between a pulse timestamp and the reason it cuts
+ * a zone off, kept apart from the loop so that wfreplay can put a
+ * capture through exactly what the daemon would have done with it.
+ */
+#include <time.h>
+#include "zone.h"
+
+#define NS 1000000000LL
+
+const char * stop_msg[STOP_REASONS] = {
+  [STOP_NONE] = "",
+  [STOP_VOLUME] = "volume",
+  [STOP_TIME] = "time",
+  [STOP_WINDOW] = "window",
+  [STOP_RATE] = "rate",
+  [STOP_SIGNAL] = "signal",
+  [STOP_CONTROL] = "control",
+  [STOP_BUTTON] = "button",
+  [STOP_PRESSURE] = "pressure",
+  [STOP_STALLED] = "stalled",
+  [STOP_METER] = "meter"
+};
+const char * reset_msg[RESET_REASONS] = {
+  [RESET_NONE] = "",
+  [RESET_BUTTON] = "button",
+  [RESET_SIGNAL] = "signal",
+  [RESET_CONTROL] = "control"
+};
+
+/**
+ * Turn a zone's limits into flow accounting rules.  The time limit goes
+ * first so that it is the reason given when both trip together.
+ * The schedule entry in force, if there is one, has the say over
+ * max_litres and time_limit.  Returns -1 if the window rule can't be
+ * held, and is left out.
+ */
+int
+zoneRules(struct zones * zs, int z) {
+  struct flow_window * flow = &zs->flow[z];
+  struct zone_config * c = &zs->config[z];
+  int err = 0, max_litres = c->max_litres, time_limit = c->time_limit;
+
+  if (zs->period[z] >= 0 && zs->period[z] < c->schedule_count) {
+    max_litres = c->schedule[zs->period[z]].max_litres;
+    time_limit = c->schedule[zs->period[z]].time_limit;
+  }
+  calBuild(&zs->cal[z], c->clicks_per_litre, c->cal, c->cal_points);
+  flow->gap = c->reset_period;
+  fwSetRule(flow, 0, FW_CONTINUOUS, 0, time_limit, STOP_TIME);
+  fwSetRule(flow, 1, FW_VOLUME, (uint64_t)(max_litres + 1) * CAL_UL, 0, STOP_VOLUME);
+  if (c->window_litres > 0 && c->window_minutes > 0) {
+    if (fwSetRule(flow, 2, FW_VOLUME, (uint64_t)(c->window_litres + 1) * CAL_UL, c->window_minutes * 60, STOP_WINDOW) < 0) {
+      fwSetRule(flow, 2, FW_NONE, 0, 0, 0);
+      err = -1;
+    }
+  } else {
+    fwSetRule(flow, 2, FW_NONE, 0, 0, 0);
+  }
+  // Rate goes by the gaps between pulses, not the flow window
+  zs->rate_gap[z] = calRateGap(&zs->cal[z], c->max_rate);
+  return err;
+}
+
+/**
+ * Put the schedule entry in force at wall clock time t in period,
+ * returning when the next one takes over, or 0 if the zone has no
+ * schedule.  Rules are left for zoneRules() to make.
+ */
+time_t
+zoneSchedule(struct zones * zs, int z, time_t t) {
+  const struct zone_config * c = &zs->config[z];
+  struct tm parts;
+  time_t when;
+  int secs, i;
+
+  if (c->schedule_count == 0) {
+    zs->period[z] = -1;
+    return 0;
+  }
+  localtime_r(&t, &parts);
+  secs = parts.tm_hour * 3600 + parts.tm_min * 60 + parts.tm_sec;
+  for (i = 0; i < c->schedule_count && c->schedule[i].at <= secs; i++)
+    ;
+  // Before the first of the day it is still yesterday's last
+  zs->period[z] = (i + c->schedule_count - 1) % c->schedule_count;
+  parts.tm_hour = parts.tm_min = 0;
+  parts.tm_sec = i < c->schedule_count ? c->schedule[i].at : c->schedule[0].at + 86400;
+  parts.tm_isdst = -1;
+  // mktime() sorts out tomorrow, and the clocks going forward or back
+  when = mktime(&parts);
+  return when > t ? when : t + 1;
+}
+
+/**
+ * Account for a pulse at ts.  step carries the part of a microlitre
+ * left over from the last one and comes back with this pulse's volume
+ * added, << CAL_FRAC.  Returns the reason for the rule it trips, 0 for
+ * none.
+ */
+int
+zonePulse(struct zones * zs, int z, int64_t ts, uint32_t * step) {
+  struct flow_rate * rate = &zs->rate[z];
+  int64_t gap;
+  int reason;
+
+  rateAdd(rate, ts);
+  gap = rateGap(rate, ts);
+  *step = (*step & ((1 << CAL_FRAC) - 1)) + calStep(&zs->cal[z], gap);
+  reason = fwAdd(&zs->flow[z], ts / NS, *step >> CAL_FRAC);
+  if (!reason && zs->rate_gap[z] && gap && gap < zs->rate_gap[z]) {
+    reason = STOP_RATE;
+  }
+  return reason;
+}
+
+/**
+ * Account for n pulses that came in by ts without their own times, at
+ * the rate we are going at then.  frac is carried over as for
+ * zonePulse(), and *volume is what they came to in microlitres.
+ */
+int
+zoneDropped(struct zones * zs, int z, uint64_t n, int64_t ts, uint32_t * frac, uint64_t * volume) {
+  uint64_t dropped;
+
+  dropped = n * calStep(&zs->cal[z], rateGap(&zs->rate[z], ts)) + (*frac & ((1 << CAL_FRAC) - 1));
+  *frac = dropped & ((1 << CAL_FRAC) - 1);
+  *volume = dropped >> CAL_FRAC;
+  return fwAdd(&zs->flow[z], ts / NS, *volume);
+}
@@ -0,0 +1,124 @@
+/**
+ * Zones, each a flow meter, the relay for its pump and its own limits.
+ *
+ * The state the loop looks at on every pass is kept as a struct of
+ * arrays, so walking all the zones for their trip state touches a
+ * line or two rather than striding over each zone's flow history.
+ * Settings are only read when rules are made or the config changes,
+ * so they stay as a plain struct per zone.  What a pulse does to a
+ * zone's rules is in zone.c, shared with wfreplay, and so are the names
+ * of the reasons a zone is stopped and started, which every tool that
+ * shows them links in.
+ */
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "flowwindow.h"
+#include "flowrate.h"
+#include "calibration.h"
+
+#define MAX_ZONES 4
+#define ZONE_NAME 16
+#define SCHEDULE_MAX 8  // Times of day a zone's limits can change at
+
+/**
+ * Why a zone was cut off, which is kept with it, sent out with it and
+ * written to the history, so new ones only ever go on the end.
+ */
+enum stop_reason {
+  STOP_NONE,
+  STOP_VOLUME,    // max_litres this session
+  STOP_TIME,      // Flowing longer than time_limit
+  STOP_WINDOW,    // window_litres in window_minutes
+  STOP_RATE,      // Faster than max_rate
+  STOP_SIGNAL,    // SIGCONT
+  STOP_CONTROL,   // A stop on the control socket
+  STOP_BUTTON,    // Long press
+  STOP_PRESSURE,  // Fall of pressure_drop
+  STOP_STALLED,   // The loop got stuck and the health monitor failed safe
+  STOP_METER,     // The flow meter's line was lost, nothing is being counted
+  STOP_REASONS    // Entries in stop_msg
+};
+
+/**
+ * What turned a zone back on, kept in the same places.
+ */
+enum reset_reason {
+  RESET_NONE,
+  RESET_BUTTON,
+  RESET_SIGNAL,   // SIGUSR1
+  RESET_CONTROL,  // A reset on the control socket
+  RESET_REASONS   // Entries in reset_msg
+};
+
+/**
+ * Limits from a time of day until the next entry's, the last of the
+ * day carrying on over midnight.
+ */
+struct schedule_entry {
+  int at;             // Seconds after local midnight
+  int max_litres;
+  int time_limit;     // Seconds
+};
+
+struct zone_config {
+  char name[ZONE_NAME];
+  int clicks_per_litre;
+  int max_litres;
+  int reset_period;
+  int time_limit;     // Seconds
+  int window_litres;  // Optional limit on litres in any window_minutes
+  int window_minutes;
+  int max_rate;       // Litres a minute that cut off straight away, 0 for no limit
+  int leak_rate;      // Millilitres a minute that are no more than a leak, 0 for no alarm
+  int leak_hours;     // How long a leak has to go on for before the alarm
+  int flow_pin;
+  int relay_pin;
+  int button_pin;     // Zones may share one
+  int gpio_line;      // Use the GPIO character device rather than the hal, -1 not to
+  int pressure_pin;   // ADC input for the pressure sensor
+  int pressure_drop;  // Fall in pressure that cuts off straight away, 0 for no limit
+  int pressure_window; // Seconds the fall has to happen within
+  int cal_points;     // Calibration points, none to go by clicks_per_litre alone
+  struct cal_point cal[CAL_POINTS];
+  int schedule_count; // Sorted by time, none to go by max_litres and time_limit alone
+  struct schedule_entry schedule[SCHEDULE_MAX];
+};
+
+struct zones {
+  int count;
+  // Looked at every pass
+  uint8_t triggered[MAX_ZONES];
+  uint8_t stop_reason[MAX_ZONES];
+  uint8_t reset_reason[MAX_ZONES];
+  uint8_t alarmed[MAX_ZONES];
+  int64_t trip_stamp[MAX_ZONES]; // Pulse that tripped the rule we are cutting off for
+  int64_t rate_gap[MAX_ZONES];   // Gap between pulses (ns) that max_rate works out at
+  double flow_rate[MAX_ZONES];   // Litres per minute, from the gaps between pulses
+  uint64_t total_clicks[MAX_ZONES];
+  uint64_t total_volume[MAX_ZONES];  // Microlitres
+  uint32_t volume_frac[MAX_ZONES];   // Part of a microlitre carried over, CAL_FRAC bits
+  uint32_t cutoffs[MAX_ZONES];
+  int8_t period[MAX_ZONES];      // Schedule entry in force, -1 for none
+  // Since we started, for the metrics
+  uint32_t cutoff_count[MAX_ZONES][STOP_REASONS];
+  uint32_t reset_count[MAX_ZONES][RESET_REASONS];
+  // Settings
+  struct zone_config config[MAX_ZONES];
+  // Bulk
+  struct calibration cal[MAX_ZONES];
+  struct flow_rate rate[MAX_ZONES];
+  struct flow_window flow[MAX_ZONES];
+};
+
+extern const char * stop_msg[STOP_REASONS];
+extern const char * reset_msg[RESET_REASONS];
+
+int zoneRules(struct zones * zs, int z);
+time_t zoneSchedule(struct zones * zs, int z, time_t t);
+int zonePulse(struct zones * zs, int z, int64_t ts, uint32_t * step);
+int zoneDropped(struct zones * zs, int z, uint64_t n, int64_t ts, uint32_t * frac, uint64_t * volume);
+
+#endif